@@ -12,6 +12,20 @@
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * Block size. SFS_BLOCKSIZE is the traditional size, and the unit in
+ * which the superblock and an inode are read: a volume with larger
+ * blocks (sp_blocksize, a power of two up to SFS_MAXBLOCKSIZE) keeps
+ * them at the start of their block. The per-block counts below are for
+ * SFS_BLOCKSIZE; the macros taking BS are for any block size.
+ */
+#define SFS_MAXBLOCKSIZE   65536
+#define SFS_DENTRIES(bs)   ((bs) / sizeof(struct sfs_dir))  /* dir entries */
+#define SFS_PTRS(bs)       ((bs) / sizeof(u_int32_t))       /* block #s */
+#define SFS_BITS(bs)       ((bs) * CHAR_BIT)                /* freemap bits */
+#define SFS_MAXDENTRIES    SFS_DENTRIES(SFS_MAXBLOCKSIZE)
+#define SFS_MAXPTRS        SFS_PTRS(SFS_MAXBLOCKSIZE)
+
 /* Number of directory entry in a block */
 #define SFS_DENTRYPERBLOCK (SFS_BLOCKSIZE/sizeof(struct sfs_dir))
 
@@ -39,7 +53,35 @@ struct sfs_super {
 	u_int32_t sp_magic;       /* Magic number, should be SFS_MAGIC */
 	u_int32_t sp_nblocks;     /* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];  /* Name of this volume */
-	u_int32_t reserved[118];
+	u_int32_t sp_features;    /* SFS_FEAT_* flags below */
+	u_int32_t sp_nfree;       /* Number of free blocks (SFS_FEAT_FREECOUNT) */
+	u_int32_t sp_allochint;   /* Block to resume allocation at */
+	u_int32_t sp_blocksize;   /* Bytes per block, 0 for SFS_BLOCKSIZE */
+	u_int32_t sp_jstart;      /* First block of the journal (SFS_FEAT_JOURNAL) */
+	u_int32_t sp_jblocks;     /* ...and its length */
+	u_int32_t reserved[112];
+};
+
+/* Superblock feature flags for sp_features */
+#define SFS_FEAT_FREECOUNT 0x1    /* sp_nfree and sp_allochint are kept */
+#define SFS_FEAT_HASHDIR   0x2    /* some directories are hashed */
+#define SFS_FEAT_EXTENTS   0x4    /* new files are extent mapped */
+#define SFS_FEAT_JOURNAL   0x8    /* metadata writes go through a journal */
+
+/* Inode flags for sfi_flags */
+#define SFS_IFLAG_HASHDIR  0x1    /* directory entries are hashed, see below */
+#define SFS_IFLAG_EXTENTS  0x2    /* data is mapped by sfi_extent[] */
+
+#define SFS_NEXTENT        32     /* # of extents in an extent-mapped inode */
+
+/*
+ * A run of contiguous data blocks. The extents of an inode cover the
+ * file in order: extent i holds the blocks following those of extent
+ * i-1, so only the physical start and length are stored.
+ */
+struct sfs_extent {
+	u_int32_t se_start;       /* First block of the run */
+	u_int32_t se_len;         /* Number of blocks */
 };
 
 /*
@@ -51,7 +93,13 @@ struct sfs_inode {
 	u_int16_t sfi_linkcount;   /* Number of hard links to this file */ /* Unused in our hw */
 	u_int32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	u_int32_t sfi_indirect;			/* Indirect block */
-	u_int32_t sfi_waste[128-3-SFS_NDIRECT]; /* unused space */
+	u_int32_t sfi_flags;			/* SFS_IFLAG_* */
+	u_int32_t sfi_hashdepth;		/* Hashed directory: global depth */
+	u_int32_t sfi_nextent;			/* Extent mapped: extents in use */
+	struct sfs_extent sfi_extent[SFS_NEXTENT]; /* ...and the extents */
+	u_int32_t sfi_dindirect;		/* Double indirect block */
+	u_int32_t sfi_tindirect;		/* Triple indirect block */
+	u_int32_t sfi_waste[128-8-SFS_NDIRECT-2*SFS_NEXTENT]; /* unused space */
 };
 
 /*
@@ -62,4 +110,87 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];  /* Filename */
 };
 
+/*
+ * Entry type. A name of at most SFS_NAMELEN-2 characters leaves the last
+ * byte of sfd_name free after its NUL; it holds the child's SFS_TYPE_*,
+ * so a directory can be listed without reading the child inodes. Older
+ * entries and longer names have SFS_TYPE_INVAL there.
+ */
+#define SFS_DTYPE_OFF     (SFS_NAMELEN-1)
+
+/*
+ * Hashed directories (SFS_IFLAG_HASHDIR)
+ *
+ * A directory that outgrows its direct blocks is converted: "." and ".."
+ * stay in sfi_direct[0] and every other entry moves to an extendible
+ * hash. The low sfi_hashdepth bits of a name's hash select one of
+ * 2^sfi_hashdepth bucket pointers; sfi_indirect points to a top index
+ * block listing the leaf index blocks that hold those pointers,
+ * SFS_PTRS(block size) per leaf: 128 on a volume of 512-byte blocks,
+ * 1024 with 4K blocks. Buckets split when full, so several pointers
+ * may share a bucket; a bucket of depth SFS_DIRHASH_MAXDEPTH that fills
+ * up chains overflow blocks instead. A bucket block is a header
+ * followed by entries, so it can be read as an array of sfs_dir with
+ * slot 0 the header.
+ */
+#define SFS_DIRHASH_MAXDEPTH 14   /* 2^14 pointers: 128 leaves at 512 bytes */
+
+struct sfs_dirbucket {
+	u_int32_t sdb_next;             /* Overflow block of this bucket, or 0 */
+	u_int32_t sdb_count;            /* Number of entries in use */
+	u_int32_t sdb_depth;            /* Hash bits shared by the entries */
+	u_int32_t sdb_prefix;           /* ...and their value */
+	char sdb_pad[sizeof(struct sfs_dir) - 4*sizeof(u_int32_t)];
+	struct sfs_dir sdb_ent[SFS_DENTRYPERBLOCK - 1];
+};
+
+/*
+ * Metadata journal (SFS_FEAT_JOURNAL)
+ *
+ * A redo log of whole blocks in sp_jblocks blocks from sp_jstart. The
+ * first block is the header; transactions follow it back to back. A
+ * transaction is any revoke blocks, one or more descriptor blocks, each
+ * followed by the blocks it lists, and a commit block. The commit block
+ * carries the checksum of everything before it in the transaction, so
+ * one that was only partly written is recognised and ignored. Mount
+ * replays transactions numbered from sjh_seq on until the first one
+ * that is missing or damaged; once they have all been written to their
+ * home locations, the header is advanced past them and the log starts
+ * over.
+ *
+ * A revoke block lists blocks that were written in place while the log
+ * still held copies of them: copies from earlier transactions are not
+ * replayed.
+ */
+#define SFS_JMAGIC_HEAD    0x6a686472     /* journal header */
+#define SFS_JMAGIC_DESC    0x6a646573     /* descriptor block */
+#define SFS_JMAGIC_COMMIT  0x6a636d74     /* commit block */
+#define SFS_JMAGIC_REVOKE  0x6a72766b     /* revoke block */
+#define SFS_JMINBLOCKS     16             /* smallest journal */
+
+/*
+ * sfs_mkfs makes journals of at least SFS_JOPBLOCKS plus one block per
+ * freemap block, room for any one operation but an insert into a very
+ * deep hashed directory; those fail up front in a journal too small.
+ */
+#define SFS_JOPBLOCKS      32
+
+struct sfs_jheader {
+	u_int32_t sjh_magic;            /* SFS_JMAGIC_HEAD */
+	u_int32_t sjh_seq;              /* First transaction in the log */
+};
+
+/*
+ * Descriptor, revoke and commit block header. In a descriptor, the home
+ * block numbers of the sjd_count blocks that follow fill the rest of
+ * the block; in a revoke block, those of the sjd_count blocks revoked.
+ * A commit block has sjd_count 0.
+ */
+struct sfs_jdesc {
+	u_int32_t sjd_magic;            /* SFS_JMAGIC_DESC, _REVOKE or _COMMIT */
+	u_int32_t sjd_seq;              /* Transaction number */
+	u_int32_t sjd_count;            /* Blocks described */
+	u_int32_t sjd_sum;              /* Commit: checksum of the transaction */
+};
+
 #endif /* _SFS_H_ */
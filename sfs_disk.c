@@ -1,103 +1,2257 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <err.h>
 
+/*
+ * io_uring is used through the raw system calls, so no library is
+ * needed; build with -DDISK_NO_URING to use the thread pool only.
+ */
+#if defined(__linux__) && !defined(DISK_NO_URING) && \
+    __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define DISK_URING
+#endif
+
 #include "sfs_types.h"
+#include "sfs.h"
 #include "sfs_disk.h"
 
-#define BLOCKSIZE  512
+#define DEFAULT_BLOCKSIZE  512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
-static int fd=-1;
+/*
+ * Write-back buffer cache.
+ *
+ * A fixed pool of block buffers sits in front of the image. Lookups go
+ * through a small hash on the block number; replacement is CLOCK (second
+ * chance). Dirty buffers are written when they are evicted, on
+ * disk_sync() and on disk_close().
+ */
+#define CACHE_NBUF   256		/* # of cached blocks */
+#define CACHE_NHASH  64			/* # of hash chains, power of 2 */
+#define CACHE_HASH(b) ((b) & (CACHE_NHASH-1))
+
+#define MAX_IOV      64			/* max blocks per vectored syscall */
+
+struct buf {
+	u_int32_t b_block;		/* block number, valid if b_valid */
+	int b_valid;			/* holds a block */
+	int b_dirty;			/* differs from the image */
+	int b_ref;			/* CLOCK reference bit */
+	int b_busy;			/* being read ahead through b_io */
+	struct buf *b_hnext;		/* next buffer on the hash chain */
+	char *b_data;			/* blocksize bytes in d_bufdata */
+	struct disk_io b_io;
+};
+
+/*
+ * Asynchronous reads.
+ *
+ * disk_aread() and disk_prefetch() hand reads to an engine and return;
+ * disk_await(), or the first disk_read() of a prefetched block, waits for
+ * them. The engine is an io_uring when the kernel has one: a batch of
+ * reads is queued on the submission ring and started with a single
+ * io_uring_enter(), and completions are reaped by whichever waiter
+ * gets there first. Otherwise AIO_NTHREADS threads run the reads with
+ * preadv(). A read that comes back short is redone synchronously by
+ * the waiter, so the engines only have to be fast, not thorough.
+ *
+ * Prefetched blocks go into cache buffers marked busy; at most
+ * AIO_MAXBUSY of them at a time, so the cache always has room.
+ */
+#define AIO_NTHREADS	4
+#define AIO_RING	64		/* submission ring entries */
+#define AIO_MAXBUSY	(CACHE_NBUF / 2)
+
+#ifdef DISK_URING
+struct uring {
+	int ur_fd;
+	unsigned *ur_sqhead, *ur_sqtail, *ur_sqarray;
+	unsigned ur_sqmask, ur_sqentries;
+	struct io_uring_sqe *ur_sqes;
+	unsigned *ur_cqhead, *ur_cqtail;
+	unsigned ur_cqmask, ur_cqentries;
+	struct io_uring_cqe *ur_cqes;
+	void *ur_sqmap, *ur_cqmap;	/* the rings, as mapped */
+	size_t ur_sqsize, ur_cqsize;
+};
+#endif
+
+struct aio {
+	pthread_mutex_t a_lock;
+	pthread_cond_t a_done;		/* a read completed */
+	int a_uring;			/* using the ring, not the threads */
+#ifdef DISK_URING
+	struct uring a_ring;
+	unsigned a_inflight;		/* submitted, not reaped */
+	int a_reaping;			/* a waiter is in io_uring_enter() */
+#endif
+	pthread_cond_t a_work;		/* thread pool: queue not empty */
+	struct disk_io *a_head, *a_tail;
+	int a_quit;
+	int a_nthreads;
+	pthread_t a_threads[AIO_NTHREADS];
+};
+
+/*
+ * Metadata journal.
+ *
+ * Once disk_journal_open() has found a journal, single-block writes --
+ * disk_write() and disk_write_part(), which the file system uses for all of
+ * its metadata -- no longer go to their home locations. The new
+ * contents go to the log set, a table of every block written since the
+ * journal was last emptied, and cached copies are refreshed; reads look
+ * in the cache, then the log set, then the image.
+ *
+ * Each operation is bracketed by disk_tx_begin() and disk_tx_end(). The
+ * first is told how many blocks the operation may journal and admits it
+ * only when that fits in the journal on top of the operations already
+ * in progress, so a transaction never has to be cut short: one that
+ * does not fit waits for them to end, and one larger than the journal
+ * is refused. The operations since the last commit form the running
+ * transaction, which is committed after JOURNAL_GROUP of them (group
+ * commit), or once it is half the size of the journal, at a moment when
+ * none is in progress: its blocks are appended to the journal and made
+ * durable with one flush. disk_tx_hold() puts group commits off for a
+ * while. When the journal is getting full, the log set is checkpointed:
+ * written home, flushed, and the journal emptied.
+ *
+ * Multi-block writes, which carry file data, still go straight home, as
+ * do disk_write_new()s of metadata blocks that nothing committed refers
+ * to yet; they are flushed with the transaction that makes them
+ * reachable. If one lands on a block that is in the log set (freed
+ * metadata reused), the copy there is dropped, and the running
+ * transaction revokes any committed one so that a replay does not bring
+ * it back. The file system does not reuse a freed block before the
+ * transaction that frees it is committed (disk_tx_seq()), so such a
+ * write never overwrites data that a crash would make reachable again.
+ */
+#define JOURNAL_GROUP	32		/* operations per group commit */
+
+struct jblock {
+	u_int32_t jb_block;		/* home location */
+	int jb_running;			/* changed since the last commit */
+	int jb_logged;			/* has a committed copy in the journal */
+	struct jblock *jb_hnext;	/* hash chain, or free list */
+	char *jb_data;			/* blocksize bytes in jl_data */
+};
+
+struct journal {
+	u_int32_t jl_start;		/* journal header block, 0 if none */
+	u_int32_t jl_room;		/* blocks after the header */
+	u_int32_t jl_used;		/* ...holding committed transactions */
+	u_int32_t jl_seq;		/* number of the next transaction */
+	u_int32_t jl_ndesc;		/* block numbers per descriptor */
+	u_int32_t jl_txmax;		/* most blocks in one transaction */
+	u_int32_t jl_rmax;		/* revoke blocks one may need */
+	u_int32_t jl_ops;		/* operations since the last commit */
+	u_int32_t jl_active;		/* operations in progress */
+	u_int32_t jl_resv;		/* ...and the blocks they may journal */
+	int jl_force;			/* commit once they have ended */
+	u_int32_t jl_hold;		/* holds on group commit */
+	pthread_cond_t jl_done;		/* an operation ended */
+
+	struct jblock *jl_blocks;	/* log set, jl_room entries */
+	char *jl_data;
+	struct jblock **jl_hash;
+	u_int32_t jl_nhash;		/* power of 2 */
+	struct jblock *jl_free;
+	u_int32_t jl_count;		/* entries in use */
+	struct jblock **jl_run;		/* running transaction, jl_room */
+	u_int32_t jl_nrun;
+	u_int32_t *jl_rev;		/* ...blocks it revokes, jl_room */
+	u_int32_t jl_nrev;
+	char *jl_desc;			/* descriptor and commit blocks */
+};
+
+/*
+ * An open image. Every entry point takes d_lock, so one image can be
+ * used from several threads; bulk data transfers drop it around the
+ * system call.
+ */
+struct disk {
+	int d_fd;
+	u_int32_t d_blocksize;		/* DEFAULT_BLOCKSIZE until set */
+
+	/* Mapped backend: the whole image, or NULL when caching */
+	char *d_map;
+	size_t d_mapsize;
+	u_int32_t d_mapnblocks;
+
+	struct buf d_bufs[CACHE_NBUF];
+	char *d_bufdata;		/* CACHE_NBUF blocks of buffer space */
+	struct buf *d_bhash[CACHE_NHASH];
+	unsigned d_hand;		/* CLOCK hand */
+	struct disk_stats d_stats;
 
+	struct journal d_jl;
+	pthread_mutex_t d_lock;
+
+	struct aio d_aio;
+	u_int32_t d_nbusy;		/* buffers being read ahead */
+};
+
+/*
+ * Positional I/O on the image. A single call moves a run of contiguous
+ * blocks described by an iovec list; short transfers are resumed.
+ */
+static
 void
-disk_open(const char *path)
+raw_io(struct disk *d, int iswrite, struct iovec *iov, int iovcnt,
+       u_int32_t block)
 {
-	assert(fd<0);
-	fd = open(path, O_RDWR);
+	off_t pos = (off_t)block * d->d_blocksize;
+	ssize_t len;
 
-	if (fd<0) {
-		err(1, "%s", path);
+	while (iovcnt > 0) {
+		if (iswrite) {
+			len = pwritev(d->d_fd, iov, iovcnt, pos);
+		}
+		else {
+			len = preadv(d->d_fd, iov, iovcnt, pos);
+		}
+		if (len < 0) {
+			if (errno==EINTR || errno==EAGAIN) {
+				continue;
+			}
+			err(1, iswrite ? "pwrite" : "pread");
+		}
+		if (len==0) {
+			if (iswrite) {
+				err(1, "write returned 0?");
+			}
+			err(1, "unexpected EOF in mid-sector");
+		}
+		pos += len;
+		while (iovcnt > 0 && (size_t)len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
 	}
 }
 
-u_int32_t
-disk_blocksize(void)
+static
+void
+raw_write(struct disk *d, const void *data, u_int32_t block)
 {
-	assert(fd>=0);
-	return BLOCKSIZE;
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = d->d_blocksize;
+	raw_io(d, 1, &iov, 1, block);
 }
 
+static
 void
-disk_write(const void *data, u_int32_t block)
+raw_read(struct disk *d, void *data, u_int32_t block)
 {
-	const char *cdata = data;
-	u_int32_t tot=0;
-	int len;
+	struct iovec iov;
 
-	assert(fd>=0);
+	iov.iov_base = data;
+	iov.iov_len = d->d_blocksize;
+	raw_io(d, 0, &iov, 1, block);
+}
+
+#ifdef DISK_URING
+static
+int
+uring_setup(struct uring *ur)
+{
+	struct io_uring_params p;
+	int fd;
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+	bzero(&p, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, AIO_RING, &p);
+	if (fd < 0) {
+		return -1;
+	}
+	ur->ur_fd = fd;
+	ur->ur_sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cqsize = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cqsize > ur->ur_sqsize) {
+			ur->ur_sqsize = ur->ur_cqsize;
+		}
+		ur->ur_cqsize = ur->ur_sqsize;
+	}
+	ur->ur_sqmap = mmap(NULL, ur->ur_sqsize, PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sqmap == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->ur_cqmap = ur->ur_sqmap;
+	}
+	else {
+		ur->ur_cqmap = mmap(NULL, ur->ur_cqsize, PROT_READ|PROT_WRITE,
+				    MAP_SHARED|MAP_POPULATE, fd,
+				    IORING_OFF_CQ_RING);
+		if (ur->ur_cqmap == MAP_FAILED) {
+			munmap(ur->ur_sqmap, ur->ur_sqsize);
+			close(fd);
+			return -1;
+		}
+	}
+	ur->ur_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+			   IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		if (ur->ur_cqmap != ur->ur_sqmap) {
+			munmap(ur->ur_cqmap, ur->ur_cqsize);
+		}
+		munmap(ur->ur_sqmap, ur->ur_sqsize);
+		close(fd);
+		return -1;
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
-			if (errno==EINTR || errno==EAGAIN) {
-				continue;
+	ur->ur_sqhead = (unsigned *)((char *)ur->ur_sqmap + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *)((char *)ur->ur_sqmap + p.sq_off.tail);
+	ur->ur_sqarray = (unsigned *)((char *)ur->ur_sqmap + p.sq_off.array);
+	ur->ur_sqmask = *(unsigned *)((char *)ur->ur_sqmap +
+				      p.sq_off.ring_mask);
+	ur->ur_sqentries = p.sq_entries;
+	ur->ur_cqhead = (unsigned *)((char *)ur->ur_cqmap + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *)((char *)ur->ur_cqmap + p.cq_off.tail);
+	ur->ur_cqes = (struct io_uring_cqe *)((char *)ur->ur_cqmap +
+					      p.cq_off.cqes);
+	ur->ur_cqmask = *(unsigned *)((char *)ur->ur_cqmap +
+				      p.cq_off.ring_mask);
+	ur->ur_cqentries = p.cq_entries;
+	return 0;
+}
+
+static
+void
+uring_teardown(struct uring *ur)
+{
+	munmap(ur->ur_sqes, ur->ur_sqentries * sizeof(struct io_uring_sqe));
+	if (ur->ur_cqmap != ur->ur_sqmap) {
+		munmap(ur->ur_cqmap, ur->ur_cqsize);
+	}
+	munmap(ur->ur_sqmap, ur->ur_sqsize);
+	close(ur->ur_fd);
+}
+
+static
+int
+uring_enter(struct uring *ur, unsigned submit, unsigned wait)
+{
+	int n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, ur->ur_fd, submit, wait,
+			    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		err(1, "io_uring_enter");
+	}
+	return n;
+}
+
+/* Mark every read on the completion ring done, return how many; a_lock held */
+static
+unsigned
+uring_reap(struct aio *a)
+{
+	struct uring *ur = &a->a_ring;
+	struct io_uring_cqe *cqe;
+	struct disk_io *io;
+	unsigned head, tail, n;
+
+	head = *ur->ur_cqhead;
+	tail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+	n = tail - head;
+	for (; head != tail; head++) {
+		cqe = &ur->ur_cqes[head & ur->ur_cqmask];
+		io = (struct disk_io *)(uintptr_t)cqe->user_data;
+		io->dio_res = cqe->res;
+		io->dio_done = 1;
+		a->a_inflight--;
+	}
+	__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/*
+ * Wait for some read to complete; a_lock held. One waiter at a time
+ * sleeps in the kernel and reaps for everyone, so no completion can be
+ * taken from under it.
+ */
+static
+void
+uring_progress(struct aio *a)
+{
+	if (a->a_reaping) {
+		pthread_cond_wait(&a->a_done, &a->a_lock);
+		return;
+	}
+	a->a_reaping = 1;
+	if (uring_reap(a) == 0 && a->a_inflight > 0) {
+		pthread_mutex_unlock(&a->a_lock);
+		uring_enter(&a->a_ring, 0, 1);
+		pthread_mutex_lock(&a->a_lock);
+		uring_reap(a);
+	}
+	a->a_reaping = 0;
+	pthread_cond_broadcast(&a->a_done);
+}
+
+static
+void
+uring_submit(struct aio *a, int fd, struct disk_io *list)
+{
+	struct uring *ur = &a->a_ring;
+	struct io_uring_sqe *sqe;
+	struct disk_io *io;
+	unsigned tail, pending = 0;
+
+	for (io = list; io != NULL; io = io->dio_qnext) {
+		while (a->a_inflight + pending >= ur->ur_cqentries) {
+			if (pending > 0) {
+				uring_enter(ur, pending, 0);
+				pending = 0;
 			}
-			err(1, "write");
+			uring_progress(a);
 		}
-		if (len==0) {
-			err(1, "write returned 0?");
+		tail = *ur->ur_sqtail;
+		if (tail - __atomic_load_n(ur->ur_sqhead, __ATOMIC_ACQUIRE) ==
+		    ur->ur_sqentries) {
+			uring_enter(ur, pending, 0);
+			pending = 0;
+		}
+		sqe = &ur->ur_sqes[tail & ur->ur_sqmask];
+		bzero(sqe, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)&io->dio_iov;
+		sqe->len = 1;
+		sqe->off = io->dio_off;
+		sqe->user_data = (uintptr_t)io;
+		ur->ur_sqarray[tail & ur->ur_sqmask] = tail & ur->ur_sqmask;
+		__atomic_store_n(ur->ur_sqtail, tail + 1, __ATOMIC_RELEASE);
+		pending++;
+		a->a_inflight++;
+	}
+	if (pending > 0) {
+		uring_enter(ur, pending, 0);
+	}
+}
+#endif /* DISK_URING */
+
+static
+void *
+aio_worker(void *arg)
+{
+	struct disk *d = arg;
+	struct aio *a = &d->d_aio;
+	struct disk_io *io;
+	ssize_t len;
+
+	pthread_mutex_lock(&a->a_lock);
+	for (;;) {
+		while (a->a_head == NULL && !a->a_quit) {
+			pthread_cond_wait(&a->a_work, &a->a_lock);
 		}
-		tot += len;
+		if (a->a_head == NULL) {
+			break;
+		}
+		io = a->a_head;
+		a->a_head = io->dio_qnext;
+		pthread_mutex_unlock(&a->a_lock);
+
+		len = preadv(d->d_fd, &io->dio_iov, 1, io->dio_off);
+
+		pthread_mutex_lock(&a->a_lock);
+		io->dio_res = len < 0 ? -errno : len;
+		io->dio_done = 1;
+		pthread_cond_broadcast(&a->a_done);
 	}
+	pthread_mutex_unlock(&a->a_lock);
+	return NULL;
 }
 
+static
 void
-disk_read(void *data, u_int32_t block)
+aio_start(struct disk *d)
 {
-	char *cdata = data;
-	u_int32_t tot=0;
-	int len;
+	struct aio *a = &d->d_aio;
+	int i;
+
+	pthread_mutex_init(&a->a_lock, NULL);
+	pthread_cond_init(&a->a_done, NULL);
+	pthread_cond_init(&a->a_work, NULL);
+#ifdef DISK_URING
+	if (uring_setup(&a->a_ring) == 0) {
+		a->a_uring = 1;
+		return;
+	}
+#endif
+	for (i=0; i<AIO_NTHREADS; i++) {
+		if (pthread_create(&a->a_threads[i], NULL, aio_worker, d)) {
+			break;
+		}
+	}
+	a->a_nthreads = i;
+}
+
+/* Every read must have been waited for */
+static
+void
+aio_stop(struct disk *d)
+{
+	struct aio *a = &d->d_aio;
+	int i;
+
+#ifdef DISK_URING
+	if (a->a_uring) {
+		assert(a->a_inflight == 0);
+		uring_teardown(&a->a_ring);
+	}
+#endif
+	pthread_mutex_lock(&a->a_lock);
+	a->a_quit = 1;
+	pthread_cond_broadcast(&a->a_work);
+	pthread_mutex_unlock(&a->a_lock);
+	for (i=0; i<a->a_nthreads; i++) {
+		pthread_join(a->a_threads[i], NULL);
+	}
+	pthread_cond_destroy(&a->a_work);
+	pthread_cond_destroy(&a->a_done);
+	pthread_mutex_destroy(&a->a_lock);
+}
+
+/*
+ * Start the reads on LIST, linked through dio_qnext, whose dio_iov and
+ * dio_off are set.
+ */
+static
+void
+aio_submit(struct disk *d, struct disk_io *list)
+{
+	struct aio *a = &d->d_aio;
+	struct disk_io *io, *last = NULL;
+
+	pthread_mutex_lock(&a->a_lock);
+	for (io = list; io != NULL; io = io->dio_qnext) {
+		io->dio_done = 0;
+		io->dio_res = 0;
+		last = io;
+	}
+	if (last == NULL) {
+		pthread_mutex_unlock(&a->a_lock);
+		return;
+	}
+#ifdef DISK_URING
+	if (a->a_uring) {
+		uring_submit(a, d->d_fd, list);
+		pthread_mutex_unlock(&a->a_lock);
+		return;
+	}
+#endif
+	if (a->a_nthreads == 0) {
+		/* no engine at all: read now */
+		for (io = list; io != NULL; io = io->dio_qnext) {
+			io->dio_res = preadv(d->d_fd, &io->dio_iov, 1,
+					     io->dio_off);
+			io->dio_done = 1;
+		}
+		pthread_mutex_unlock(&a->a_lock);
+		return;
+	}
+	if (a->a_head == NULL) {
+		a->a_head = list;
+	}
+	else {
+		a->a_tail->dio_qnext = list;
+	}
+	a->a_tail = last;
+	pthread_cond_broadcast(&a->a_work);
+	pthread_mutex_unlock(&a->a_lock);
+}
+
+static
+int
+aio_isdone(struct disk *d, struct disk_io *io)
+{
+	int done;
+
+	pthread_mutex_lock(&d->d_aio.a_lock);
+	done = io->dio_done;
+	pthread_mutex_unlock(&d->d_aio.a_lock);
+	return done;
+}
+
+/*
+ * Wait for read IO to complete, then finish it: a failed or short read
+ * is redone with raw_io(), which resumes or reports it.
+ */
+static
+void
+aio_wait(struct disk *d, struct disk_io *io)
+{
+	struct aio *a = &d->d_aio;
+	struct iovec iov;
 
-	assert(fd>=0);
+	pthread_mutex_lock(&a->a_lock);
+	while (!io->dio_done) {
+#ifdef DISK_URING
+		if (a->a_uring) {
+			uring_progress(a);
+			continue;
+		}
+#endif
+		pthread_cond_wait(&a->a_done, &a->a_lock);
+	}
+	pthread_mutex_unlock(&a->a_lock);
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+	if (io->dio_res != (ssize_t)io->dio_iov.iov_len) {
+		iov = io->dio_iov;
+		raw_io(d, 0, &iov, 1, io->dio_off / d->d_blocksize);
 	}
+}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
-			if (errno==EINTR || errno==EAGAIN) {
+static
+struct buf *
+cache_lookup(struct disk *d, u_int32_t block)
+{
+	struct buf *b;
+
+	for (b = d->d_bhash[CACHE_HASH(block)]; b != NULL; b = b->b_hnext) {
+		if (b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+cache_unhash(struct disk *d, struct buf *b)
+{
+	struct buf **pp;
+
+	for (pp = &d->d_bhash[CACHE_HASH(b->b_block)]; *pp != NULL;
+	     pp = &(*pp)->b_hnext) {
+		if (*pp == b) {
+			*pp = b->b_hnext;
+			break;
+		}
+	}
+	b->b_hnext = NULL;
+}
+
+static
+void
+cache_writeback(struct disk *d, struct buf *b)
+{
+	assert(b->b_valid && b->b_dirty);
+	raw_write(d, b->b_data, b->b_block);
+	b->b_dirty = 0;
+	d->d_stats.ds_writebacks++;
+}
+
+static struct jblock *jl_lookup(struct journal *jl, u_int32_t block);
+
+/*
+ * The read ahead into B has completed: make the buffer usable. A block
+ * that went into the log set meanwhile takes the logged contents.
+ */
+static
+void
+cache_finish(struct disk *d, struct buf *b)
+{
+	struct jblock *jb;
+
+	aio_wait(d, &b->b_io);
+	jb = jl_lookup(&d->d_jl, b->b_block);
+	if (jb != NULL) {
+		memcpy(b->b_data, jb->jb_data, d->d_blocksize);
+	}
+	b->b_busy = 0;
+	d->d_nbusy--;
+}
+
+/*
+ * Cached buffer for BLOCK, or NULL; one being read ahead is waited for
+ * with the lock dropped.
+ */
+static
+struct buf *
+cache_get(struct disk *d, u_int32_t block)
+{
+	struct buf *b;
+	struct disk_io *io;
+
+	for (;;) {
+		b = cache_lookup(d, block);
+		if (b == NULL || !b->b_busy) {
+			return b;
+		}
+		io = &b->b_io;
+		pthread_mutex_unlock(&d->d_lock);
+		aio_wait(d, io);
+		pthread_mutex_lock(&d->d_lock);
+		/* the buffer cannot be reused until it is finished */
+		if (b->b_busy && aio_isdone(d, &b->b_io)) {
+			cache_finish(d, b);
+		}
+	}
+}
+
+/* Cached buffer for BLOCK if it can be used now, else NULL */
+static
+struct buf *
+cache_peek(struct disk *d, u_int32_t block)
+{
+	struct buf *b = cache_lookup(d, block);
+
+	return b != NULL && !b->b_busy ? b : NULL;
+}
+
+/* Wait for every read ahead; before the cache is emptied */
+static
+void
+cache_drain(struct disk *d)
+{
+	int i;
+
+	for (i=0; i<CACHE_NBUF; i++) {
+		if (d->d_bufs[i].b_busy) {
+			cache_finish(d, &d->d_bufs[i]);
+		}
+	}
+}
+
+/*
+ * Pick a buffer to reuse for BLOCK, writing back its old contents if
+ * needed, and enter it in the hash. The data is left for the caller.
+ */
+static
+struct buf *
+cache_alloc(struct disk *d, u_int32_t block)
+{
+	struct buf *b;
+
+	for (;;) {
+		b = &d->d_bufs[d->d_hand];
+		d->d_hand = (d->d_hand + 1) % CACHE_NBUF;
+		if (!b->b_valid) {
+			break;
+		}
+		if (b->b_busy) {
+			if (!aio_isdone(d, &b->b_io)) {
 				continue;
 			}
-			err(1, "read");
+			cache_finish(d, b);
 		}
-		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+		if (b->b_ref) {
+			b->b_ref = 0;
+			continue;
+		}
+		if (b->b_dirty) {
+			cache_writeback(d, b);
+		}
+		cache_unhash(d, b);
+		break;
+	}
+
+	b->b_block = block;
+	b->b_valid = 1;
+	b->b_dirty = 0;
+	b->b_ref = 1;
+	b->b_hnext = d->d_bhash[CACHE_HASH(block)];
+	d->d_bhash[CACHE_HASH(block)] = b;
+	return b;
+}
+
+static
+int
+buf_cmp(const void *a, const void *b)
+{
+	u_int32_t x = (*(struct buf *const *)a)->b_block;
+	u_int32_t y = (*(struct buf *const *)b)->b_block;
+
+	return (x > y) - (x < y);
+}
+
+#define JL_HASH(jl, b)	((b) & ((jl)->jl_nhash-1))
+
+/* Journal blocks taken by a transaction of N blocks */
+static
+u_int32_t
+jl_footprint(struct journal *jl, u_int32_t n)
+{
+	return n + (n + jl->jl_ndesc - 1) / jl->jl_ndesc + 1;
+}
+
+/*
+ * Whether an operation that may journal N blocks can start now: the
+ * running transaction, with the blocks of the operations in progress
+ * and these, must fit in what is left of the journal, and so must the
+ * revoke blocks.
+ */
+static
+int
+jl_fits(struct journal *jl, u_int32_t n)
+{
+	return jl->jl_used + jl_footprint(jl, jl->jl_nrun + jl->jl_resv + n) +
+		jl->jl_rmax <= jl->jl_room;
+}
+
+static
+struct jblock *
+jl_lookup(struct journal *jl, u_int32_t block)
+{
+	struct jblock *jb;
+
+	if (jl->jl_count == 0) {
+		return NULL;
+	}
+	for (jb = jl->jl_hash[JL_HASH(jl, block)]; jb != NULL;
+	     jb = jb->jb_hnext) {
+		if (jb->jb_block == block) {
+			return jb;
+		}
+	}
+	return NULL;
+}
+
+/* Copy the log set's version of any of BLOCK..BLOCK+N-1 over DATA */
+static
+void
+jl_overlay(struct disk *d, char *data, u_int32_t block, u_int32_t n)
+{
+	struct journal *jl = &d->d_jl;
+	struct jblock *jb;
+	u_int32_t i;
+
+	for (i=0; i<n && jl->jl_count>0; i++) {
+		jb = jl_lookup(jl, block + i);
+		if (jb != NULL) {
+			memcpy(data + (size_t)i * d->d_blocksize, jb->jb_data,
+			       d->d_blocksize);
+		}
+	}
+}
+
+static
+void
+jl_remove(struct journal *jl, struct jblock *jb)
+{
+	struct jblock **pp;
+	u_int32_t i;
+
+	for (pp = &jl->jl_hash[JL_HASH(jl, jb->jb_block)]; *pp != jb;
+	     pp = &(*pp)->jb_hnext)
+		;
+	*pp = jb->jb_hnext;
+	if (jb->jb_running) {
+		for (i=0; jl->jl_run[i] != jb; i++)
+			;
+		jl->jl_run[i] = jl->jl_run[--jl->jl_nrun];
+	}
+	jb->jb_hnext = jl->jl_free;
+	jl->jl_free = jb;
+	jl->jl_count--;
+}
+
+/* FNV-1a over a block, chained through SUM */
+static
+u_int32_t
+jl_sum(struct disk *d, u_int32_t sum, const void *data)
+{
+	const unsigned char *p = data;
+	u_int32_t i;
+
+	for (i=0; i<d->d_blocksize; i++) {
+		sum ^= p[i];
+		sum *= 16777619u;
+	}
+	return sum;
+}
+
+static
+void
+jl_flush(struct disk *d)
+{
+	if (fdatasync(d->d_fd)) {
+		err(1, "fdatasync");
+	}
+}
+
+static
+void
+jl_write_header(struct disk *d)
+{
+	struct journal *jl = &d->d_jl;
+	struct sfs_jheader jh;
+
+	bzero(jl->jl_desc, d->d_blocksize);
+	jh.sjh_magic = SFS_JMAGIC_HEAD;
+	jh.sjh_seq = jl->jl_seq;
+	memcpy(jl->jl_desc, &jh, sizeof(jh));
+	raw_write(d, jl->jl_desc, jl->jl_start);
+}
+
+static
+int
+jb_cmp(const void *a, const void *b)
+{
+	u_int32_t x = (*(struct jblock *const *)a)->jb_block;
+	u_int32_t y = (*(struct jblock *const *)b)->jb_block;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Write the log set home and empty the journal. Only done between
+ * transactions, so every entry has been committed.
+ */
+static
+void
+jl_checkpoint(struct disk *d)
+{
+	struct journal *jl = &d->d_jl;
+	struct jblock **all = jl->jl_run;	/* idle between transactions */
+	struct jblock *jb;
+	u_int32_t i, n = 0;
+
+	assert(jl->jl_nrun == 0 && jl->jl_nrev == 0);
+	if (jl->jl_used == 0) {
+		return;
+	}
+
+	for (i=0; i<jl->jl_nhash; i++) {
+		for (jb = jl->jl_hash[i]; jb != NULL; jb = jb->jb_hnext) {
+			all[n++] = jb;
+		}
+	}
+	qsort(all, n, sizeof(all[0]), jb_cmp);
+	for (i=0; i<n; i++) {
+		if (d->d_map != NULL) {
+			memcpy(d->d_map +
+			       (size_t)all[i]->jb_block * d->d_blocksize,
+			       all[i]->jb_data, d->d_blocksize);
 		}
-		tot += len;
+		else {
+			raw_write(d, all[i]->jb_data, all[i]->jb_block);
+		}
+		d->d_stats.ds_writebacks++;
+	}
+	if (d->d_map != NULL && msync(d->d_map, d->d_mapsize, MS_SYNC)) {
+		err(1, "msync");
+	}
+	jl_flush(d);
+
+	jl_write_header(d);
+	jl_flush(d);
+
+	bzero(jl->jl_hash, jl->jl_nhash * sizeof(jl->jl_hash[0]));
+	jl->jl_free = NULL;
+	for (i=0; i<jl->jl_room; i++) {
+		jl->jl_blocks[i].jb_hnext = jl->jl_free;
+		jl->jl_free = &jl->jl_blocks[i];
 	}
+	jl->jl_count = 0;
+	jl->jl_used = 0;
+	d->d_stats.ds_checkpoints++;
 }
 
+/*
+ * Append the running transaction to the journal: its revoke blocks,
+ * descriptors, each followed by the blocks it lists, and a commit
+ * block, then one flush.
+ */
+static
 void
-disk_close(void)
+jl_commit(struct disk *d)
 {
-	assert(fd>=0);
-	if (close(fd)) {
+	struct journal *jl = &d->d_jl;
+	struct iovec iov[MAX_IOV];
+	struct sfs_jdesc jd;
+	struct jblock *jb;
+	u_int32_t i, j, k, pos, start, niov, sum, nrevblk = 0;
+	u_int32_t bs = d->d_blocksize;
+	u_int32_t *list;
+	char *desc;
+
+	jl->jl_ops = 0;
+	jl->jl_force = 0;
+	if (jl->jl_nrun == 0 && jl->jl_nrev == 0) {
+		return;
+	}
+
+	pos = jl->jl_start + 1 + jl->jl_used;
+	sum = 2166136261u;
+	desc = jl->jl_desc;
+	for (i=0; i<jl->jl_nrev; i+=k) {
+		k = jl->jl_nrev - i < jl->jl_ndesc ?
+			jl->jl_nrev - i : jl->jl_ndesc;
+		bzero(desc, bs);
+		jd.sjd_magic = SFS_JMAGIC_REVOKE;
+		jd.sjd_seq = jl->jl_seq;
+		jd.sjd_count = k;
+		jd.sjd_sum = 0;
+		memcpy(desc, &jd, sizeof(jd));
+		memcpy(desc + sizeof(jd), jl->jl_rev + i, k * sizeof(list[0]));
+		sum = jl_sum(d, sum, desc);
+		raw_write(d, desc, pos++);
+		nrevblk++;
+	}
+	for (i=0; i<jl->jl_nrun; i+=k) {
+		k = jl->jl_nrun - i < jl->jl_ndesc ?
+			jl->jl_nrun - i : jl->jl_ndesc;
+		bzero(desc, bs);
+		jd.sjd_magic = SFS_JMAGIC_DESC;
+		jd.sjd_seq = jl->jl_seq;
+		jd.sjd_count = k;
+		jd.sjd_sum = 0;
+		memcpy(desc, &jd, sizeof(jd));
+		list = (u_int32_t *)(desc + sizeof(jd));
+		for (j=0; j<k; j++) {
+			list[j] = jl->jl_run[i+j]->jb_block;
+		}
+		sum = jl_sum(d, sum, desc);
+
+		/* the descriptor, then its blocks, MAX_IOV at a time */
+		iov[0].iov_base = desc;
+		iov[0].iov_len = bs;
+		niov = 1;
+		start = pos;
+		for (j=0; j<k; j++) {
+			jb = jl->jl_run[i+j];
+			sum = jl_sum(d, sum, jb->jb_data);
+			iov[niov].iov_base = jb->jb_data;
+			iov[niov].iov_len = bs;
+			if (++niov == MAX_IOV) {
+				raw_io(d, 1, iov, niov, start);
+				start += niov;
+				niov = 0;
+			}
+		}
+		if (niov > 0) {
+			raw_io(d, 1, iov, niov, start);
+		}
+		pos += k + 1;
+		desc += bs;
+	}
+
+	bzero(desc, bs);
+	jd.sjd_magic = SFS_JMAGIC_COMMIT;
+	jd.sjd_seq = jl->jl_seq;
+	jd.sjd_count = 0;
+	jd.sjd_sum = sum;
+	memcpy(desc, &jd, sizeof(jd));
+	raw_write(d, desc, pos);
+	jl_flush(d);
+
+	d->d_stats.ds_commits++;
+	d->d_stats.ds_logged += jl->jl_nrun;
+	for (i=0; i<jl->jl_nrun; i++) {
+		jl->jl_run[i]->jb_running = 0;
+		jl->jl_run[i]->jb_logged = 1;
+	}
+	jl->jl_used += jl_footprint(jl, jl->jl_nrun) + nrevblk;
+	jl->jl_nrun = 0;
+	jl->jl_nrev = 0;
+	jl->jl_seq++;
+}
+
+/*
+ * Journalled write of the first LEN bytes of BLOCK, rest zeroed. The
+ * operations in progress were admitted for what they write, so the
+ * running transaction always has room for it.
+ */
+static
+void
+jl_put(struct disk *d, const void *data, u_int32_t block, u_int32_t len)
+{
+	struct journal *jl = &d->d_jl;
+	struct jblock *jb;
+	struct buf *b;
+
+	jb = jl_lookup(jl, block);
+	if (jb == NULL) {
+		assert(jl->jl_free != NULL);
+		jb = jl->jl_free;
+		jl->jl_free = jb->jb_hnext;
+		jb->jb_block = block;
+		jb->jb_running = 0;
+		jb->jb_logged = 0;
+		jb->jb_hnext = jl->jl_hash[JL_HASH(jl, block)];
+		jl->jl_hash[JL_HASH(jl, block)] = jb;
+		jl->jl_count++;
+	}
+	if (!jb->jb_running) {
+		assert(jl->jl_used + jl_footprint(jl, jl->jl_nrun + 1) +
+		       jl->jl_rmax <= jl->jl_room);
+		jb->jb_running = 1;
+		jl->jl_run[jl->jl_nrun++] = jb;
+	}
+	memcpy(jb->jb_data, data, len);
+	bzero(jb->jb_data + len, d->d_blocksize - len);
+
+	/* a buffer being read ahead takes the new copy when it finishes */
+	b = cache_lookup(d, block);
+	if (b != NULL && !b->b_busy) {
+		d->d_stats.ds_hits++;
+		b->b_ref = 1;
+		memcpy(b->b_data, jb->jb_data, d->d_blocksize);
+	}
+}
+
+/*
+ * BLOCK..BLOCK+N-1 are about to be overwritten in place. Log set
+ * entries for them are stale and dropped; a committed copy would come
+ * back on replay, so the running transaction revokes it.
+ */
+static
+void
+jl_revoke(struct disk *d, u_int32_t block, u_int32_t n)
+{
+	struct journal *jl = &d->d_jl;
+	struct jblock *jb;
+	u_int32_t i;
+
+	for (i=0; i<n && jl->jl_count>0; i++) {
+		jb = jl_lookup(jl, block + i);
+		if (jb == NULL) {
+			continue;
+		}
+		if (jb->jb_logged) {
+			jl->jl_rev[jl->jl_nrev++] = jb->jb_block;
+		}
+		jl_remove(jl, jb);
+	}
+}
+
+/*
+ * Empty the cache and give every buffer blocksize bytes of data space.
+ */
+static
+void
+cache_reset(struct disk *d)
+{
+	int i;
+
+	free(d->d_bufdata);
+	d->d_bufdata = malloc((size_t)CACHE_NBUF * d->d_blocksize);
+	if (d->d_bufdata == NULL) {
+		err(1, "buffer cache");
+	}
+	bzero(d->d_bufs, sizeof(d->d_bufs));
+	bzero(d->d_bhash, sizeof(d->d_bhash));
+	for (i=0; i<CACHE_NBUF; i++) {
+		d->d_bufs[i].b_data = d->d_bufdata + (size_t)i * d->d_blocksize;
+	}
+	d->d_hand = 0;
+}
+
+struct disk *
+disk_open(const char *path, int flags)
+{
+	struct disk *d;
+	struct stat st;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		err(1, "%s", path);
+	}
+	d->d_fd = open(path, O_RDWR);
+
+	if (d->d_fd<0) {
+		err(1, "%s", path);
+	}
+
+	d->d_blocksize = DEFAULT_BLOCKSIZE;
+	cache_reset(d);
+	pthread_mutex_init(&d->d_lock, NULL);
+	aio_start(d);
+
+	if (flags & DISK_MMAP) {
+		if (fstat(d->d_fd, &st)) {
+			err(1, "%s: fstat", path);
+		}
+		d->d_mapsize = st.st_size;
+		d->d_mapnblocks = d->d_mapsize / d->d_blocksize;
+		d->d_map = mmap(NULL, d->d_mapsize,
+				PROT_READ|PROT_WRITE, MAP_SHARED, d->d_fd, 0);
+		if (d->d_map == MAP_FAILED) {
+			err(1, "%s: mmap", path);
+		}
+	}
+	return d;
+}
+
+static void disk_sync_locked(struct disk *d);
+
+/*
+ * Switch to SIZE-byte blocks, once the superblock says how large they
+ * are. Dirty buffers are written back first.
+ */
+void
+disk_set_blocksize(struct disk *d, u_int32_t size)
+{
+	assert(size >= DEFAULT_BLOCKSIZE && (size & (size - 1)) == 0);
+	assert(d->d_jl.jl_start == 0);
+
+	pthread_mutex_lock(&d->d_lock);
+	if (size != d->d_blocksize) {
+		cache_drain(d);
+		disk_sync_locked(d);
+		d->d_blocksize = size;
+		cache_reset(d);
+		d->d_mapnblocks = d->d_mapsize / d->d_blocksize;
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Zero-copy access to a block of a mapped image. The pointer stays
+ * valid until the block is next written. Returns NULL when the image is
+ * not mapped, or when the block's current contents are in the journal's
+ * log set, whose entries are recycled; callers then fall back to disk_read().
+ */
+const void *
+disk_block_ptr(struct disk *d, u_int32_t block)
+{
+	const void *p = NULL;
+
+	if (d->d_map == NULL) {
+		return NULL;
+	}
+	assert(block < d->d_mapnblocks);
+	pthread_mutex_lock(&d->d_lock);
+	if (jl_lookup(&d->d_jl, block) == NULL) {
+		p = d->d_map + (size_t)block * d->d_blocksize;
+	}
+	pthread_mutex_unlock(&d->d_lock);
+	return p;
+}
+
+static
+char *
+map_block(struct disk *d, u_int32_t block, u_int32_t nblocks)
+{
+	assert(block + nblocks <= d->d_mapnblocks);
+	return d->d_map + (size_t)block * d->d_blocksize;
+}
+
+u_int32_t
+disk_blocksize(struct disk *d)
+{
+	return d->d_blocksize;
+}
+
+/*
+ * Read the first LEN bytes of BLOCK, for structures smaller than a
+ * block such as the superblock and inodes.
+ */
+static
+void
+bread_locked(struct disk *d, void *data, u_int32_t block, u_int32_t len)
+{
+	struct jblock *jb;
+	struct buf *b;
+
+	assert(len <= d->d_blocksize);
+
+	if (d->d_map != NULL) {
+		jb = jl_lookup(&d->d_jl, block);
+		memcpy(data, jb != NULL ? jb->jb_data :
+		       map_block(d, block, 1), len);
+		return;
+	}
+
+	b = cache_get(d, block);
+	jb = jl_lookup(&d->d_jl, block);
+	if (b != NULL) {
+		d->d_stats.ds_hits++;
+		b->b_ref = 1;
+	}
+	else {
+		d->d_stats.ds_misses++;
+		b = cache_alloc(d, block);
+		if (jb != NULL) {
+			memcpy(b->b_data, jb->jb_data, d->d_blocksize);
+		}
+		else {
+			raw_read(d, b->b_data, block);
+		}
+	}
+	memcpy(data, b->b_data, len);
+}
+
+/*
+ * Write LEN bytes from DATA at the start of BLOCK; the rest of the
+ * block is zeroed.
+ */
+static
+void
+bwrite_locked(struct disk *d, const void *data, u_int32_t block,
+	      u_int32_t len)
+{
+	struct buf *b;
+	char *p;
+
+	assert(len <= d->d_blocksize);
+
+	if (d->d_jl.jl_start != 0) {
+		jl_put(d, data, block, len);
+		return;
+	}
+	if (d->d_map != NULL) {
+		p = map_block(d, block, 1);
+	}
+	else {
+		b = cache_get(d, block);
+		if (b != NULL) {
+			d->d_stats.ds_hits++;
+			b->b_ref = 1;
+		}
+		else {
+			b = cache_alloc(d, block);
+		}
+		b->b_dirty = 1;
+		p = b->b_data;
+	}
+	memcpy(p, data, len);
+	bzero(p + len, d->d_blocksize - len);
+}
+
+void
+disk_read(struct disk *d, void *data, u_int32_t block)
+{
+	pthread_mutex_lock(&d->d_lock);
+	bread_locked(d, data, block, d->d_blocksize);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+void
+disk_write(struct disk *d, const void *data, u_int32_t block)
+{
+	pthread_mutex_lock(&d->d_lock);
+	bwrite_locked(d, data, block, d->d_blocksize);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+void
+disk_read_part(struct disk *d, void *data, u_int32_t block, u_int32_t len)
+{
+	pthread_mutex_lock(&d->d_lock);
+	bread_locked(d, data, block, len);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+void
+disk_write_part(struct disk *d, const void *data, u_int32_t block,
+		u_int32_t len)
+{
+	pthread_mutex_lock(&d->d_lock);
+	bwrite_locked(d, data, block, len);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Read NBLOCKS contiguous blocks starting at BLOCK into DATA. Blocks
+ * present in the cache are copied from it; each run of missing blocks
+ * is fetched with one syscall straight into DATA without being cached,
+ * so bulk transfers do not push metadata out of the cache. The lock is
+ * dropped for that syscall: the caller owns the blocks (they belong to
+ * a file it holds locked), so only the cache and log set need it.
+ */
+void
+disk_readv(struct disk *d, void *data, u_int32_t block, u_int32_t nblocks)
+{
+	u_int32_t bs = d->d_blocksize;
+	char *cdata = data;
+	struct iovec iov;
+	struct buf *b;
+	u_int32_t i, run = 0;
+
+	if (d->d_map != NULL) {
+		memcpy(data, map_block(d, block, nblocks), nblocks * bs);
+		pthread_mutex_lock(&d->d_lock);
+		jl_overlay(d, data, block, nblocks);
+		pthread_mutex_unlock(&d->d_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&d->d_lock);
+	for (i=0; i<=nblocks; i++) {
+		b = (i < nblocks) ? cache_peek(d, block + i) : NULL;
+		if (i < nblocks && b == NULL) {
+			d->d_stats.ds_misses++;
+			run++;
+			continue;
+		}
+		if (run > 0) {
+			iov.iov_base = cdata + (i - run) * bs;
+			iov.iov_len = run * bs;
+			pthread_mutex_unlock(&d->d_lock);
+			raw_io(d, 0, &iov, 1, block + i - run);
+			pthread_mutex_lock(&d->d_lock);
+			jl_overlay(d, cdata + (i - run) * bs, block + i - run,
+				   run);
+			run = 0;
+			if (i < nblocks) {
+				b = cache_peek(d, block + i);
+			}
+		}
+		if (b != NULL) {
+			d->d_stats.ds_hits++;
+			memcpy(cdata + i * bs, b->b_data, bs);
+		}
+		else if (i < nblocks) {
+			/* evicted while the lock was dropped */
+			i--;
+		}
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Write NBLOCKS contiguous blocks starting at BLOCK from DATA with one
+ * syscall. Cached copies of those blocks are refreshed and left clean.
+ */
+void
+disk_writev(struct disk *d, const void *data, u_int32_t block,
+	    u_int32_t nblocks)
+{
+	u_int32_t bs = d->d_blocksize;
+	const char *cdata = data;
+	struct iovec iov;
+	struct buf *b;
+	u_int32_t i;
+
+	if (nblocks == 0) {
+		return;
+	}
+	pthread_mutex_lock(&d->d_lock);
+	if (d->d_jl.jl_start != 0) {
+		jl_revoke(d, block, nblocks);
+	}
+	if (d->d_map != NULL) {
+		pthread_mutex_unlock(&d->d_lock);
+		memcpy(map_block(d, block, nblocks), data, nblocks * bs);
+		return;
+	}
+	/* no stale copy may be written back over the new data */
+	for (i=0; i<nblocks; i++) {
+		b = cache_get(d, block + i);
+		if (b != NULL) {
+			memcpy(b->b_data, cdata + i * bs, bs);
+			b->b_dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&d->d_lock);
+
+	iov.iov_base = (void *)cdata;
+	iov.iov_len = nblocks * bs;
+	raw_io(d, 1, &iov, 1, block);
+}
+
+/*
+ * disk_write_part() of a metadata block that nothing committed refers
+ * to yet, such as one the operation in progress has just allocated: a
+ * crash before the commit that links it in leaves it unused, so with a
+ * journal it is written home like file data instead of being logged.
+ */
+void
+disk_write_new(struct disk *d, const void *data, u_int32_t block,
+	       u_int32_t len)
+{
+	char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= d->d_blocksize);
+
+	if (d->d_jl.jl_start == 0) {
+		disk_write_part(d, data, block, len);
+		return;
+	}
+	memcpy(buf, data, len);
+	bzero(buf + len, d->d_blocksize - len);
+	disk_writev(d, buf, block, 1);
+}
+
+/*
+ * Scatter read: fetch BLOCKS[i] into BUFS[i] for each of the N entries.
+ * Cache hits are served from memory; the misses are grouped into runs
+ * of ascending adjacent block numbers and each run is read with one
+ * preadv() into the cache, so later disk_read()s of the same blocks hit.
+ */
+void
+disk_read_list(struct disk *d, void *const bufs_out[],
+	       const u_int32_t blocks[], u_int32_t n)
+{
+	u_int32_t bs = d->d_blocksize;
+	struct iovec iov[MAX_IOV];
+	struct buf *run[MAX_IOV];
+	struct buf *b;
+	u_int32_t i, j, nrun = 0;
+	int again;
+
+	pthread_mutex_lock(&d->d_lock);
+	if (d->d_map != NULL) {
+		for (i=0; i<n; i++) {
+			bread_locked(d, bufs_out[i], blocks[i], bs);
+		}
+		pthread_mutex_unlock(&d->d_lock);
+		return;
+	}
+
+	/* finish read-aheads first: the loop below keeps the lock */
+	do {
+		again = 0;
+		for (i=0; i<n; i++) {
+			b = cache_lookup(d, blocks[i]);
+			if (b != NULL && b->b_busy) {
+				cache_get(d, blocks[i]);
+				again = 1;
+			}
+		}
+	} while (again);
+
+	for (i=0; i<=n; i++) {
+		b = (i < n) ? cache_lookup(d, blocks[i]) : NULL;
+		if (i < n && b != NULL) {
+			d->d_stats.ds_hits++;
+			b->b_ref = 1;
+			memcpy(bufs_out[i], b->b_data, bs);
+		}
+		if (nrun > 0 && (i == n || b != NULL || nrun == MAX_IOV ||
+		    blocks[i] != run[nrun-1]->b_block + 1)) {
+			raw_io(d, 0, iov, nrun, run[0]->b_block);
+			for (j=0; j<nrun; j++) {
+				jl_overlay(d, run[j]->b_data, run[j]->b_block,
+					   1);
+				memcpy(bufs_out[i-nrun+j], run[j]->b_data, bs);
+			}
+			nrun = 0;
+		}
+		if (i < n && b == NULL) {
+			d->d_stats.ds_misses++;
+			run[nrun] = cache_alloc(d, blocks[i]);
+			iov[nrun].iov_base = run[nrun]->b_data;
+			iov[nrun].iov_len = bs;
+			nrun++;
+		}
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Start reading BLOCKS[0..N-1] into the cache and return at once; a
+ * disk_read() of one of them that arrives first waits for it. Blocks that
+ * are cached or in the log set are skipped, and so is the rest of the
+ * list once AIO_MAXBUSY reads are in flight. On a mapped image the
+ * kernel is asked to page the blocks in instead.
+ */
+void
+disk_prefetch(struct disk *d, const u_int32_t blocks[], u_int32_t n)
+{
+	struct disk_io *list = NULL, **tailp = &list;
+	struct buf *b;
+	size_t off, pgoff;
+	u_int32_t i;
+
+	if (d->d_map != NULL) {
+		for (i=0; i<n; i++) {
+			if (blocks[i] == 0) {
+				continue;
+			}
+			off = (size_t)blocks[i] * d->d_blocksize;
+			pgoff = off % getpagesize();
+			madvise(map_block(d, blocks[i], 1) - pgoff,
+				d->d_blocksize + pgoff, MADV_WILLNEED);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&d->d_lock);
+	for (i=0; i<n && d->d_nbusy < AIO_MAXBUSY; i++) {
+		if (blocks[i] == 0 || cache_lookup(d, blocks[i]) != NULL ||
+		    jl_lookup(&d->d_jl, blocks[i]) != NULL) {
+			continue;
+		}
+		b = cache_alloc(d, blocks[i]);
+		b->b_busy = 1;
+		d->d_nbusy++;
+		d->d_stats.ds_misses++;
+		d->d_stats.ds_prefetched++;
+		b->b_io.dio_iov.iov_base = b->b_data;
+		b->b_io.dio_iov.iov_len = d->d_blocksize;
+		b->b_io.dio_off = (off_t)blocks[i] * d->d_blocksize;
+		b->b_io.dio_qnext = NULL;
+		*tailp = &b->b_io;
+		tailp = &b->b_io.dio_qnext;
+	}
+	/* submitted under the lock, so a waiter never finds one unstarted */
+	aio_submit(d, list);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Start the N reads described by IOS (dio_data, dio_block, dio_nblocks
+ * filled in) and return; disk_await() finishes them. Data is read
+ * straight into place, as disk_readv() does.
+ */
+void
+disk_aread(struct disk *d, struct disk_io ios[], u_int32_t n)
+{
+	u_int32_t i;
+
+	if (n == 0) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		ios[i].dio_iov.iov_base = ios[i].dio_data;
+		ios[i].dio_iov.iov_len = (size_t)ios[i].dio_nblocks *
+					 d->d_blocksize;
+		ios[i].dio_off = (off_t)ios[i].dio_block * d->d_blocksize;
+		ios[i].dio_qnext = i + 1 < n ? &ios[i + 1] : NULL;
+	}
+	if (d->d_map != NULL) {
+		for (i=0; i<n; i++) {
+			memcpy(ios[i].dio_data,
+			       map_block(d, ios[i].dio_block,
+					 ios[i].dio_nblocks),
+			       ios[i].dio_iov.iov_len);
+			ios[i].dio_res = ios[i].dio_iov.iov_len;
+			ios[i].dio_done = 1;
+		}
+		return;
+	}
+	aio_submit(d, &ios[0]);
+}
+
+/*
+ * Wait for the N reads started by disk_aread(). Newer contents kept in
+ * the cache or the log set are copied over what came from the image.
+ */
+void
+disk_await(struct disk *d, struct disk_io ios[], u_int32_t n)
+{
+	u_int32_t bs = d->d_blocksize;
+	struct buf *b;
+	u_int32_t i, j;
+
+	for (i=0; i<n; i++) {
+		if (d->d_map == NULL) {
+			aio_wait(d, &ios[i]);
+		}
+	}
+	pthread_mutex_lock(&d->d_lock);
+	for (i=0; i<n; i++) {
+		for (j=0; d->d_map == NULL && j<ios[i].dio_nblocks; j++) {
+			b = cache_peek(d, ios[i].dio_block + j);
+			if (b != NULL) {
+				d->d_stats.ds_hits++;
+				memcpy((char *)ios[i].dio_data + j * bs,
+				       b->b_data, bs);
+			}
+			else {
+				d->d_stats.ds_misses++;
+			}
+		}
+		jl_overlay(d, ios[i].dio_data, ios[i].dio_block,
+			   ios[i].dio_nblocks);
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Read-ahead.
+ *
+ * A stream starts with a window of DISK_RA_MIN blocks past the first
+ * read. Each time the reader gets within half a window of the end of
+ * what was read ahead, the window doubles, up to ra_max, and the next
+ * window's worth is read ahead; so a long sequential walk keeps a
+ * growing amount of I/O in flight. A read anywhere else shows the
+ * stream is not sequential: read-ahead stops until it is again.
+ */
+#define RA_MAXBYTES	(256 * 1024)	/* default ra_max, in bytes */
+
+/*
+ * Start stream RA. MAX limits the window; 0 picks one that fits in the
+ * cache alongside everything else.
+ */
+void
+disk_ra_init(struct disk *d, struct disk_ra *ra, u_int32_t max)
+{
+	if (max == 0) {
+		max = RA_MAXBYTES / d->d_blocksize;
+		if (max > DISK_RA_MAX) {
+			max = DISK_RA_MAX;
+		}
+	}
+	if (max < DISK_RA_MIN) {
+		max = DISK_RA_MIN;
+	}
+	ra->ra_next = 0;
+	ra->ra_end = 0;
+	ra->ra_size = 0;
+	ra->ra_max = max;
+}
+
+/*
+ * The reader of stream RA is about to use blocks BLOCK to BLOCK+N-1.
+ * Returns how many blocks to read ahead, from *FIRST on; 0 for none.
+ */
+u_int32_t
+disk_ra_access(struct disk_ra *ra, u_int32_t block, u_int32_t n,
+	       u_int32_t *first)
+{
+	u_int32_t want;
+
+	if (block != ra->ra_next) {
+		ra->ra_next = block + n;
+		ra->ra_end = ra->ra_next;
+		ra->ra_size = 0;
+		return 0;
+	}
+	ra->ra_next = block + n;
+	if (ra->ra_end < ra->ra_next) {
+		ra->ra_end = ra->ra_next;
+	}
+	if (ra->ra_size != 0 && ra->ra_end - ra->ra_next > ra->ra_size / 2) {
+		return 0;
+	}
+	ra->ra_size = ra->ra_size == 0 ? DISK_RA_MIN : ra->ra_size * 2;
+	if (ra->ra_size > ra->ra_max) {
+		ra->ra_size = ra->ra_max;
+	}
+	want = ra->ra_next + ra->ra_size - ra->ra_end;
+	*first = ra->ra_end;
+	ra->ra_end += want;
+	return want;
+}
+
+/* Name of the engine behind the asynchronous reads */
+const char *
+disk_aio_engine(struct disk *d)
+{
+	if (d->d_map != NULL) {
+		return "mmap";
+	}
+	return d->d_aio.a_uring ? "io_uring" : "threads";
+}
+
+/*
+ * Blocks revoked by the transactions being replayed, and by which:
+ * copies of a block in transactions before that one are stale.
+ */
+struct jrevoke {
+	u_int32_t jr_block;
+	u_int32_t jr_seq;
+};
+
+struct jreplay {
+	struct jrevoke *jr_list;
+	u_int32_t jr_n, jr_max;
+};
+
+static
+int
+jr_cmp(const void *a, const void *b)
+{
+	const struct jrevoke *x = a, *y = b;
+
+	if (x->jr_block != y->jr_block) {
+		return (x->jr_block > y->jr_block) -
+			(x->jr_block < y->jr_block);
+	}
+	return (x->jr_seq > y->jr_seq) - (x->jr_seq < y->jr_seq);
+}
+
+/* Sort the revoke list and keep the last revoke of each block */
+static
+void
+jr_sort(struct jreplay *jr)
+{
+	u_int32_t i, n = 0;
+
+	qsort(jr->jr_list, jr->jr_n, sizeof(jr->jr_list[0]), jr_cmp);
+	for (i=0; i<jr->jr_n; i++) {
+		if (n > 0 && jr->jr_list[n-1].jr_block ==
+		    jr->jr_list[i].jr_block) {
+			n--;
+		}
+		jr->jr_list[n++] = jr->jr_list[i];
+	}
+	jr->jr_n = n;
+}
+
+static
+int
+jr_cmp_block(const void *a, const void *b)
+{
+	const struct jrevoke *x = a, *y = b;
+
+	return (x->jr_block > y->jr_block) - (x->jr_block < y->jr_block);
+}
+
+/* Whether the copy of BLOCK in transaction SEQ was revoked later */
+static
+int
+jr_revoked(const struct jreplay *jr, u_int32_t block, u_int32_t seq)
+{
+	struct jrevoke key, *r;
+
+	key.jr_block = block;
+	key.jr_seq = 0;
+	r = bsearch(&key, jr->jr_list, jr->jr_n, sizeof(key), jr_cmp_block);
+	return r != NULL && r->jr_seq > seq;
+}
+
+/*
+ * Check the transaction numbered SEQ at log position POS: its revoke
+ * and descriptor blocks, the blocks those list and the commit block
+ * must all be there and the checksum must match. Returns the number of
+ * log blocks it spans, or 0 if it is missing or damaged. What it
+ * revokes is added to JR.
+ */
+static
+u_int32_t
+jl_scan(struct disk *d, char *blk, u_int32_t pos, u_int32_t seq,
+	struct jreplay *jr)
+{
+	struct journal *jl = &d->d_jl;
+	struct sfs_jdesc jd;
+	u_int32_t p, i, n, sum = 2166136261u;
+	u_int32_t nrev = jr->jr_n;
+	const u_int32_t *list;
+
+	for (p = pos; p < jl->jl_room; p += n) {
+		raw_read(d, blk, jl->jl_start + 1 + p);
+		memcpy(&jd, blk, sizeof(jd));
+		if (jd.sjd_seq != seq) {
+			break;
+		}
+		if (jd.sjd_magic == SFS_JMAGIC_COMMIT) {
+			if (jd.sjd_sum != sum) {
+				break;
+			}
+			return p + 1 - pos;
+		}
+		if ((jd.sjd_magic != SFS_JMAGIC_DESC &&
+		     jd.sjd_magic != SFS_JMAGIC_REVOKE) ||
+		    jd.sjd_count == 0 || jd.sjd_count > jl->jl_ndesc) {
+			break;
+		}
+		n = jd.sjd_magic == SFS_JMAGIC_DESC ? 1 + jd.sjd_count : 1;
+		if (p + n >= jl->jl_room) {
+			break;
+		}
+		sum = jl_sum(d, sum, blk);
+		if (jd.sjd_magic == SFS_JMAGIC_REVOKE) {
+			if (jr->jr_n + jd.sjd_count > jr->jr_max) {
+				jr->jr_max = 2 * (jr->jr_n + jd.sjd_count);
+				jr->jr_list = realloc(jr->jr_list, jr->jr_max *
+						      sizeof(jr->jr_list[0]));
+				if (jr->jr_list == NULL) {
+					err(1, "journal");
+				}
+			}
+			list = (const u_int32_t *)(blk + sizeof(jd));
+			for (i=0; i<jd.sjd_count; i++) {
+				jr->jr_list[jr->jr_n].jr_block = list[i];
+				jr->jr_list[jr->jr_n++].jr_seq = seq;
+			}
+		}
+		for (i=1; i<n; i++) {
+			raw_read(d, blk, jl->jl_start + 1 + p + i);
+			sum = jl_sum(d, sum, blk);
+		}
+	}
+	jr->jr_n = nrev;
+	return 0;
+}
+
+/*
+ * Copy the blocks of the LEN-block transaction SEQ at POS to their
+ * homes, but for those revoked by a later one.
+ */
+static
+void
+jl_apply(struct disk *d, char *blk, u_int32_t pos, u_int32_t len,
+	 u_int32_t seq, u_int32_t nblocks, const struct jreplay *jr)
+{
+	u_int32_t list[SFS_MAXBLOCKSIZE / sizeof(u_int32_t)];
+	struct journal *jl = &d->d_jl;
+	struct sfs_jdesc jd;
+	u_int32_t p, i;
+
+	for (p = pos; p < pos + len - 1; p++) {
+		raw_read(d, blk, jl->jl_start + 1 + p);
+		memcpy(&jd, blk, sizeof(jd));
+		if (jd.sjd_magic == SFS_JMAGIC_REVOKE) {
+			continue;
+		}
+		memcpy(list, blk + sizeof(jd), jd.sjd_count * sizeof(list[0]));
+		for (i=0; i<jd.sjd_count; i++) {
+			if (list[i] >= nblocks) {
+				errx(1, "journal: block %u out of range", list[i]);
+			}
+			if (jr_revoked(jr, list[i], seq)) {
+				continue;
+			}
+			raw_read(d, blk, jl->jl_start + 1 + p + 1 + i);
+			raw_write(d, blk, list[i]);
+		}
+		p += jd.sjd_count;
+	}
+}
+
+/*
+ * Start journalling metadata writes into the NBLOCKS-block journal at
+ * START, once the block size is set. Committed transactions left by a
+ * crash are replayed first; returns how many there were.
+ */
+int
+disk_journal_open(struct disk *d, u_int32_t start, u_int32_t nblocks)
+{
+	struct journal *jl = &d->d_jl;
+	u_int32_t bs = d->d_blocksize;
+	struct sfs_jheader jh;
+	struct jreplay jr;
+	struct stat st;
+	u_int32_t i, len, pos, n = 0;
+	u_int32_t *lens;
+	char *blk;
+
+	assert(jl->jl_start == 0);
+
+	if (fstat(d->d_fd, &st)) {
+		err(1, "fstat");
+	}
+	if (nblocks < SFS_JMINBLOCKS ||
+	    (off_t)start + nblocks > st.st_size / bs) {
+		errx(1, "journal: bad location %u+%u", start, nblocks);
+	}
+	pthread_mutex_lock(&d->d_lock);
+	jl->jl_start = start;
+	jl->jl_room = nblocks - 1;
+	jl->jl_ndesc = (bs - sizeof(struct sfs_jdesc)) / sizeof(u_int32_t);
+	jl->jl_rmax = (jl->jl_room + jl->jl_ndesc - 1) / jl->jl_ndesc;
+	for (jl->jl_txmax = jl->jl_room;
+	     jl_footprint(jl, jl->jl_txmax) + jl->jl_rmax > jl->jl_room;
+	     jl->jl_txmax--)
+		;
+
+	blk = malloc(bs);
+	lens = malloc(jl->jl_room * sizeof(lens[0]));
+	if (blk == NULL || lens == NULL) {
+		err(1, "journal");
+	}
+	raw_read(d, blk, jl->jl_start);
+	memcpy(&jh, blk, sizeof(jh));
+	if (jh.sjh_magic != SFS_JMAGIC_HEAD) {
+		errx(1, "journal: bad header magic %x", jh.sjh_magic);
+	}
+
+	/* find the transactions and what they revoke, then replay them */
+	bzero(&jr, sizeof(jr));
+	jl->jl_seq = jh.sjh_seq;
+	for (pos = 0; (len = jl_scan(d, blk, pos, jl->jl_seq + n, &jr)) > 0;
+	     pos += len) {
+		lens[n++] = len;
+	}
+	jr_sort(&jr);
+	for (pos = 0, i = 0; i < n; pos += lens[i++]) {
+		jl_apply(d, blk, pos, lens[i], jl->jl_seq, st.st_size / bs,
+			 &jr);
+		jl->jl_seq++;
+	}
+	free(jr.jr_list);
+	free(lens);
+	free(blk);
+
+	/*
+	 * Step past whatever the scan stopped at, so a damaged transaction
+	 * is never mistaken for a new one; stale blocks in the cache (the
+	 * superblock, at least) go too.
+	 */
+	jl->jl_seq++;
+	if (n > 0) {
+		jl_flush(d);
+		cache_drain(d);
+		cache_reset(d);
+	}
+
+	jl->jl_blocks = calloc(jl->jl_room, sizeof(jl->jl_blocks[0]));
+	jl->jl_data = malloc((size_t)jl->jl_room * bs);
+	for (jl->jl_nhash = 1; jl->jl_nhash < jl->jl_room; jl->jl_nhash <<= 1)
+		;
+	jl->jl_hash = calloc(jl->jl_nhash, sizeof(jl->jl_hash[0]));
+	jl->jl_run = calloc(jl->jl_room, sizeof(jl->jl_run[0]));
+	jl->jl_rev = calloc(jl->jl_room, sizeof(jl->jl_rev[0]));
+	jl->jl_desc = malloc((size_t)((jl->jl_txmax + jl->jl_ndesc - 1) /
+				      jl->jl_ndesc + 1) * bs);
+	if (jl->jl_blocks == NULL || jl->jl_data == NULL ||
+	    jl->jl_hash == NULL || jl->jl_run == NULL || jl->jl_rev == NULL ||
+	    jl->jl_desc == NULL) {
+		err(1, "journal");
+	}
+	jl->jl_free = NULL;
+	for (i=0; i<jl->jl_room; i++) {
+		jl->jl_blocks[i].jb_data = jl->jl_data + (size_t)i * bs;
+		jl->jl_blocks[i].jb_hnext = jl->jl_free;
+		jl->jl_free = &jl->jl_blocks[i];
+	}
+	jl->jl_count = jl->jl_used = jl->jl_nrun = jl->jl_nrev = 0;
+	jl->jl_ops = jl->jl_active = jl->jl_resv = 0;
+	jl->jl_force = 0;
+	pthread_cond_init(&jl->jl_done, NULL);
+
+	jl_write_header(d);
+	jl_flush(d);
+	pthread_mutex_unlock(&d->d_lock);
+	return n;
+}
+
+/*
+ * Start of a file system operation that may journal up to NBLOCKS
+ * blocks. No transaction is committed while one is in progress, so it
+ * waits until the journal has room for them, emptying the journal if
+ * nothing else is in progress; returns -1 if it never would.
+ */
+int
+disk_tx_begin(struct disk *d, u_int32_t nblocks)
+{
+	struct journal *jl = &d->d_jl;
+
+	pthread_mutex_lock(&d->d_lock);
+	if (jl->jl_start != 0) {
+		if (nblocks > jl->jl_txmax) {
+			pthread_mutex_unlock(&d->d_lock);
+			return -1;
+		}
+		while (!jl_fits(jl, nblocks)) {
+			if (jl->jl_active == 0) {
+				jl_commit(d);
+				jl_checkpoint(d);
+			}
+			else {
+				pthread_cond_wait(&jl->jl_done, &d->d_lock);
+			}
+		}
+		jl->jl_resv += nblocks;
+	}
+	jl->jl_active++;
+	pthread_mutex_unlock(&d->d_lock);
+	return 0;
+}
+
+/*
+ * End of a file system operation begun with NBLOCKS: its writes are
+ * committed together, with those of the operations around it.
+ */
+void
+disk_tx_end(struct disk *d, u_int32_t nblocks)
+{
+	struct journal *jl = &d->d_jl;
+
+	pthread_mutex_lock(&d->d_lock);
+	assert(jl->jl_active > 0);
+	jl->jl_active--;
+	jl->jl_ops++;
+	if (jl->jl_start != 0) {
+		jl->jl_resv -= nblocks;
+		if (jl->jl_active == 0 &&
+		    (jl->jl_force || (jl->jl_hold == 0 &&
+		     (jl->jl_ops >= JOURNAL_GROUP ||
+		      jl->jl_nrun > jl->jl_txmax / 2)))) {
+			jl_commit(d);
+			if (jl->jl_used > jl->jl_room / 2) {
+				jl_checkpoint(d);
+			}
+		}
+		pthread_cond_broadcast(&jl->jl_done);
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * End of an operation that should be durable now: commit it, and the
+ * operations grouped with it, without waiting for the group to fill.
+ * If other operations are in progress, the last of them commits.
+ */
+void
+disk_tx_commit(struct disk *d)
+{
+	struct journal *jl = &d->d_jl;
+
+	pthread_mutex_lock(&d->d_lock);
+	if (jl->jl_start != 0) {
+		if (jl->jl_active == 0) {
+			jl_commit(d);
+		}
+		else {
+			jl->jl_force = 1;
+		}
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Take (HOLD nonzero) or release a hold on group commits. While one is
+ * held, operations are committed together by the next disk_tx_commit(),
+ * unless the journal fills up first: then what has run so far is
+ * committed between two of them.
+ */
+void
+disk_tx_hold(struct disk *d, int hold)
+{
+	struct journal *jl = &d->d_jl;
+
+	pthread_mutex_lock(&d->d_lock);
+	if (hold) {
+		jl->jl_hold++;
+	}
+	else {
+		assert(jl->jl_hold > 0);
+		jl->jl_hold--;
+	}
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/*
+ * Number of the running transaction, 0 without a journal. Blocks
+ * written now are durable once it has moved past that number.
+ */
+u_int32_t
+disk_tx_seq(struct disk *d)
+{
+	u_int32_t seq;
+
+	pthread_mutex_lock(&d->d_lock);
+	seq = d->d_jl.jl_start != 0 ? d->d_jl.jl_seq : 0;
+	pthread_mutex_unlock(&d->d_lock);
+	return seq;
+}
+
+/* Commit, write everything home and stop journalling */
+static
+void
+jl_close(struct disk *d)
+{
+	struct journal *jl = &d->d_jl;
+
+	jl_commit(d);
+	jl_checkpoint(d);
+	free(jl->jl_blocks);
+	free(jl->jl_data);
+	free(jl->jl_hash);
+	free(jl->jl_run);
+	free(jl->jl_rev);
+	free(jl->jl_desc);
+	pthread_cond_destroy(&jl->jl_done);
+	jl->jl_blocks = NULL;
+	jl->jl_data = jl->jl_desc = NULL;
+	jl->jl_hash = jl->jl_run = NULL;
+	jl->jl_rev = NULL;
+	jl->jl_start = 0;
+	jl->jl_count = 0;
+}
+
+/*
+ * Write every dirty buffer back to the image, in block order so the
+ * flush is as sequential as the dirty set allows. With a journal, the
+ * running transaction is committed and the journal emptied instead, so
+ * the image is complete without a replay; that waits for the operations
+ * in progress to end.
+ */
+static
+void
+disk_sync_locked(struct disk *d)
+{
+	struct buf *dirty[CACHE_NBUF];
+	int i, n = 0;
+
+	if (d->d_jl.jl_start != 0) {
+		while (d->d_jl.jl_active > 0) {
+			pthread_cond_wait(&d->d_jl.jl_done, &d->d_lock);
+		}
+		jl_commit(d);
+		jl_checkpoint(d);
+		return;
+	}
+
+	if (d->d_map != NULL) {
+		if (msync(d->d_map, d->d_mapsize, MS_SYNC)) {
+			err(1, "msync");
+		}
+		return;
+	}
+
+	for (i=0; i<CACHE_NBUF; i++) {
+		if (d->d_bufs[i].b_valid && d->d_bufs[i].b_dirty) {
+			dirty[n++] = &d->d_bufs[i];
+		}
+	}
+	qsort(dirty, n, sizeof(dirty[0]), buf_cmp);
+	for (i=0; i<n; i++) {
+		cache_writeback(d, dirty[i]);
+	}
+}
+
+void
+disk_sync(struct disk *d)
+{
+	pthread_mutex_lock(&d->d_lock);
+	disk_sync_locked(d);
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+void
+disk_getstats(struct disk *d, struct disk_stats *ds)
+{
+	pthread_mutex_lock(&d->d_lock);
+	*ds = d->d_stats;
+	pthread_mutex_unlock(&d->d_lock);
+}
+
+/* Nothing else may be using D */
+void
+disk_close(struct disk *d)
+{
+	cache_drain(d);
+	aio_stop(d);
+	if (d->d_jl.jl_start != 0) {
+		jl_close(d);
+	}
+	disk_sync_locked(d);
+	if (d->d_map != NULL) {
+		if (munmap(d->d_map, d->d_mapsize)) {
+			err(1, "munmap");
+		}
+	}
+	if (close(d->d_fd)) {
 		err(1, "close");
 	}
-	fd = -1;
+	pthread_mutex_destroy(&d->d_lock);
+	free(d->d_bufdata);
+	free(d);
 }
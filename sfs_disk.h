@@ -0,0 +1,106 @@
+#ifndef _SFS_DISK_H_
+#define _SFS_DISK_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Buffer cache statistics
+ */
+struct disk_stats {
+	unsigned long ds_hits;		/* reads/writes served by the cache */
+	unsigned long ds_misses;	/* reads that went to the image */
+	unsigned long ds_writebacks;	/* dirty blocks written to the image */
+	unsigned long ds_commits;	/* journal transactions committed */
+	unsigned long ds_logged;	/* ...and the blocks they carried */
+	unsigned long ds_checkpoints;	/* times the journal was emptied */
+	unsigned long ds_prefetched;	/* blocks read ahead into the cache */
+};
+
+/*
+ * An asynchronous read of NBLOCKS blocks from BLOCK into DATA, for
+ * disk_aread(); the caller fills in the first three fields.
+ */
+struct disk_io {
+	void *dio_data;
+	u_int32_t dio_block;
+	u_int32_t dio_nblocks;
+
+	/* private to the disk layer */
+	struct iovec dio_iov;
+	off_t dio_off;
+	ssize_t dio_res;		/* bytes read, or -errno */
+	int dio_done;
+	struct disk_io *dio_qnext;
+};
+
+/*
+ * An open image and its buffer cache; safe to share between threads.
+ */
+struct disk;
+
+/* Flags for disk_open() */
+#define DISK_MMAP	0x1	/* map the whole image instead of caching */
+
+struct disk *disk_open(const char *path, int flags);
+void disk_set_blocksize(struct disk *d, u_int32_t size);
+u_int32_t disk_blocksize(struct disk *d);
+void disk_write(struct disk *d, const void *data, u_int32_t block);
+void disk_read(struct disk *d, void *data, u_int32_t block);
+
+/* Leading LEN bytes of a block; a partial write zeroes the rest */
+void disk_read_part(struct disk *d, void *data, u_int32_t block, u_int32_t len);
+void disk_write_part(struct disk *d, const void *data, u_int32_t block,
+		     u_int32_t len);
+
+/* Multi-block transfers: contiguous runs bypass the cache for misses */
+void disk_readv(struct disk *d, void *data, u_int32_t block, u_int32_t nblocks);
+void disk_writev(struct disk *d, const void *data, u_int32_t block,
+		 u_int32_t nblocks);
+void disk_write_new(struct disk *d, const void *data, u_int32_t block,
+		    u_int32_t len);
+void disk_read_list(struct disk *d, void *const bufs[],
+		    const u_int32_t blocks[], u_int32_t n);
+
+/*
+ * Read-ahead window for one stream of reads, such as a walk through a
+ * file. The disk layer cannot map a file, so the caller reports what it
+ * is about to read in its own (logical) block numbers and reads ahead
+ * whatever disk_ra_access() returns.
+ */
+#define DISK_RA_MIN	4		/* first window, in blocks */
+#define DISK_RA_MAX	64		/* largest default window, in blocks */
+
+struct disk_ra {
+	u_int32_t ra_next;		/* block a sequential reader wants next */
+	u_int32_t ra_end;		/* first block not read ahead */
+	u_int32_t ra_size;		/* window; 0 after a random access */
+	u_int32_t ra_max;		/* ...and its limit */
+};
+
+void disk_ra_init(struct disk *d, struct disk_ra *ra, u_int32_t max);
+u_int32_t disk_ra_access(struct disk_ra *ra, u_int32_t block, u_int32_t n,
+			 u_int32_t *first);
+
+/* Asynchronous reads; see sfs_disk.c */
+void disk_prefetch(struct disk *d, const u_int32_t blocks[], u_int32_t n);
+void disk_aread(struct disk *d, struct disk_io ios[], u_int32_t n);
+void disk_await(struct disk *d, struct disk_io ios[], u_int32_t n);
+const char *disk_aio_engine(struct disk *d);
+
+/* In-place block access; NULL unless the image is mapped */
+const void *disk_block_ptr(struct disk *d, u_int32_t block);
+
+/* Metadata journal; see sfs_disk.c */
+int disk_journal_open(struct disk *d, u_int32_t start, u_int32_t nblocks);
+int disk_tx_begin(struct disk *d, u_int32_t nblocks);
+void disk_tx_end(struct disk *d, u_int32_t nblocks);
+void disk_tx_commit(struct disk *d);
+void disk_tx_hold(struct disk *d, int hold);
+u_int32_t disk_tx_seq(struct disk *d);
+
+void disk_sync(struct disk *d);
+void disk_getstats(struct disk *d, struct disk_stats *ds);
+void disk_close(struct disk *d);
+
+#endif /*_SFS_DISK_H_*/
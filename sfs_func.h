@@ -1,8 +1,27 @@
 #ifndef _SFS_FUNC_H_
 #define _SFS_FUNC_H_
 
+#include <sys/types.h>
+
+/* Flags for sfs_mount_opt() */
+#define SFS_MOUNT_MMAP	0x1	/* map the image, read structures in place */
+#define SFS_MOUNT_EXTENTS 0x2	/* from now on, map new files by extents */
+
+/* Flags for sfs_fsck_opt() */
+#define SFS_FSCK_QUIET	0x1	/* report problems only, not the tree */
+#define SFS_FSCK_REPAIR	0x2	/* make the freemap match the tree */
+
 void sfs_mount(const char* path);
+void sfs_mount_opt(const char* path, int flags);
+void sfs_mounts();
+int sfs_mounted();
+void sfs_use(const char* name);
 void sfs_umount();
+void sfs_umount_vol(const char* name);
+void sfs_set_verbose(int on);
+void sfs_sync();
+void sfs_begin();
+void sfs_commit();
 void sfs_ls(const char* path);
 void sfs_cd(const char* path);
 
@@ -13,9 +32,31 @@ void sfs_rm(const char* path);
 void sfs_mv(const char* src_name, const char* dst_name);
 void sfs_dump();
 void sfs_fsck();
+void sfs_fsck_opt(int flags);
 void sfs_bitmap();
+void sfs_bitmap_stats();
+void sfs_defrag();
+void sfs_df();
+void sfs_cachestat();
 
 void sfs_cpin(const char* local_path, const char* path);
 void sfs_cpout(const char* path, const char* local_path);
 
+/*
+ * Mount handles. A mounted volume may be used by several threads at
+ * once through these; the shell commands above work on the volume
+ * picked by sfs_mount() or sfs_use().
+ */
+struct sfs_fs;
+
+struct sfs_fs *sfs_fs_mount(const char* path, int flags);
+struct sfs_fs *sfs_fs_current();
+void sfs_fs_umount(struct sfs_fs *fs);
+void sfs_fs_sync(struct sfs_fs *fs);
+int sfs_fs_lookup(struct sfs_fs *fs, u_int32_t dir, const char* name,
+		  u_int32_t *ino);
+int sfs_fs_stat(struct sfs_fs *fs, u_int32_t ino, u_int32_t *size, int *type);
+ssize_t sfs_fs_read(struct sfs_fs *fs, u_int32_t ino, void *buf, size_t len,
+		    u_int32_t off);
+
 #endif /*_SFS_FUNC_H_*/
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
 
 /* optional */
 #include <sys/types.h>
@@ -18,1122 +21,4963 @@
 #include "sfs_disk.h"
 #include "sfs.h"
 
-void dump_directory();
+/*
+ * Inode cache.
+ *
+ * Inodes stay resident in a fixed table. iget() returns a referenced
+ * in-core inode, reading it on a miss, and iput() drops the reference.
+ * Changes are made to i_di in place and flagged with imark_dirty();
+ * dirty inodes are written back by iflush() at the end of a command, or
+ * when an unreferenced one is evicted to make room (CLOCK).
+ */
+#define ICACHE_SIZE	256
+#define ICACHE_NHASH	64
 
-/* BIT operation Macros */
-/* a=target variable, b=bit number to act upon 0-n */
-#define BIT_SET(a,b) ((a) |= (1<<(b)))
-#define BIT_CLEAR(a,b) ((a) &= ~(1<<(b)))
-#define BIT_FLIP(a,b) ((a) ^= (1<<(b)))
-#define BIT_CHECK(a,b) ((a) & (1<<(b)))
+struct inode {
+	u_int32_t i_ino;		// inode number, SFS_NOINO if free
+	int i_ref;			// references held
+	int i_dirty;			// i_di differs from the disk
+	int i_recent;			// CLOCK reference bit
+	struct inode *i_hnext;		// next inode on the hash chain
+	pthread_rwlock_t i_lock;	// guards i_di and the inode's blocks
+	struct sfs_inode i_di;		// the on-disk inode
+};
 
-static struct sfs_super spb;	// superblock
-static struct sfs_dir sd_cwd = { SFS_NOINO }; // current working directory
+/* Where a directory entry lives */
+struct dirloc {
+	u_int32_t dl_block;		// block holding the entry
+	int dl_slot;			// index of the entry in that block
+	int dl_hashed;			// block is a hash bucket block
+};
+
+/*
+ * Directory entry cache.
+ *
+ * Maps (parent inode, name) to the child's inode number, type and entry
+ * location; a negative entry records that the name does not exist. The
+ * table is direct mapped on a hash of the key. Cached locations are
+ * only hints: dir_find() checks the entry is still at the location
+ * before handing it out, since hashing may move entries between blocks.
+ */
+#define DCACHE_SIZE	1024
+
+struct dcache_ent {
+	u_int32_t dc_parent;		// parent inode, SFS_NOINO if unused
+	u_int32_t dc_ino;		// child inode, SFS_NOINO if negative
+	u_int16_t dc_type;		// SFS_TYPE_*, SFS_TYPE_INVAL if unknown
+	struct dirloc dc_loc;		// where the entry was found
+	char dc_name[SFS_NAMELEN];
+};
+
+/*
+ * A block freed on a journalled volume, and the transaction that
+ * records the free. File data is written in place, not journalled, so
+ * the block is not given out again until that transaction is committed:
+ * a crash before then brings back the file that owned it, intact.
+ */
+struct bm_pending {
+	u_int32_t pf_block;
+	u_int32_t pf_seq;		// set when the freemap is written back
+};
+
+/*
+ * A mounted volume: the image, the superblock and every cache of it.
+ *
+ * One mount may be used by several threads. Each inode has a
+ * reader/writer lock, held shared to read the inode and the blocks it
+ * owns and exclusive to change them; a directory is locked before its
+ * children, never after. The tables shared by all inodes have a mutex
+ * each: bm_lock for the freemap and the superblock counters,
+ * icache_lock for the inode table and dcache_lock for the entry cache.
+ * Those are taken after inode locks, one at a time but for bm_lock
+ * under icache_lock, and are held over calls into the disk layer, which
+ * has its own lock.
+ */
+struct sfs_fs {
+	struct disk *disk;
+	char *fs_path;			// image file, as given to mount
+	dev_t fs_dev;			// ...and its identity
+	ino_t fs_ino;
+	struct sfs_super spb;		// superblock
+	struct sfs_dir sd_cwd;		// the shell's working directory
+
+	/*
+	 * Geometry, from sp_blocksize. Block buffers on the stack are
+	 * sized for SFS_MAXBLOCKSIZE and used up to fs_bsize.
+	 */
+	u_int32_t fs_bsize;		// bytes per block
+	u_int32_t fs_dpb;		// directory entries per block
+	u_int32_t fs_ppb;		// block numbers per indirect block
+	int fs_journal;			// metadata goes through a journal
+
+	pthread_mutex_t bm_lock;
+	u_int64_t *bm_map;		// freemap words
+	u_int32_t bm_nwords;		// # of words in bm_map
+	u_int32_t bm_nblocks;		// # of freemap blocks on disk
+	u_int32_t bm_hint;		// word to start the next search at
+	unsigned char *bm_dirty;	// per freemap block: needs write back
+	int sb_dirty;			// superblock counters need write back
+	u_int64_t *bm_fresh;		// taken since the last commit
+	u_int32_t bm_fseq;		// ...which was before this transaction
+	u_int64_t *bm_pend;		// freed, not yet committed: held back
+	struct bm_pending *bm_plist;	// ...in the order they were freed
+	u_int32_t bm_ptag;		// first entry not written back yet
+	u_int32_t bm_npend, bm_pmax;	// entries in use, allocated
+
+	pthread_mutex_t icache_lock;
+	struct inode icache[ICACHE_SIZE];
+	struct inode *ihash[ICACHE_NHASH];
+	unsigned ihand;
+	unsigned long icache_hits, icache_misses;
+
+	pthread_mutex_t dcache_lock;
+	struct dcache_ent dcache[DCACHE_SIZE];
+	unsigned long dcache_hits, dcache_misses;
+
+	int fs_batch;			// sfs_begin() nesting depth
+};
+
+/*
+ * The shell keeps up to SFS_MAXMOUNT volumes mounted at once, each with
+ * its caches and working directory; commands work on cur_fs.
+ */
+#define SFS_MAXMOUNT	8
+
+static struct sfs_fs *mounts[SFS_MAXMOUNT];
+static struct sfs_fs *cur_fs;		// the mount shell commands work on
+static int sh_verbose = 1;		// report mounts and unmounts
+
+void dump_directory(struct sfs_fs *fs, const struct sfs_dir dir_entry[]);
+void error_message(const char *message, const char *path, int error_code);
+
+/*
+ * Contents of BLOCK for read-only use: in place when the image is
+ * mapped, otherwise read into BUF (which must hold a whole block).
+ */
+static const void *block_get(struct sfs_fs *fs, void *buf, u_int32_t block)
+{
+	const void *p = disk_block_ptr(fs->disk, block);
+
+	if (p == NULL) {
+		disk_read(fs->disk, buf, block);
+		p = buf;
+	}
+	return p;
+}
+
+/*
+ * In-memory free block bitmap.
+ *
+ * The freemap is loaded once at mount time and kept as 64-bit words
+ * (bit b of the map is block b, LSB first, as on disk). Allocation
+ * looks for a word that is not all ones starting at a hint and picks
+ * its lowest clear bit; only bitmap blocks that changed are written
+ * back by bitmap_flush().
+ *
+ * A caller that knows where a block belongs passes it as a goal: the
+ * block after the file's last one, the parent directory of a new inode.
+ * The goal and the blocks after it are taken first, as far as the end
+ * of the group the goal is in, a group being the blocks one freemap
+ * block covers. Past that the search falls back to the hint, so a full
+ * region costs a bounded scan instead of one to the end of the volume.
+ *
+ * The free block count and the search position are kept in the
+ * superblock (SFS_FEAT_FREECOUNT), so a full volume is refused without
+ * looking at the map and the next mount resumes where this one stopped.
+ */
+#define BM_WORDBITS	64
+#define BM_BLOCKWORDS(fs)	((fs)->fs_bsize / sizeof(u_int64_t))
+
+/*
+ * Number of blocks marked in use, counted a word at a time. Bits past
+ * the end of the volume are ignored.
+ */
+static u_int32_t bitmap_count_used(struct sfs_fs *fs)
+{
+	u_int32_t w, used = 0;
+	u_int32_t full = fs->spb.sp_nblocks / BM_WORDBITS;
+	u_int32_t tail = fs->spb.sp_nblocks % BM_WORDBITS;
+
+	for (w = 0; w < full; w++)
+		used += __builtin_popcountll(fs->bm_map[w]);
+	if (tail)
+		used += __builtin_popcountll(fs->bm_map[full] & ((1ULL << tail) - 1));
+	return used;
+}
+
+static void bitmap_load(struct sfs_fs *fs)
+{
+	u_int32_t i, nfree;
+
+	fs->bm_nblocks = (fs->spb.sp_nblocks + SFS_BITS(fs->fs_bsize) - 1) /
+			 SFS_BITS(fs->fs_bsize);
+	fs->bm_nwords = fs->bm_nblocks * BM_BLOCKWORDS(fs);
+	fs->bm_map = malloc(fs->bm_nblocks * fs->fs_bsize);
+	fs->bm_dirty = calloc(fs->bm_nblocks, 1);
+	fs->bm_fresh = calloc(fs->bm_nwords, sizeof(u_int64_t));
+	fs->bm_pend = calloc(fs->bm_nwords, sizeof(u_int64_t));
+	assert(fs->bm_map != NULL && fs->bm_dirty != NULL &&
+	       fs->bm_fresh != NULL && fs->bm_pend != NULL);
+
+	for (i = 0; i < fs->bm_nblocks; i++) {
+		disk_read(fs->disk, fs->bm_map + i * BM_BLOCKWORDS(fs),
+			  SFS_MAP_LOCATION + i);
+	}
+
+	/*
+	 * The map is in memory anyway, so checking the stored count is one
+	 * popcount pass; it repairs volumes written by tools that do not
+	 * maintain it.
+	 */
+	nfree = fs->spb.sp_nblocks - bitmap_count_used(fs);
+	if (!(fs->spb.sp_features & SFS_FEAT_FREECOUNT) ||
+	    fs->spb.sp_nfree != nfree) {
+		fs->spb.sp_features |= SFS_FEAT_FREECOUNT;
+		fs->spb.sp_nfree = nfree;
+		fs->sb_dirty = 1;
+	}
+	fs->bm_hint = fs->spb.sp_allochint / BM_WORDBITS;
+	if (fs->bm_hint >= fs->bm_nwords)
+		fs->bm_hint = 0;
+}
+
+/*
+ * Write back the changed freemap blocks and the superblock. Blocks freed
+ * since the last write back are now recorded in the running transaction.
+ */
+static void bitmap_flush(struct sfs_fs *fs)
+{
+	u_int32_t i, seq;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	for (i = 0; i < fs->bm_nblocks; i++) {
+		if (fs->bm_dirty[i]) {
+			disk_write(fs->disk, fs->bm_map + i * BM_BLOCKWORDS(fs),
+				   SFS_MAP_LOCATION + i);;
+			fs->bm_dirty[i] = 0;
+		}
+	}
+	if (fs->bm_ptag < fs->bm_npend) {
+		seq = disk_tx_seq(fs->disk);
+		for (i = fs->bm_ptag; i < fs->bm_npend; i++)
+			fs->bm_plist[i].pf_seq = seq;
+		fs->bm_ptag = fs->bm_npend;
+	}
+	if (fs->sb_dirty) {
+		fs->spb.sp_allochint = fs->bm_hint * BM_WORDBITS;
+		disk_write_part(fs->disk, &fs->spb, SFS_SB_LOCATION,
+				sizeof(fs->spb));
+		fs->sb_dirty = 0;
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+}
+
+static void bitmap_unload(struct sfs_fs *fs)
+{
+	bitmap_flush(fs);
+	free(fs->bm_map);
+	free(fs->bm_dirty);
+	free(fs->bm_fresh);
+	free(fs->bm_pend);
+	free(fs->bm_plist);
+	fs->bm_map = fs->bm_fresh = fs->bm_pend = NULL;
+	fs->bm_dirty = NULL;
+	fs->bm_plist = NULL;
+	fs->bm_nwords = fs->bm_nblocks = fs->bm_hint = 0;
+	fs->bm_ptag = fs->bm_npend = fs->bm_pmax = 0;
+}
+
+static void bitmap_mark(struct sfs_fs *fs, u_int32_t block, int inuse)
+{
+	u_int32_t w = block / BM_WORDBITS;
+	u_int64_t mask = 1ULL << (block % BM_WORDBITS);
+
+	assert(block < fs->spb.sp_nblocks);
+	if (inuse) {
+		assert(!(fs->bm_map[w] & mask));
+		fs->bm_map[w] |= mask;
+		fs->bm_fresh[w] |= mask;
+		fs->spb.sp_nfree--;
+	}
+	else {
+		assert(fs->bm_map[w] & mask);
+		fs->bm_map[w] &= ~mask;
+		fs->spb.sp_nfree++;
+		if (w < fs->bm_hint)
+			fs->bm_hint = w;
+	}
+	fs->bm_dirty[w / BM_BLOCKWORDS(fs)] = 1;
+	fs->sb_dirty = 1;
+}
+
+/*
+ * Word W of the freemap as the allocator sees it: blocks whose free is
+ * not committed yet count as used.
+ */
+static inline u_int64_t bitmap_word(struct sfs_fs *fs, u_int32_t w)
+{
+	return fs->bm_map[w] | fs->bm_pend[w];
+}
+
+static int bitmap_busy(struct sfs_fs *fs, u_int32_t block)
+{
+	return (bitmap_word(fs, block / BM_WORDBITS) >>
+		(block % BM_WORDBITS)) & 1;
+}
+
+/*
+ * Catch up with the commits since the last call: blocks taken before
+ * them are no longer fresh, and those whose free they record go back
+ * to the allocator. The caller holds bm_lock.
+ */
+static void bitmap_reclaim(struct sfs_fs *fs)
+{
+	struct bm_pending *pf;
+	u_int32_t seq, w, n;
+
+	seq = disk_tx_seq(fs->disk);
+	if (seq != fs->bm_fseq) {
+		bzero(fs->bm_fresh, fs->bm_nwords * sizeof(u_int64_t));
+		fs->bm_fseq = seq;
+	}
+	if (fs->bm_ptag == 0)
+		return;
+	for (n = 0; n < fs->bm_ptag; n++) {
+		pf = &fs->bm_plist[n];
+		// no journal (any more): nothing to wait for
+		if (seq != 0 && pf->pf_seq >= seq)
+			break;
+		w = pf->pf_block / BM_WORDBITS;
+		fs->bm_pend[w] &= ~(1ULL << (pf->pf_block % BM_WORDBITS));
+		if (w < fs->bm_hint)
+			fs->bm_hint = w;
+	}
+	if (n == 0)
+		return;
+	memmove(fs->bm_plist, fs->bm_plist + n,
+		(fs->bm_npend - n) * sizeof(fs->bm_plist[0]));
+	fs->bm_ptag -= n;
+	fs->bm_npend -= n;
+}
+
+static u_int32_t bitmap_alloc_locked(struct sfs_fs *fs, u_int32_t goal)
+{
+	u_int32_t w, end, block;
+	u_int64_t word;
+
+	bitmap_reclaim(fs);
+	if (fs->spb.sp_nfree == fs->bm_npend)
+		return 0;
+
+	if (goal != 0 && goal < fs->spb.sp_nblocks) {
+		w = goal / BM_WORDBITS;
+		end = (w / BM_BLOCKWORDS(fs) + 1) * BM_BLOCKWORDS(fs);
+		if (end > fs->bm_nwords)
+			end = fs->bm_nwords;
+		// the bits below the goal count as used
+		word = bitmap_word(fs, w) | ((1ULL << (goal % BM_WORDBITS)) - 1);
+		while (word == ~0ULL && ++w < end)
+			word = bitmap_word(fs, w);
+		if (w < end) {
+			block = w * BM_WORDBITS + __builtin_ctzll(~word);
+			if (block < fs->spb.sp_nblocks) {
+				bitmap_mark(fs, block, 1);
+				return block;
+			}
+		}
+	}
+
+	for (w = fs->bm_hint; w < fs->bm_nwords; w++) {
+		if (bitmap_word(fs, w) != ~0ULL)
+			break;
+	}
+	fs->bm_hint = w;
+	block = w < fs->bm_nwords ?
+		w * BM_WORDBITS + __builtin_ctzll(~bitmap_word(fs, w)) :
+		fs->spb.sp_nblocks;
+	if (block >= fs->spb.sp_nblocks)
+		return 0;
+	bitmap_mark(fs, block, 1);
+	return block;
+}
+
+/*
+ * Allocate a free block, near GOAL if that is not 0. Returns its
+ * number, or 0 (the superblock, never free) if the volume is full.
+ */
+static u_int32_t bitmap_alloc(struct sfs_fs *fs, u_int32_t goal)
+{
+	u_int32_t block;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	block = bitmap_alloc_locked(fs, goal);
+	pthread_mutex_unlock(&fs->bm_lock);
+	return block;
+}
+
+/*
+ * First block of the first run of N free blocks from block FROM up to
+ * block TO, looked for a word at a time where the words are all used
+ * or all free; 0 if there is none. The caller holds bm_lock.
+ */
+static u_int32_t bitmap_find_run(struct sfs_fs *fs, u_int32_t from,
+				 u_int32_t to, u_int32_t n)
+{
+	u_int32_t b, first = 0, len = 0;
+	u_int64_t word;
+
+	if (to > fs->spb.sp_nblocks)
+		to = fs->spb.sp_nblocks;
+	for (b = from; b < to && len < n; ) {
+		word = bitmap_word(fs, b / BM_WORDBITS);
+		if (b % BM_WORDBITS == 0 && b + BM_WORDBITS <= to &&
+		    (word == 0 || word == ~0ULL)) {
+			if (word == 0) {
+				if (len == 0)
+					first = b;
+				len += BM_WORDBITS;
+			}
+			else {
+				len = 0;
+			}
+			b += BM_WORDBITS;
+			continue;
+		}
+		if (word & (1ULL << (b % BM_WORDBITS))) {
+			len = 0;
+		}
+		else {
+			if (len == 0)
+				first = b;
+			len++;
+		}
+		b++;
+	}
+	return len < n ? 0 : first;
+}
+
+/*
+ * Allocate up to WANT contiguous blocks and store the first in START;
+ * returns the run length, 0 if the volume is full. The run starts at
+ * GOAL if that is free, so a file keeps growing in place; otherwise at
+ * the first run of WANT free blocks after GOAL, and only if there is
+ * none at the block bitmap_alloc() would pick, with as many free blocks
+ * following it as there are.
+ */
+static u_int32_t bitmap_alloc_run(struct sfs_fs *fs, u_int32_t goal,
+				  u_int32_t want, u_int32_t *start)
+{
+	u_int32_t b = 0, n;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	bitmap_reclaim(fs);
+	if (want > 1 && goal != 0 && goal < fs->spb.sp_nblocks &&
+	    bitmap_busy(fs, goal))
+		b = bitmap_find_run(fs, goal, fs->spb.sp_nblocks, want);
+	if (b != 0)
+		bitmap_mark(fs, b, 1);
+	else
+		b = bitmap_alloc_locked(fs, goal);
+	if (b == 0) {
+		pthread_mutex_unlock(&fs->bm_lock);
+		return 0;
+	}
+	*start = b;
+	for (n = 1; n < want && ++b < fs->spb.sp_nblocks; n++) {
+		if (bitmap_busy(fs, b))
+			break;
+		bitmap_mark(fs, b, 1);
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+	return n;
+}
+
+/*
+ * Allocate N contiguous blocks: the first run of free blocks that is
+ * long enough. The first block is stored in START; returns 0 if there
+ * is no such run.
+ */
+static int bitmap_alloc_contig(struct sfs_fs *fs, u_int32_t n,
+			       u_int32_t *start)
+{
+	u_int32_t first = 0, i;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	bitmap_reclaim(fs);
+	if (n > 0 && n <= fs->spb.sp_nfree - fs->bm_npend)
+		first = bitmap_find_run(fs, fs->bm_hint * BM_WORDBITS,
+					fs->spb.sp_nblocks, n);
+	if (first == 0) {
+		pthread_mutex_unlock(&fs->bm_lock);
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		bitmap_mark(fs, first + i, 1);
+	pthread_mutex_unlock(&fs->bm_lock);
+	*start = first;
+	return 1;
+}
+
+/*
+ * Free BLOCK. On a journalled volume it is held back from the allocator
+ * until the free is committed (struct bm_pending), unless it was taken
+ * since the last commit: then no committed transaction has it in use,
+ * as with the unused part of a reservation.
+ */
+static void bitmap_free(struct sfs_fs *fs, u_int32_t block)
+{
+	u_int32_t w = block / BM_WORDBITS;
+	u_int64_t mask = 1ULL << (block % BM_WORDBITS);
+	int fresh;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	bitmap_reclaim(fs);
+	fresh = (fs->bm_fresh[w] & mask) != 0;
+	bitmap_mark(fs, block, 0);
+	fs->bm_fresh[w] &= ~mask;
+	if (fs->fs_journal && !fresh) {
+		if (fs->bm_npend == fs->bm_pmax) {
+			fs->bm_pmax = fs->bm_pmax ? 2 * fs->bm_pmax : 256;
+			fs->bm_plist = realloc(fs->bm_plist, fs->bm_pmax *
+					       sizeof(fs->bm_plist[0]));
+			assert(fs->bm_plist != NULL);
+		}
+		fs->bm_plist[fs->bm_npend].pf_block = block;
+		fs->bm_plist[fs->bm_npend++].pf_seq = 0;
+		fs->bm_pend[w] |= mask;
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+}
+
+/*
+ * Whether BLOCK was taken since the last commit, on a journalled volume:
+ * nothing committed refers to it then.
+ */
+static int bitmap_fresh(struct sfs_fs *fs, u_int32_t block)
+{
+	int fresh;
+
+	if (!fs->fs_journal)
+		return 0;
+	pthread_mutex_lock(&fs->bm_lock);
+	bitmap_reclaim(fs);
+	fresh = (fs->bm_fresh[block / BM_WORDBITS] >>
+		 (block % BM_WORDBITS)) & 1;
+	pthread_mutex_unlock(&fs->bm_lock);
+	return fresh;
+}
+
+/*
+ * Write the first LEN bytes of metadata block BLOCK. A fresh one goes
+ * straight home rather than into the journal, which only has to hold
+ * the blocks that committed transactions already refer to.
+ */
+static void meta_write_part(struct sfs_fs *fs, const void *data,
+			    u_int32_t block, u_int32_t len)
+{
+	if (bitmap_fresh(fs, block))
+		disk_write_new(fs->disk, data, block, len);
+	else
+		disk_write_part(fs->disk, data, block, len);
+}
+
+static void meta_write(struct sfs_fs *fs, const void *data, u_int32_t block)
+{
+	meta_write_part(fs, data, block, fs->fs_bsize);
+}
+
+/*
+ * Number of blocks that can be taken: free on the volume and not held
+ * back.
+ */
+static u_int32_t bitmap_nfree(struct sfs_fs *fs)
+{
+	u_int32_t nfree;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	bitmap_reclaim(fs);
+	nfree = fs->spb.sp_nfree - fs->bm_npend;
+	pthread_mutex_unlock(&fs->bm_lock);
+	return nfree;
+}
+
+/* Set superblock feature FLAG; it is written with the freemap */
+static void sb_set_feature(struct sfs_fs *fs, u_int32_t flag)
+{
+	pthread_mutex_lock(&fs->bm_lock);
+	if (!(fs->spb.sp_features & flag)) {
+		fs->spb.sp_features |= flag;
+		fs->sb_dirty = 1;
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+}
+
+static void iunhash(struct sfs_fs *fs, struct inode *ip)
+{
+	struct inode **pp;
+
+	for (pp = &fs->ihash[ip->i_ino % ICACHE_NHASH]; *pp != NULL;
+	     pp = &(*pp)->i_hnext) {
+		if (*pp == ip) {
+			*pp = ip->i_hnext;
+			break;
+		}
+	}
+	ip->i_hnext = NULL;
+	ip->i_ino = SFS_NOINO;
+}
+
+/* Referenced slot for INO, not yet filled in */
+static struct inode *islot(struct sfs_fs *fs, u_int32_t ino)
+{
+	struct inode *ip;
+	unsigned tries;
+
+	for (tries = 0; tries < 2 * ICACHE_SIZE; tries++) {
+		ip = &fs->icache[fs->ihand];
+		fs->ihand = (fs->ihand + 1) % ICACHE_SIZE;
+		if (ip->i_ref > 0)
+			continue;
+		if (ip->i_ino != SFS_NOINO && ip->i_recent) {
+			ip->i_recent = 0;
+			continue;
+		}
+		if (ip->i_ino != SFS_NOINO) {
+			if (ip->i_dirty)
+				meta_write_part(fs, &ip->i_di, ip->i_ino,
+						sizeof(ip->i_di));
+			iunhash(fs, ip);
+		}
+		ip->i_ino = ino;
+		ip->i_ref = 1;
+		ip->i_dirty = 0;
+		ip->i_recent = 1;
+		ip->i_hnext = fs->ihash[ino % ICACHE_NHASH];
+		fs->ihash[ino % ICACHE_NHASH] = ip;
+		return ip;
+	}
+	assert(!"inode cache: every inode is referenced");
+	return NULL;
+}
+
+/* In-core inode INO, read from disk if not resident; not locked */
+static struct inode *iget(struct sfs_fs *fs, u_int32_t ino)
+{
+	struct inode *ip;
+
+	pthread_mutex_lock(&fs->icache_lock);
+	for (ip = fs->ihash[ino % ICACHE_NHASH]; ip != NULL; ip = ip->i_hnext) {
+		if (ip->i_ino == ino) {
+			ip->i_ref++;
+			ip->i_recent = 1;
+			fs->icache_hits++;
+			pthread_mutex_unlock(&fs->icache_lock);
+			return ip;
+		}
+	}
+	fs->icache_misses++;
+	ip = islot(fs, ino);
+	disk_read_part(fs->disk, &ip->i_di, ino, sizeof(ip->i_di));
+	pthread_mutex_unlock(&fs->icache_lock);
+	return ip;
+}
+
+/*
+ * In-core inode for freshly allocated block INO, zeroed, dirty and
+ * locked exclusive: nobody else can know of it yet.
+ */
+static struct inode *iget_new(struct sfs_fs *fs, u_int32_t ino)
+{
+	struct inode *ip;
+
+	pthread_mutex_lock(&fs->icache_lock);
+	ip = islot(fs, ino);
+	bzero(&ip->i_di, sizeof(ip->i_di));
+	ip->i_dirty = 1;
+	if (pthread_rwlock_trywrlock(&ip->i_lock) != 0)
+		assert(!"iget_new: inode in use");
+	pthread_mutex_unlock(&fs->icache_lock);
+	return ip;
+}
+
+static void iput(struct sfs_fs *fs, struct inode *ip)
+{
+	pthread_mutex_lock(&fs->icache_lock);
+	assert(ip->i_ref > 0);
+	ip->i_ref--;
+	pthread_mutex_unlock(&fs->icache_lock);
+}
+
+/*
+ * Inode locks: shared to read an inode and the blocks it owns,
+ * exclusive to change them. iget() and iput() only deal in references.
+ */
+static void irlock(struct inode *ip)
+{
+	pthread_rwlock_rdlock(&ip->i_lock);
+}
+
+static void iwlock(struct inode *ip)
+{
+	pthread_rwlock_wrlock(&ip->i_lock);
+}
+
+static void iunlock(struct inode *ip)
+{
+	pthread_rwlock_unlock(&ip->i_lock);
+}
+
+/* Caller holds IP locked exclusive */
+static void imark_dirty(struct inode *ip)
+{
+	ip->i_dirty = 1;
+}
+
+/*
+ * The inode's block is being freed: drop it, unlocked, without writing
+ * it back. Another thread still holding a reference keeps a stale copy.
+ */
+static void idrop(struct sfs_fs *fs, struct inode *ip)
+{
+	pthread_mutex_lock(&fs->icache_lock);
+	assert(ip->i_ref > 0);
+	ip->i_ref--;
+	ip->i_dirty = 0;
+	iunhash(fs, ip);
+	pthread_mutex_unlock(&fs->icache_lock);
+}
+
+/*
+ * Write every dirty inode back. One locked exclusive is being changed
+ * and is skipped; its owner flushes it when done.
+ */
+static void iflush(struct sfs_fs *fs)
+{
+	struct inode *ip;
+	int i;
+
+	pthread_mutex_lock(&fs->icache_lock);
+	for (i = 0; i < ICACHE_SIZE; i++) {
+		ip = &fs->icache[i];
+		if (ip->i_ino == SFS_NOINO)
+			continue;
+		// i_dirty is set under the inode lock: test it under it
+		if (pthread_rwlock_tryrdlock(&ip->i_lock) != 0)
+			continue;
+		if (ip->i_dirty) {
+			meta_write_part(fs, &ip->i_di, ip->i_ino,
+					sizeof(ip->i_di));
+			ip->i_dirty = 0;
+		}
+		pthread_rwlock_unlock(&ip->i_lock);
+	}
+	pthread_mutex_unlock(&fs->icache_lock);
+}
+
+/* Flush and empty the cache, at unmount */
+static void icache_purge(struct sfs_fs *fs)
+{
+	int i;
+
+	iflush(fs);
+	for (i = 0; i < ICACHE_SIZE; i++)
+		pthread_rwlock_destroy(&fs->icache[i].i_lock);
+	bzero(fs->icache, sizeof(fs->icache));
+	bzero(fs->ihash, sizeof(fs->ihash));
+	fs->ihand = 0;
+}
+
+/*
+ * Batches (sfs_begin() ... sfs_commit()). Inside one, commands leave
+ * their inodes and bitmap blocks dirty in memory and the batch ends as
+ * a single operation, so the blocks that every command touches (the
+ * parent directory's inode, the bitmap, the superblock) are written
+ * once, at commit. A batch is not undone as a whole: a command that
+ * fails inside it changes nothing itself, and the rest still commit.
+ *
+ * On a journalled volume every command is an operation of its own and
+ * writes back when done, so that a transaction is only ever committed
+ * between commands. The batch holds off group commits and ends with a
+ * commit, so it is durable all at once; but if the journal fills up,
+ * or most free blocks are held back by the frees the batch made (they
+ * are not reused before a commit), what has run so far is committed
+ * first and a crash may keep only part of the batch.
+ */
+
+/* Write back dirty inodes, then the freemap */
+static void fs_writeback(struct sfs_fs *fs)
+{
+	iflush(fs);
+	bitmap_flush(fs);
+}
+
+/*
+ * Journal credits: the most blocks an operation may journal. Blocks it
+ * takes go straight home (meta_write()), so what counts is what was on
+ * the volume before: the superblock, up to FS_TXINODES inodes and
+ * FS_TXDIRBLKS directory blocks, and a freemap block per block taken or
+ * freed, up to all of them.
+ */
+#define FS_TXINODES	4
+#define FS_TXDIRBLKS	4
+
+static u_int32_t fs_credits(struct sfs_fs *fs, u_int32_t nblk)
+{
+	return 1 + FS_TXINODES + FS_TXDIRBLKS +
+	       (nblk < fs->bm_nblocks ? nblk : fs->bm_nblocks);
+}
+
+/*
+ * A command that may journal CREDITS blocks is about to change the
+ * volume. On a journalled volume no transaction is committed until it
+ * calls fs_flush(), so a commit never catches it half done; it may have
+ * to wait for room in the journal first. Returns 0, or -12 if the
+ * journal is too small for it.
+ */
+static int fs_start(struct sfs_fs *fs, u_int32_t credits)
+{
+	int reclaim;
+
+	// most of what is free is held back: commit first to get it
+	pthread_mutex_lock(&fs->bm_lock);
+	reclaim = fs->bm_ptag > 0 &&
+		  2 * fs->bm_npend > fs->spb.sp_nfree;
+	pthread_mutex_unlock(&fs->bm_lock);
+	if (reclaim)
+		disk_tx_commit(fs->disk);
+
+	if (disk_tx_begin(fs->disk, credits) != 0)
+		return -12;
+	return 0;
+}
+
+/*
+ * Write back what the command changed, unless it is part of a batch on
+ * a volume without a journal, and end its transaction.
+ */
+static void fs_flush(struct sfs_fs *fs, u_int32_t credits)
+{
+	if (fs->fs_batch == 0 || fs->fs_journal)
+		fs_writeback(fs);
+	disk_tx_end(fs->disk, credits);
+}
+
+typedef int (*dir_visit_t)(const struct sfs_dir *ent,
+			   const struct dirloc *loc, void *arg);
+
+static int is_dot(const char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* Hash of NAME for hashed directories (FNV-1a) */
+static u_int32_t dir_hash(const char *name)
+{
+	u_int32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Slot of live entry NAME among SD[FIRST..], or -1 */
+static int dirblk_find(struct sfs_fs *fs, const struct sfs_dir *sd, int first,
+		       const char *name)
+{
+	int j;
+
+	for (j = first; j < fs->fs_dpb; j++) {
+		if (sd[j].sfd_ino != SFS_NOINO &&
+		    strcmp(sd[j].sfd_name, name) == 0)
+			return j;
+	}
+	return -1;
+}
+
+/* Copy NAME to the SFS_NAMELEN bytes at DST, cut short if need be */
+static void name_copy(char *dst, const char *name)
+{
+	size_t len = strnlen(name, SFS_NAMELEN - 1);
+
+	memcpy(dst, name, len);
+	dst[len] = '\0';
+}
+
+/* Fill in entry D: NAME -> INO, with the type byte if NAME leaves room */
+static void dirent_set(struct sfs_dir *d, const char *name, u_int32_t ino,
+		       u_int16_t type)
+{
+	bzero(d->sfd_name, SFS_NAMELEN);
+	d->sfd_ino = ino;
+	name_copy(d->sfd_name, name);
+	if (d->sfd_name[SFS_DTYPE_OFF - 1] == '\0')
+		d->sfd_name[SFS_DTYPE_OFF] = type;
+}
+
+/* Type stored in entry D, SFS_TYPE_INVAL if it has none */
+static u_int16_t dirent_type(const struct sfs_dir *d)
+{
+	unsigned char t = d->sfd_name[SFS_DTYPE_OFF];
+
+	if (d->sfd_name[SFS_DTYPE_OFF - 1] != '\0' ||
+	    (t != SFS_TYPE_FILE && t != SFS_TYPE_DIR))
+		return SFS_TYPE_INVAL;
+	return t;
+}
+
+/*
+ * Type of the child of entry D, from its inode if the entry lacks it.
+ * An inode's type never changes, so the child is not locked; that also
+ * keeps ".." from being locked after the directory holding it.
+ */
+static u_int16_t dirent_type_get(struct sfs_fs *fs, const struct sfs_dir *d)
+{
+	u_int16_t type = dirent_type(d);
+	struct inode *ip;
+
+	if (type == SFS_TYPE_INVAL) {
+		ip = iget(fs, d->sfd_ino);
+		type = ip->i_di.sfi_type;
+		iput(fs, ip);
+	}
+	return type;
+}
+
+/* Bucket pointer I of hashed directory DIR */
+static u_int32_t dirhash_get(struct sfs_fs *fs, const struct sfs_inode *dir,
+			     u_int32_t i)
+{
+	u_int32_t buf[SFS_MAXPTRS];
+	const u_int32_t *idx;
+	u_int32_t leaf;
+
+	idx = block_get(fs, buf, dir->sfi_indirect);
+	leaf = idx[i / fs->fs_ppb];
+	if (leaf == 0)
+		return 0;
+	idx = block_get(fs, buf, leaf);
+	return idx[i % fs->fs_ppb];
+}
+
+/*
+ * Set bucket pointer I of hashed directory DIR to BLK, allocating the
+ * leaf index block on first use. Returns 0 or -4 (no block).
+ */
+static int dirhash_set(struct sfs_fs *fs, const struct sfs_inode *dir,
+		       u_int32_t i, u_int32_t blk)
+{
+	u_int32_t top[SFS_MAXPTRS], leaf[SFS_MAXPTRS];
+	u_int32_t leafblk;
+
+	disk_read(fs->disk, top, dir->sfi_indirect);
+	leafblk = top[i / fs->fs_ppb];
+	if (leafblk == 0) {
+		leafblk = bitmap_alloc(fs, dir->sfi_indirect);
+		if (leafblk == 0)
+			return -4;
+		bzero(leaf, fs->fs_bsize);
+		top[i / fs->fs_ppb] = leafblk;
+		meta_write(fs, top, dir->sfi_indirect);
+	}
+	else {
+		disk_read(fs->disk, leaf, leafblk);
+	}
+	leaf[i % fs->fs_ppb] = blk;
+	meta_write(fs, leaf, leafblk);
+	return 0;
+}
+
+/*
+ * Start reading the buckets of pointers FIRST to FIRST+N-1 of hashed
+ * directory DIR; N is at most DISK_RA_MAX.
+ */
+static void dirhash_prefetch(struct sfs_fs *fs, const struct sfs_inode *dir,
+			     u_int32_t first, u_int32_t n)
+{
+	u_int32_t top[SFS_MAXPTRS], leaf[SFS_MAXPTRS];
+	u_int32_t blocks[DISK_RA_MAX];
+	const u_int32_t *tp, *lp = NULL;
+	u_int32_t i, k = 0;
+
+	tp = block_get(fs, top, dir->sfi_indirect);
+	for (i = first; i < first + n; i++) {
+		if (lp == NULL || i % fs->fs_ppb == 0) {
+			if (tp[i / fs->fs_ppb] == 0)
+				break;
+			lp = block_get(fs, leaf, tp[i / fs->fs_ppb]);
+		}
+		blocks[k++] = lp[i % fs->fs_ppb];
+	}
+	disk_prefetch(fs->disk, blocks, k);
+}
+
+/*
+ * Call FN on the contents of every bucket block of hashed directory DIR,
+ * overflow blocks included. A bucket shared by several pointers is
+ * visited once, from the pointer equal to its prefix. The chain pointer
+ * is read before the call, so FN may free the block. The buckets ahead
+ * of the walk are read ahead.
+ */
+static int dirhash_walk(struct sfs_fs *fs, const struct sfs_inode *dir,
+			int (*fn)(const struct sfs_dir *sd, u_int32_t blk,
+				  void *arg),
+			void *arg)
+{
+	struct sfs_dir buf[SFS_MAXDENTRIES];
+	const struct sfs_dir *sd;
+	const struct sfs_dirbucket *hdr;
+	struct disk_ra ra;
+	u_int32_t i, n = 1U << dir->sfi_hashdepth;
+	u_int32_t blk, next, first, want;
+	int ret;
+
+	disk_ra_init(fs->disk, &ra, 0);
+	for (i = 0; i < n; i++) {
+		want = disk_ra_access(&ra, i, 1, &first);
+		if (want > 0 && first < n)
+			dirhash_prefetch(fs, dir, first,
+					 want < n - first ? want : n - first);
+		blk = dirhash_get(fs, dir, i);
+		sd = block_get(fs, buf, blk);
+		hdr = (const struct sfs_dirbucket *)sd;
+		if (hdr->sdb_prefix != i)
+			continue;
+		for (; blk != 0; blk = next) {
+			sd = block_get(fs, buf, blk);
+			next = ((const struct sfs_dirbucket *)sd)->sdb_next;
+			ret = fn(sd, blk, arg);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static struct dcache_ent *dcache_slot(struct sfs_fs *fs, u_int32_t parent,
+				      const char *name)
+{
+	return &fs->dcache[(dir_hash(name) ^ parent * 2654435761u) %
+			   DCACHE_SIZE];
+}
+
+/* Look (PARENT, NAME) up; on a hit the entry is copied to DC and 1 returned */
+static int dcache_lookup(struct sfs_fs *fs, u_int32_t parent, const char *name,
+			 struct dcache_ent *dc)
+{
+	struct dcache_ent *ent = dcache_slot(fs, parent, name);
+	int hit;
+
+	pthread_mutex_lock(&fs->dcache_lock);
+	hit = ent->dc_parent == parent &&
+	      strncmp(ent->dc_name, name, SFS_NAMELEN) == 0;
+	if (hit) {
+		*dc = *ent;
+		fs->dcache_hits++;
+	}
+	else {
+		fs->dcache_misses++;
+	}
+	pthread_mutex_unlock(&fs->dcache_lock);
+	return hit;
+}
+
+/* Remember (PARENT, NAME) -> INO; INO == SFS_NOINO for a negative entry */
+static void dcache_enter(struct sfs_fs *fs, u_int32_t parent, const char *name,
+			 u_int32_t ino, u_int16_t type, const struct dirloc *loc)
+{
+	struct dcache_ent *dc = dcache_slot(fs, parent, name);
+
+	pthread_mutex_lock(&fs->dcache_lock);
+	dc->dc_parent = parent;
+	dc->dc_ino = ino;
+	dc->dc_type = type;
+	if (loc != NULL)
+		dc->dc_loc = *loc;
+	else
+		dc->dc_loc.dl_block = 0;
+	name_copy(dc->dc_name, name);
+	pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+/* Forget every entry whose parent is PARENT (all if SFS_NOINO) */
+static void dcache_purge(struct sfs_fs *fs, u_int32_t parent)
+{
+	int i;
+
+	pthread_mutex_lock(&fs->dcache_lock);
+	for (i = 0; i < DCACHE_SIZE; i++) {
+		if (parent == SFS_NOINO || fs->dcache[i].dc_parent == parent)
+			fs->dcache[i].dc_parent = SFS_NOINO;
+	}
+	pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+/*
+ * Contents of the direct blocks of directory DIR for read-only use, as
+ * block_get() gives one: SD[i] for sfi_direct[i], NULL where that is 0.
+ * The blocks not in the cache are read with one scattered read, a run
+ * of adjacent blocks at a time. BUF holds SFS_NDIRECT blocks.
+ */
+static void dir_blocks_get(struct sfs_fs *fs, const struct sfs_inode *dir,
+			   char *buf, const struct sfs_dir *sd[])
+{
+	void *bufs[SFS_NDIRECT];
+	u_int32_t blks[SFS_NDIRECT];
+	int i, n = 0;
+
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		sd[i] = NULL;
+		if (dir->sfi_direct[i] == 0)
+			continue;
+		sd[i] = disk_block_ptr(fs->disk, dir->sfi_direct[i]);
+		if (sd[i] != NULL)
+			continue;
+		bufs[n] = buf + i * fs->fs_bsize;
+		blks[n++] = dir->sfi_direct[i];
+		sd[i] = bufs[n - 1];
+	}
+	disk_read_list(fs->disk, bufs, blks, n);
+}
+
+/*
+ * Start reading the inodes of the live entries of directory block SD
+ * from slot FIRST on; with UNTYPED, only those of entries that lack a
+ * type, which is all a listing needs.
+ */
+static void dirblk_prefetch(struct sfs_fs *fs, const struct sfs_dir *sd,
+			    int first, int untyped)
+{
+	u_int32_t ino[SFS_MAXDENTRIES];
+	int j, n = 0;
+
+	for (j = first; j < fs->fs_dpb; j++) {
+		if (sd[j].sfd_ino == SFS_NOINO || is_dot(sd[j].sfd_name))
+			continue;
+		if (untyped && dirent_type(&sd[j]) != SFS_TYPE_INVAL)
+			continue;
+		ino[n++] = sd[j].sfd_ino;
+	}
+	disk_prefetch(fs->disk, ino, n);
+}
+
+/*
+ * Search directory DIR's blocks for NAME. On success the entry is copied
+ * to ENT, its location to LOC, and 0 is returned; -1 if there is no
+ * such entry.
+ */
+static int dir_scan(struct sfs_fs *fs, const struct sfs_inode *dir,
+		    const char *name, struct sfs_dir *ent, struct dirloc *loc)
+{
+	struct sfs_dir buf[SFS_MAXDENTRIES];
+	const struct sfs_dir *sd, *dsd[SFS_NDIRECT];
+	char *dbuf;
+	u_int32_t blk;
+	int i, j;
+
+	if (!(dir->sfi_flags & SFS_IFLAG_HASHDIR) || is_dot(name)) {
+		dbuf = malloc(SFS_NDIRECT * fs->fs_bsize);
+		assert(dbuf != NULL);
+		dir_blocks_get(fs, dir, dbuf, dsd);
+		for (i = 0; i < SFS_NDIRECT; i++) {
+			if (dsd[i] == NULL)
+				continue;
+			j = dirblk_find(fs, dsd[i], 0, name);
+			if (j >= 0) {
+				*ent = dsd[i][j];
+				loc->dl_block = dir->sfi_direct[i];
+				loc->dl_slot = j;
+				loc->dl_hashed = 0;
+				break;
+			}
+		}
+		free(dbuf);
+		return i < SFS_NDIRECT ? 0 : -1;
+	}
+
+	blk = dirhash_get(fs, dir,
+			  dir_hash(name) & ((1U << dir->sfi_hashdepth) - 1));
+	for (; blk != 0;
+	     blk = ((const struct sfs_dirbucket *)sd)->sdb_next) {
+		sd = block_get(fs, buf, blk);
+		j = dirblk_find(fs, sd, 1, name);
+		if (j >= 0) {
+			*ent = sd[j];
+			loc->dl_block = blk;
+			loc->dl_slot = j;
+			loc->dl_hashed = 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Look NAME up in directory DP, which the caller holds locked, through
+ * the entry cache. On success the entry is copied to ENT and 0 is
+ * returned; -1 if there is no such entry. TYPE, if not NULL, receives
+ * the child's type and LOC, if not NULL, the entry's location; a cache
+ * hit that needs no location does no I/O.
+ */
+static int dir_find(struct sfs_fs *fs, struct inode *dp, const char *name,
+		    struct sfs_dir *ent, u_int16_t *type, struct dirloc *loc)
+{
+	struct sfs_dir buf[SFS_MAXDENTRIES];
+	const struct sfs_dir *sd;
+	struct dcache_ent dc;
+	int hit;
+
+	hit = dcache_lookup(fs, dp->i_ino, name, &dc);
+	if (hit && dc.dc_ino == SFS_NOINO)
+		return -1;
+	if (hit && loc != NULL) {
+		/* make sure the entry has not moved */
+		sd = NULL;
+		if (dc.dc_loc.dl_block != 0)
+			sd = block_get(fs, buf, dc.dc_loc.dl_block);
+		if (sd == NULL || sd[dc.dc_loc.dl_slot].sfd_ino != dc.dc_ino ||
+		    strcmp(sd[dc.dc_loc.dl_slot].sfd_name, name) != 0)
+			hit = 0;
+	}
+	if (!hit) {
+		if (dir_scan(fs, &dp->i_di, name, ent, &dc.dc_loc) != 0) {
+			dcache_enter(fs, dp->i_ino, name, SFS_NOINO,
+				     SFS_TYPE_INVAL, NULL);
+			return -1;
+		}
+		dc.dc_ino = ent->sfd_ino;
+		dc.dc_type = dirent_type(ent);
+		dcache_enter(fs, dp->i_ino, name, dc.dc_ino, dc.dc_type,
+			     &dc.dc_loc);
+	}
+
+	ent->sfd_ino = dc.dc_ino;
+	name_copy(ent->sfd_name, name);
+	if (type != NULL) {
+		if (dc.dc_type == SFS_TYPE_INVAL) {
+			dc.dc_type = dirent_type_get(fs, ent);
+			dcache_enter(fs, dp->i_ino, name, dc.dc_ino, dc.dc_type,
+				     &dc.dc_loc);
+		}
+		*type = dc.dc_type;
+	}
+	if (loc != NULL)
+		*loc = dc.dc_loc;
+	return 0;
+}
+
+/*
+ * Path resolution.
+ *
+ * A path is a list of names separated by slashes, taken from the root
+ * if it starts with one and from a given directory otherwise. Each
+ * component is looked up through the entry cache with only the
+ * directory searched locked, so a path whose entries are cached is
+ * resolved without I/O and any other costs at most one directory scan
+ * per component.
+ */
+
+/*
+ * Copy the next component of *PATH to NAME (SFS_NAMELEN bytes) and
+ * advance *PATH past it. Returns 1, 0 if there is none left or -8 if
+ * it is too long for a directory entry.
+ */
+static int namei_comp(const char **path, char *name)
+{
+	const char *p = *path;
+	size_t len;
+
+	while (*p == '/')
+		p++;
+	if (*p == '\0')
+		return 0;
+	len = strcspn(p, "/");
+	if (len >= SFS_NAMELEN)
+		return -8;
+	memcpy(name, p, len);
+	name[len] = '\0';
+	*path = p + len;
+	return 1;
+}
+
+/*
+ * Look NAME up in directory DIR. Returns 0 with the entry in ENT and,
+ * if TYPE is not NULL, the child's type in *TYPE; -1 if there is no
+ * such entry or -2 if DIR is not a directory.
+ */
+static int namei_step(struct sfs_fs *fs, u_int32_t dir, const char *name,
+		      struct sfs_dir *ent, u_int16_t *type)
+{
+	struct inode *dp;
+	int error = 0;
+
+	dp = iget(fs, dir);
+	irlock(dp);
+	if (dp->i_di.sfi_type != SFS_TYPE_DIR)
+		error = -2;
+	else if (dir_find(fs, dp, name, ent, type, NULL) != 0)
+		error = -1;
+	iunlock(dp);
+	iput(fs, dp);
+	return error;
+}
+
+/*
+ * Resolve PATH, from directory START unless it is absolute, up to its
+ * last component: the directory meant to hold that is stored in *DIR
+ * and the component in NAME (SFS_NAMELEN bytes). A path of slashes
+ * only stands for "/.". Returns 0, -1 (a directory on the way does
+ * not exist), -2 (...is not a directory) or -8 (a name is too long,
+ * or PATH is empty).
+ */
+static int namei_parent(struct sfs_fs *fs, u_int32_t start, const char *path,
+			u_int32_t *dir, char *name)
+{
+	struct sfs_dir ent;
+	char next[SFS_NAMELEN];
+	u_int32_t ino = path[0] == '/' ? SFS_ROOT_LOCATION : start;
+	int error;
+
+	if (path[0] == '\0')
+		return -8;
+	error = namei_comp(&path, name);
+	if (error <= 0) {
+		strcpy(name, ".");
+		*dir = ino;
+		return error;
+	}
+	while ((error = namei_comp(&path, next)) > 0) {
+		error = namei_step(fs, ino, name, &ent, NULL);
+		if (error)
+			return error;
+		ino = ent.sfd_ino;
+		strcpy(name, next);
+	}
+	if (error)
+		return error;
+	*dir = ino;
+	return 0;
+}
+
+/*
+ * Resolve PATH, from directory START unless it is absolute, to the
+ * entry for its last component, copied to ENT with the child's type in
+ * *TYPE if TYPE is not NULL. The root itself is named "/". Errors are
+ * those of namei_parent().
+ */
+static int namei(struct sfs_fs *fs, u_int32_t start, const char *path,
+		 struct sfs_dir *ent, u_int16_t *type)
+{
+	char name[SFS_NAMELEN];
+	u_int32_t dir;
+	int error;
+
+	if (path[0] == '/' && path[strspn(path, "/")] == '\0') {
+		ent->sfd_ino = SFS_ROOT_LOCATION;
+		strcpy(ent->sfd_name, "/");
+		if (type != NULL)
+			*type = SFS_TYPE_DIR;
+		return 0;
+	}
+	error = namei_parent(fs, start, path, &dir, name);
+	if (error)
+		return error;
+	return namei_step(fs, dir, name, ent, type);
+}
+
+/*
+ * For shell command CMD: the directory meant to hold the last component
+ * of PATH, which is copied to NAME, referenced and write locked. NULL,
+ * with the error reported, if there is no such directory.
+ */
+static struct inode *namei_lockparent(struct sfs_fs *fs, const char *cmd,
+				      const char *path, char *name)
+{
+	struct inode *dp;
+	u_int32_t dir;
+	int error;
+
+	error = namei_parent(fs, fs->sd_cwd.sfd_ino, path, &dir, name);
+	if (error) {
+		error_message(cmd, path, error);
+		return NULL;
+	}
+	dp = iget(fs, dir);
+	iwlock(dp);
+	if (dp->i_di.sfi_type != SFS_TYPE_DIR) {
+		error_message(cmd, path, -2);
+		iunlock(dp);
+		iput(fs, dp);
+		return NULL;
+	}
+	return dp;
+}
+
+/*
+ * Call FN on every live entry of directory DIR until it returns nonzero;
+ * that value is returned. FN must not change the directory. The inodes
+ * of a block's untyped entries are read ahead before FN sees them.
+ */
+struct dir_foreach_arg {
+	struct sfs_fs *fs;
+	dir_visit_t fn;
+	void *arg;
+};
+
+static int dir_foreach_bucket(const struct sfs_dir *sd, u_int32_t blk,
+			      void *arg)
+{
+	struct dir_foreach_arg *fa = arg;
+	struct dirloc loc;
+	int j, ret;
+
+	dirblk_prefetch(fa->fs, sd, 1, 1);
+	for (j = 1; j < fa->fs->fs_dpb; j++) {
+		if (sd[j].sfd_ino == SFS_NOINO)
+			continue;
+		loc.dl_block = blk;
+		loc.dl_slot = j;
+		loc.dl_hashed = 1;
+		ret = fa->fn(&sd[j], &loc, fa->arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int dir_foreach(struct sfs_fs *fs, const struct sfs_inode *dir,
+		       dir_visit_t fn, void *arg)
+{
+	const struct sfs_dir *sd[SFS_NDIRECT];
+	struct dir_foreach_arg fa;
+	struct dirloc loc;
+	char *buf;
+	int i, j, ret = 0;
+
+	buf = malloc(SFS_NDIRECT * fs->fs_bsize);
+	assert(buf != NULL);
+	dir_blocks_get(fs, dir, buf, sd);
+	for (i = 0; i < SFS_NDIRECT && ret == 0; i++) {
+		if (sd[i] == NULL)
+			continue;
+		dirblk_prefetch(fs, sd[i], 0, 1);
+		for (j = 0; j < fs->fs_dpb && ret == 0; j++) {
+			if (sd[i][j].sfd_ino == SFS_NOINO)
+				continue;
+			loc.dl_block = dir->sfi_direct[i];
+			loc.dl_slot = j;
+			loc.dl_hashed = 0;
+			ret = fn(&sd[i][j], &loc, arg);
+		}
+	}
+	free(buf);
+	if (ret || !(dir->sfi_flags & SFS_IFLAG_HASHDIR))
+		return ret;
+
+	fa.fs = fs;
+	fa.fn = fn;
+	fa.arg = arg;
+	return dirhash_walk(fs, dir, dir_foreach_bucket, &fa);
+}
+
+/*
+ * Put NAME -> INO (of type TYPE) in the first free slot of a linear
+ * directory, adding a block if every allocated one is full. Returns 0,
+ * -3 (all direct blocks full) or -4 (no block).
+ */
+static int dir_add_linear(struct sfs_fs *fs, struct sfs_inode *dir,
+			  const char *name, u_int32_t ino, u_int16_t type)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES];
+	int i, j = 0, directNum = -1, newDirect = -1;
+	u_int32_t blk;
+
+	for (i = 0; i < SFS_NDIRECT && directNum < 0; i++) {
+		if (dir->sfi_direct[i] == 0) {
+			if (newDirect < 0)
+				newDirect = i;
+			continue;
+		}
+		disk_read(fs->disk, sd, dir->sfi_direct[i]);
+		for (j = 0; j < fs->fs_dpb; j++) {
+			if (sd[j].sfd_ino == SFS_NOINO) {
+				directNum = i;
+				break;
+			}
+		}
+	}
+
+	if (directNum < 0) {
+		if (newDirect < 0)
+			return -3;
+		blk = bitmap_alloc(fs, dir->sfi_direct[0]);
+		if (blk == 0)
+			return -4;
+		bzero(sd, fs->fs_bsize);
+		dir->sfi_direct[newDirect] = blk;
+		directNum = newDirect;
+		j = 0;
+	}
+
+	dirent_set(&sd[j], name, ino, type);
+	meta_write(fs, sd, dir->sfi_direct[directNum]);
+	return 0;
+}
+
+/*
+ * Double the bucket pointer table of hashed directory DIR: pointer
+ * I + 2^depth starts out sharing pointer I's bucket. The inode is
+ * updated in memory only. Returns 0 or -4 (no block for a leaf).
+ */
+static int dirhash_grow(struct sfs_fs *fs, struct sfs_inode *dir)
+{
+	u_int32_t i, n = 1U << dir->sfi_hashdepth;
+
+	for (i = 0; i < n; i++) {
+		if (dirhash_set(fs, dir, n + i, dirhash_get(fs, dir, i)) != 0)
+			return -4;
+	}
+	dir->sfi_hashdepth++;
+	return 0;
+}
+
+/*
+ * Split full bucket BLK of hashed directory DIR on its next hash bit:
+ * entries with that bit set move to a new bucket, and the pointers
+ * that select them are redirected. Returns 0 or -4 (no block).
+ */
+static int dirhash_split(struct sfs_fs *fs, const struct sfs_inode *dir,
+			 u_int32_t blk)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES], nsd[SFS_MAXDENTRIES];
+	struct sfs_dirbucket *hdr = (struct sfs_dirbucket *)sd;
+	struct sfs_dirbucket *nhdr = (struct sfs_dirbucket *)nsd;
+	u_int32_t newblk, bit, i, n = 1U << dir->sfi_hashdepth;
+	int j;
+
+	newblk = bitmap_alloc(fs, blk);
+	if (newblk == 0)
+		return -4;
+
+	disk_read(fs->disk, sd, blk);
+	bit = 1U << hdr->sdb_depth;
+	bzero(nsd, fs->fs_bsize);
+	hdr->sdb_depth++;
+	nhdr->sdb_depth = hdr->sdb_depth;
+	nhdr->sdb_prefix = hdr->sdb_prefix | bit;
+
+	for (j = 1; j < fs->fs_dpb; j++) {
+		if (sd[j].sfd_ino == SFS_NOINO ||
+		    !(dir_hash(sd[j].sfd_name) & bit))
+			continue;
+		nsd[j] = sd[j];
+		nhdr->sdb_count++;
+		sd[j].sfd_ino = SFS_NOINO;
+		hdr->sdb_count--;
+	}
+	meta_write(fs, nsd, newblk);
+	meta_write(fs, sd, blk);
+
+	for (i = nhdr->sdb_prefix; i < n; i += bit << 1)
+		dirhash_set(fs, dir, i, newblk);
+	return 0;
+}
+
+/*
+ * Put NAME -> INO (of type TYPE) in its bucket of hashed directory DIR.
+ * A full bucket
+ * is split, doubling the pointer table first if it is as deep as the
+ * table; at the maximum depth an overflow block is chained instead.
+ * Returns 0 or -4.
+ */
+static int dirhash_insert(struct sfs_fs *fs, struct sfs_inode *dir,
+			  const char *name, u_int32_t ino, u_int16_t type)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES];
+	struct sfs_dirbucket *hdr = (struct sfs_dirbucket *)sd;
+	u_int32_t h = dir_hash(name);
+	u_int32_t head, blk, prev, newblk;
+	int j;
+
+	for (;;) {
+		head = dirhash_get(fs, dir,
+				   h & ((1U << dir->sfi_hashdepth) - 1));
+		prev = 0;
+		for (blk = head; blk != 0; blk = hdr->sdb_next) {
+			disk_read(fs->disk, sd, blk);
+			if (hdr->sdb_count < fs->fs_dpb - 1)
+				break;
+			prev = blk;
+		}
+		if (blk != 0)
+			break;
+
+		disk_read(fs->disk, sd, head);
+		if (hdr->sdb_depth == SFS_DIRHASH_MAXDEPTH) {
+			newblk = bitmap_alloc(fs, prev);
+			if (newblk == 0)
+				return -4;
+			bzero(sd, fs->fs_bsize);
+			hdr->sdb_depth = SFS_DIRHASH_MAXDEPTH;
+			hdr->sdb_prefix = h & ((1U << SFS_DIRHASH_MAXDEPTH) - 1);
+			meta_write(fs, sd, newblk);
+			disk_read(fs->disk, sd, prev);
+			hdr->sdb_next = newblk;
+			meta_write(fs, sd, prev);
+			blk = newblk;
+			disk_read(fs->disk, sd, blk);
+			break;
+		}
+		if (hdr->sdb_depth == dir->sfi_hashdepth &&
+		    dirhash_grow(fs, dir) != 0)
+			return -4;
+		if (dirhash_split(fs, dir, head) != 0)
+			return -4;
+	}
+
+	for (j = 1; sd[j].sfd_ino != SFS_NOINO; j++)
+		;
+	dirent_set(&sd[j], name, ino, type);
+	hdr->sdb_count++;
+	meta_write(fs, sd, blk);
+	return 0;
+}
+
+static int dirhash_free_bucket(const struct sfs_dir *sd, u_int32_t blk,
+			       void *arg)
+{
+	bitmap_free(arg, blk);
+	return 0;
+}
+
+/* Return the buckets and the index of hashed directory DIR to the freemap */
+static void dirhash_free(struct sfs_fs *fs, const struct sfs_inode *dir)
+{
+	u_int32_t top[SFS_MAXPTRS];
+	u_int32_t i;
+
+	dirhash_walk(fs, dir, dirhash_free_bucket, fs);
+	disk_read(fs->disk, top, dir->sfi_indirect);
+	for (i = 0; i < fs->fs_ppb; i++) {
+		if (top[i] != 0)
+			bitmap_free(fs, top[i]);
+	}
+	bitmap_free(fs, dir->sfi_indirect);
+}
+
+/*
+ * Turn full linear directory DIR into a hashed one: set up the index
+ * with a single bucket, rehash every entry but "." and ".." and release
+ * the direct blocks that end up empty. Entries without a type get one
+ * on the way. The linear blocks are only cleared once every entry is in
+ * the index; if the volume cannot hold it, the index is given back and
+ * DIR stays linear. Returns 0 or -4.
+ */
+static int dir_convert(struct sfs_fs *fs, struct sfs_inode *dir)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES];
+	u_int32_t top[SFS_MAXPTRS];
+	u_int32_t nent = dir->sfi_size / sizeof(struct sfs_dir);
+	u_int32_t index, bucket;
+	int i, j, live, error = 0;
+
+	/* worst case: top and leaf index plus a bucket per entry */
+	if (bitmap_nfree(fs) < 2 + nent)
+		return -4;
+
+	index = bitmap_alloc(fs, dir->sfi_direct[0]);
+	if (index == 0)
+		return -4;
+	bucket = bitmap_alloc(fs, index);
+	if (bucket == 0) {
+		bitmap_free(fs, index);
+		return -4;
+	}
+	bzero(top, fs->fs_bsize);
+	meta_write(fs, top, index);
+	bzero(sd, fs->fs_bsize);
+	meta_write(fs, sd, bucket);
+	dir->sfi_indirect = index;
+	dir->sfi_hashdepth = 0;
+	dir->sfi_flags |= SFS_IFLAG_HASHDIR;
+	if (dirhash_set(fs, dir, 0, bucket) != 0) {
+		bitmap_free(fs, bucket);
+		bitmap_free(fs, index);
+		dir->sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		dir->sfi_indirect = 0;
+		return -4;
+	}
+
+	for (i = 0; i < SFS_NDIRECT && error == 0; i++) {
+		if (dir->sfi_direct[i] == 0)
+			continue;
+		disk_read(fs->disk, sd, dir->sfi_direct[i]);
+		for (j = 0; j < fs->fs_dpb && error == 0; j++) {
+			if (sd[j].sfd_ino == SFS_NOINO || is_dot(sd[j].sfd_name))
+				continue;
+			error = dirhash_insert(fs, dir, sd[j].sfd_name,
+					       sd[j].sfd_ino,
+					       dirent_type_get(fs, &sd[j]));
+		}
+	}
+	if (error) {
+		dirhash_free(fs, dir);
+		dir->sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		dir->sfi_indirect = 0;
+		dir->sfi_hashdepth = 0;
+		return error;
+	}
+
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (dir->sfi_direct[i] == 0)
+			continue;
+		disk_read(fs->disk, sd, dir->sfi_direct[i]);
+		live = 0;
+		for (j = 0; j < fs->fs_dpb; j++) {
+			if (sd[j].sfd_ino == SFS_NOINO)
+				continue;
+			if (is_dot(sd[j].sfd_name))
+				live++;
+			else
+				sd[j].sfd_ino = SFS_NOINO;
+		}
+		if (live == 0 && i != 0) {
+			bitmap_free(fs, dir->sfi_direct[i]);
+			dir->sfi_direct[i] = 0;
+		}
+		else {
+			meta_write(fs, sd, dir->sfi_direct[i]);
+		}
+	}
+
+	sb_set_feature(fs, SFS_FEAT_HASHDIR);
+	return 0;
+}
+
+/*
+ * Make sure linear directory DP has a free slot, adding a block if every
+ * allocated one is full. Called before a new entry's inode is allocated,
+ * so that the directory block comes first, as in the original tools.
+ * A directory that needs converting is left to dir_add(). Returns 0 or
+ * -4 (no block).
+ */
+static int dir_make_room(struct sfs_fs *fs, struct inode *dp)
+{
+	struct sfs_inode *dir = &dp->i_di;
+	struct sfs_dir buf[SFS_MAXDENTRIES];
+	const struct sfs_dir *sd;
+	int i, j, newDirect = -1;
+	u_int32_t blk;
+
+	if (dir->sfi_flags & SFS_IFLAG_HASHDIR)
+		return 0;
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (dir->sfi_direct[i] == 0) {
+			if (newDirect < 0)
+				newDirect = i;
+			continue;
+		}
+		sd = block_get(fs, buf, dir->sfi_direct[i]);
+		for (j = 0; j < fs->fs_dpb; j++) {
+			if (sd[j].sfd_ino == SFS_NOINO)
+				return 0;
+		}
+	}
+	if (newDirect < 0)
+		return 0;
+
+	blk = bitmap_alloc(fs, dir->sfi_direct[0]);
+	if (blk == 0)
+		return -4;
+	bzero(buf, fs->fs_bsize);
+	meta_write(fs, buf, blk);
+	dir->sfi_direct[newDirect] = blk;
+	imark_dirty(dp);
+	return 0;
+}
+
+/*
+ * Enter NAME -> INO (of type TYPE) in directory DP. A linear directory
+ * whose direct blocks are all full is converted to a hashed one first.
+ * Returns 0 or -4 (no block).
+ */
+static int dir_add(struct sfs_fs *fs, struct inode *dp, const char *name,
+		   u_int32_t ino, u_int16_t type)
+{
+	struct sfs_inode *dir = &dp->i_di;
+	int error;
+
+	if (!(dir->sfi_flags & SFS_IFLAG_HASHDIR)) {
+		error = dir_add_linear(fs, dir, name, ino, type);
+		if (error == -3) {
+			error = dir_convert(fs, dir);
+			if (error == 0)
+				imark_dirty(dp);
+		}
+		if (error)
+			return error;
+	}
+	if (dir->sfi_flags & SFS_IFLAG_HASHDIR) {
+		error = dirhash_insert(fs, dir, name, ino, type);
+		imark_dirty(dp);
+		if (error)
+			return error;
+	}
+
+	dir->sfi_size += sizeof(struct sfs_dir);
+	imark_dirty(dp);
+	dcache_enter(fs, dp->i_ino, name, ino, type, NULL);
+	return 0;
+}
+
+/*
+ * Credits for an operation that enters a name in directory DIR and
+ * takes NBLK blocks of its own. Adding to a hashed directory may split
+ * buckets and double the pointer table, rewriting the top index and
+ * every leaf; a linear one whose direct blocks are all in use may be
+ * converted, rewriting them.
+ */
+static u_int32_t dir_add_credits(struct sfs_fs *fs,
+				 const struct sfs_inode *dir, u_int32_t nblk)
+{
+	u_int32_t ppb = fs->fs_ppb;
+	// index and buckets a conversion or split may take
+	u_int32_t grow = ((1U << SFS_DIRHASH_MAXDEPTH) + ppb - 1) / ppb +
+			 SFS_DIRHASH_MAXDEPTH + 2;
+	int i;
+
+	if (dir->sfi_flags & SFS_IFLAG_HASHDIR)
+		return fs_credits(fs, nblk + grow) + 1 +
+		       ((1U << dir->sfi_hashdepth) + ppb - 1) / ppb;
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (dir->sfi_direct[i] == 0)
+			return fs_credits(fs, nblk + 1);
+	}
+	return fs_credits(fs, nblk + grow + SFS_NDIRECT * (fs->fs_dpb + 1)) +
+	       SFS_NDIRECT;
+}
+
+/* Clear the entry at LOC in directory DP */
+static void dir_remove(struct sfs_fs *fs, struct inode *dp,
+		       const struct dirloc *loc)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES];
+
+	disk_read(fs->disk, sd, loc->dl_block);
+	dcache_enter(fs, dp->i_ino, sd[loc->dl_slot].sfd_name, SFS_NOINO,
+		     SFS_TYPE_INVAL, NULL);
+	sd[loc->dl_slot].sfd_ino = SFS_NOINO;
+	if (loc->dl_hashed)
+		((struct sfs_dirbucket *)sd)->sdb_count--;
+	meta_write(fs, sd, loc->dl_block);
+
+	dp->i_di.sfi_size -= sizeof(struct sfs_dir);
+	imark_dirty(dp);
+}
+
+/*
+ * Return every block of directory DIR to the freemap: its direct
+ * blocks and, for a hashed directory, the buckets and the index.
+ */
+static void dir_free_blocks(struct sfs_fs *fs, const struct sfs_inode *dir)
+{
+	int i;
+
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (dir->sfi_direct[i] != 0)
+			bitmap_free(fs, dir->sfi_direct[i]);
+	}
+	if (dir->sfi_flags & SFS_IFLAG_HASHDIR)
+		dirhash_free(fs, dir);
+}
+
+/*
+ * File block mapping.
+ *
+ * A file's data blocks are listed by sfi_direct[] and a tree of
+ * indirect blocks below each of sfi_indirect, sfi_dindirect and
+ * sfi_tindirect (1, 2 and 3 levels deep) or, for an extent-mapped
+ * inode, by sfi_extent[]. A bmap_cursor walks one file and keeps the
+ * indirect block it used last at every depth, and the extent it is in,
+ * so a sequential walk reads each indirect block once: about one
+ * metadata read per indirect block's worth of data blocks. Indirect blocks changed
+ * through the cursor are written back when it moves off them or by
+ * bmap_flush().
+ *
+ * A file that grows through the cursor gets its blocks, indirect blocks
+ * included, after the last one it was given, and holds a reservation of
+ * up to BMAP_PREALLOC blocks past that to grow into; bmap_release()
+ * gives back what is left of it.
+ */
+#define BMAP_MAXDEPTH	3
+#define BMAP_PREALLOC	8
+
+struct bmap_cursor {
+	struct sfs_fs *bc_fs;		// the volume
+	struct sfs_inode *bc_si;	// the file
+	u_int32_t bc_blk[BMAP_MAXDEPTH];	// indirect block held per depth
+	int bc_dirty[BMAP_MAXDEPTH];	// ...needs write back
+	u_int32_t bc_ind[BMAP_MAXDEPTH][SFS_MAXPTRS];
+	u_int32_t bc_ext;		// extent of the last lookup
+	u_int32_t bc_extlbn;		// first logical block of that extent
+	u_int32_t bc_goal;		// where the next new block should go
+	u_int32_t bc_rsv;		// first block reserved to grow into
+	u_int32_t bc_nrsv;		// ...and how many
+};
+
+static void bmap_init(struct bmap_cursor *bc, struct sfs_fs *fs,
+		      struct sfs_inode *si)
+{
+	bzero(bc->bc_blk, sizeof(bc->bc_blk));
+	bzero(bc->bc_dirty, sizeof(bc->bc_dirty));
+	bc->bc_fs = fs;
+	bc->bc_si = si;
+	bc->bc_ext = 0;
+	bc->bc_extlbn = 0;
+	bc->bc_goal = 0;
+	bc->bc_rsv = 0;
+	bc->bc_nrsv = 0;
+}
+
+/*
+ * Allocate up to WANT contiguous blocks for the file: from its
+ * reservation, or from a new one at the goal. The first block is stored
+ * in START and the run length returned, 0 if the volume is full.
+ */
+static u_int32_t bmap_alloc_run(struct bmap_cursor *bc, u_int32_t want,
+				u_int32_t *start)
+{
+	u_int32_t n;
+
+	if (bc->bc_nrsv == 0) {
+		n = bitmap_alloc_run(bc->bc_fs, bc->bc_goal,
+				     want + BMAP_PREALLOC, &bc->bc_rsv);
+		if (n == 0)
+			return 0;
+		bc->bc_nrsv = n;
+	}
+	n = want < bc->bc_nrsv ? want : bc->bc_nrsv;
+	*start = bc->bc_rsv;
+	bc->bc_rsv += n;
+	bc->bc_nrsv -= n;
+	bc->bc_goal = *start + n;
+	return n;
+}
+
+/* Free the blocks reserved for the file and not used */
+static void bmap_release(struct bmap_cursor *bc)
+{
+	while (bc->bc_nrsv > 0) {
+		bitmap_free(bc->bc_fs, bc->bc_rsv++);
+		bc->bc_nrsv--;
+	}
+}
+
+/* Write back the indirect blocks changed through the cursor */
+static void bmap_flush(struct bmap_cursor *bc)
+{
+	int d;
+
+	for (d = 0; d < BMAP_MAXDEPTH; d++) {
+		if (bc->bc_dirty[d]) {
+			meta_write(bc->bc_fs, bc->bc_ind[d], bc->bc_blk[d]);
+			bc->bc_dirty[d] = 0;
+		}
+	}
+}
+
+/*
+ * Contents of indirect block BLK, D levels above the data, through the
+ * cursor. NEW means BLK was just allocated: it starts out zeroed.
+ */
+static u_int32_t *bmap_load(struct bmap_cursor *bc, int d, u_int32_t blk,
+			    int new)
+{
+	struct sfs_fs *fs = bc->bc_fs;
+
+	if (bc->bc_blk[d] == blk && !new)
+		return bc->bc_ind[d];
+	if (bc->bc_dirty[d])
+		meta_write(fs, bc->bc_ind[d], bc->bc_blk[d]);
+	bc->bc_blk[d] = blk;
+	bc->bc_dirty[d] = new;
+	if (new)
+		bzero(bc->bc_ind[d], fs->fs_bsize);
+	else
+		disk_read(fs->disk, bc->bc_ind[d], blk);
+	return bc->bc_ind[d];
+}
+
+/*
+ * Locate logical block *LBN: returns the inode slot at the top of its
+ * tree (the sfi_direct[] entry itself for a direct block), sets *LEVELS
+ * to the number of indirect levels below that slot and leaves in *LBN
+ * the index within the tree. NULL if the file cannot be that large.
+ * Tree spans are 64-bit: with large blocks a triple indirect tree maps
+ * more than 2^32 blocks.
+ */
+static u_int32_t *bmap_root(struct bmap_cursor *bc, u_int32_t *lbn,
+			    int *levels)
+{
+	struct sfs_inode *si = bc->bc_si;
+	u_int64_t span = bc->bc_fs->fs_ppb;
+
+	if (*lbn < SFS_NDIRECT) {
+		*levels = 0;
+		return &si->sfi_direct[*lbn];
+	}
+	*lbn -= SFS_NDIRECT;
+	if (*lbn < span) {
+		*levels = 1;
+		return &si->sfi_indirect;
+	}
+	*lbn -= span;
+	span *= bc->bc_fs->fs_ppb;
+	if (*lbn < span) {
+		*levels = 2;
+		return &si->sfi_dindirect;
+	}
+	*lbn -= span;
+	span *= bc->bc_fs->fs_ppb;
+	if (*lbn < span) {
+		*levels = 3;
+		return &si->sfi_tindirect;
+	}
+	return NULL;
+}
+
+/* Index into an indirect block D levels above the data, for tree index I */
+static u_int32_t bmap_index(struct bmap_cursor *bc, u_int32_t i, int d)
+{
+	while (d-- > 0)
+		i /= bc->bc_fs->fs_ppb;
+	return i % bc->bc_fs->fs_ppb;
+}
+
+/* Block holding logical block LBN of a block-mapped file, 0 if none */
+static u_int32_t bmap_block(struct bmap_cursor *bc, u_int32_t lbn)
+{
+	u_int32_t *slot, blk;
+	int levels, d;
+
+	slot = bmap_root(bc, &lbn, &levels);
+	if (slot == NULL)
+		return 0;
+	blk = *slot;
+	for (d = levels - 1; d >= 0 && blk != 0; d--)
+		blk = bmap_load(bc, d, blk, 0)[bmap_index(bc, lbn, d)];
+	return blk;
+}
+
+/*
+ * Make room to map logical block LBN of a block-mapped file, allocating
+ * the indirect blocks on its path. Returns the slot that will hold the
+ * block number and stores in ROOM how many consecutive slots from it
+ * are in the same block; NULL if no block was left.
+ */
+static u_int32_t *bmap_prepare(struct bmap_cursor *bc, u_int32_t lbn,
+			       u_int32_t *room)
+{
+	u_int32_t *slot, blk;
+	int levels, d, new;
+
+	slot = bmap_root(bc, &lbn, &levels);
+	assert(slot != NULL);
+	if (levels == 0) {
+		*room = SFS_NDIRECT - lbn;
+		return slot;
+	}
+	for (d = levels - 1; d >= 0; d--) {
+		new = (*slot == 0);
+		if (new) {
+			if (bmap_alloc_run(bc, 1, &blk) == 0)
+				return NULL;
+			*slot = blk;
+			if (d + 1 < levels)
+				bc->bc_dirty[d + 1] = 1;
+		}
+		slot = &bmap_load(bc, d, *slot, new)[bmap_index(bc, lbn, d)];
+	}
+	bc->bc_dirty[0] = 1;
+	*room = bc->bc_fs->fs_ppb - lbn % bc->bc_fs->fs_ppb;
+	return slot;
+}
+
+/*
+ * Undo the part of bmap_prepare(LBN) that is not needed: free the
+ * indirect blocks on LBN's path that map nothing, bottom up.
+ */
+static void bmap_trim(struct bmap_cursor *bc, u_int32_t lbn)
+{
+	u_int32_t *slot[BMAP_MAXDEPTH + 1];
+	u_int32_t *ind;
+	int levels, d, i;
+
+	slot[BMAP_MAXDEPTH] = bmap_root(bc, &lbn, &levels);
+	if (slot[BMAP_MAXDEPTH] == NULL || levels == 0)
+		return;
+	slot[levels] = slot[BMAP_MAXDEPTH];
+	for (d = levels - 1; d >= 0 && *slot[d + 1] != 0; d--)
+		slot[d] = &bmap_load(bc, d, *slot[d + 1], 0)[bmap_index(bc, lbn, d)];
+
+	for (d++; d < levels; d++) {
+		ind = bc->bc_ind[d];
+		for (i = 0; i < bc->bc_fs->fs_ppb && ind[i] == 0; i++)
+			;
+		if (i < bc->bc_fs->fs_ppb)
+			break;
+		bitmap_free(bc->bc_fs, bc->bc_blk[d]);
+		bc->bc_blk[d] = 0;
+		bc->bc_dirty[d] = 0;
+		*slot[d + 1] = 0;
+		if (d + 1 < levels)
+			bc->bc_dirty[d + 1] = 1;
+	}
+}
+
+/*
+ * Map logical block LBN of the file to PBN (0 for a hole) and return
+ * how many blocks from LBN on, at most MAX, follow it contiguously on
+ * disk.
+ */
+static u_int32_t bmap_run(struct bmap_cursor *bc, u_int32_t lbn,
+			  u_int32_t max, u_int32_t *pbn)
+{
+	const struct sfs_inode *si = bc->bc_si;
+	const struct sfs_extent *ext;
+	u_int32_t n;
+
+	if (si->sfi_flags & SFS_IFLAG_EXTENTS) {
+		if (lbn < bc->bc_extlbn) {
+			bc->bc_ext = 0;
+			bc->bc_extlbn = 0;
+		}
+		while (bc->bc_ext < si->sfi_nextent &&
+		       lbn - bc->bc_extlbn >= si->sfi_extent[bc->bc_ext].se_len) {
+			bc->bc_extlbn += si->sfi_extent[bc->bc_ext].se_len;
+			bc->bc_ext++;
+		}
+		if (bc->bc_ext == si->sfi_nextent) {
+			*pbn = 0;
+			return 1;
+		}
+		ext = &si->sfi_extent[bc->bc_ext];
+		*pbn = ext->se_start + (lbn - bc->bc_extlbn);
+		n = ext->se_len - (lbn - bc->bc_extlbn);
+		return n < max ? n : max;
+	}
+
+	*pbn = bmap_block(bc, lbn);
+	for (n = 1; n < max && *pbn != 0 &&
+	     bmap_block(bc, lbn + n) == *pbn + n; n++)
+		;
+	return n;
+}
+
+/* sfi_flags for a new regular file */
+static u_int32_t file_newflags(struct sfs_fs *fs)
+{
+	return (fs->spb.sp_features & SFS_FEAT_EXTENTS) ? SFS_IFLAG_EXTENTS : 0;
+}
+
+/*
+ * Most blocks a file with sfi_flags FLAGS can map: what sfi_size can
+ * describe and, for a block-mapped file, the direct blocks plus the
+ * single, double and triple indirect trees.
+ */
+static u_int32_t file_maxblocks(struct sfs_fs *fs, u_int32_t flags)
+{
+	u_int64_t n, p = fs->fs_ppb;
+
+	n = 0xffffffffU / fs->fs_bsize;	// sfi_size limit
+	if (!(flags & SFS_IFLAG_EXTENTS) && SFS_NDIRECT + p + p*p + p*p*p < n)
+		n = SFS_NDIRECT + p + p*p + p*p*p;
+	return n;
+}
+
+/*
+ * Give the file walked by BC blocks NEXT.. for the N blocks of data in
+ * BUF and write them, a contiguous run at a time. A block-mapped file
+ * gets its indirect blocks as it reaches them; an extent-mapped file
+ * grows its last extent when the run follows it. The number of blocks
+ * placed is stored in PLACED. Returns 0, -4 (no block) or -11 (out of
+ * extents).
+ */
+static int file_append(struct bmap_cursor *bc, u_int32_t next,
+		       const char *buf, u_int32_t n, u_int32_t *placed)
+{
+	struct sfs_fs *fs = bc->bc_fs;
+	struct sfs_inode *si = bc->bc_si;
+	struct sfs_extent *ext;
+	u_int32_t done = 0, want, run, start, j;
+	u_int32_t *slot = NULL;
+	int error = 0;
+
+	while (done < n) {
+		want = n - done;
+		if (!(si->sfi_flags & SFS_IFLAG_EXTENTS)) {
+			slot = bmap_prepare(bc, next + done, &run);
+			if (slot == NULL) {
+				error = -4;
+				break;
+			}
+			if (want > run)
+				want = run;
+		}
+		run = bmap_alloc_run(bc, want, &start);
+		if (run == 0) {
+			error = -4;
+			break;
+		}
+
+		if (si->sfi_flags & SFS_IFLAG_EXTENTS) {
+			ext = NULL;
+			if (si->sfi_nextent > 0)
+				ext = &si->sfi_extent[si->sfi_nextent - 1];
+			if (ext != NULL && ext->se_start + ext->se_len == start) {
+				ext->se_len += run;
+			}
+			else if (si->sfi_nextent < SFS_NEXTENT) {
+				ext = &si->sfi_extent[si->sfi_nextent++];
+				ext->se_start = start;
+				ext->se_len = run;
+			}
+			else {
+				for (j = 0; j < run; j++)
+					bitmap_free(fs, start + j);
+				error = -11;
+				break;
+			}
+		}
+		else {
+			for (j = 0; j < run; j++)
+				slot[j] = start + j;
+		}
+		disk_writev(fs->disk, buf + done * fs->fs_bsize, start, run);
+		done += run;
+	}
+	if (error && !(si->sfi_flags & SFS_IFLAG_EXTENTS))
+		bmap_trim(bc, next + done);
+	*placed = done;
+	return error;
+}
+
+/* Free indirect block BLK, LEVELS above the data, and what it maps */
+static void ind_free(struct sfs_fs *fs, u_int32_t blk, int levels)
+{
+	u_int32_t ind[SFS_MAXPTRS];
+	int i;
+
+	disk_read(fs->disk, ind, blk);
+	for (i = 0; i < fs->fs_ppb; i++) {
+		if (ind[i] == 0)
+			continue;
+		if (levels > 1)
+			ind_free(fs, ind[i], levels - 1);
+		else
+			bitmap_free(fs, ind[i]);
+	}
+	bitmap_free(fs, blk);
+}
+
+/*
+ * Return every block of file SI to the freemap: its extents, or its
+ * direct blocks and the trees below its indirect blocks.
+ */
+static void file_free_blocks(struct sfs_fs *fs, const struct sfs_inode *si)
+{
+	u_int32_t j;
+	int i;
+
+	if (si->sfi_flags & SFS_IFLAG_EXTENTS) {
+		for (i = 0; i < si->sfi_nextent; i++) {
+			for (j = 0; j < si->sfi_extent[i].se_len; j++)
+				bitmap_free(fs, si->sfi_extent[i].se_start + j);
+		}
+		return;
+	}
+
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (si->sfi_direct[i] != 0)
+			bitmap_free(fs, si->sfi_direct[i]);
+	}
+	if (si->sfi_indirect != 0)
+		ind_free(fs, si->sfi_indirect, 1);
+	if (si->sfi_dindirect != 0)
+		ind_free(fs, si->sfi_dindirect, 2);
+	if (si->sfi_tindirect != 0)
+		ind_free(fs, si->sfi_tindirect, 3);
+}
+
+/*
+ * Whether the file walked by BC, whose data stops before block END and
+ * goes on at PBN with logical block LBN, only steps over its own
+ * indirect blocks there: those on the way to LBN, placed in line with
+ * the data as the file grew.
+ */
+static int bmap_inline_gap(struct bmap_cursor *bc, u_int32_t lbn,
+			   u_int32_t end, u_int32_t pbn)
+{
+	int d;
+
+	if (pbn == end)
+		return 1;
+	if ((bc->bc_si->sfi_flags & SFS_IFLAG_EXTENTS) || pbn < end ||
+	    pbn - end > BMAP_MAXDEPTH)
+		return 0;
+	bmap_block(bc, lbn);
+	for (; end < pbn; end++) {
+		for (d = 0; d < BMAP_MAXDEPTH && bc->bc_blk[d] != end; d++)
+			;
+		if (d == BMAP_MAXDEPTH)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Number of fragments of file SI: the runs of contiguous blocks its
+ * data is stored in, in file order. Holes do not count, and neither
+ * does a break over the file's own indirect blocks.
+ */
+static u_int32_t file_fragments(struct sfs_fs *fs, struct sfs_inode *si)
+{
+	struct bmap_cursor bc;
+	u_int32_t nblk = (si->sfi_size + fs->fs_bsize - 1) / fs->fs_bsize;
+	u_int32_t lbn, run, pbn, end = 0, n = 0;
+
+	bmap_init(&bc, fs, si);
+	for (lbn = 0; lbn < nblk; lbn += run) {
+		run = bmap_run(&bc, lbn, nblk - lbn, &pbn);
+		if (pbn == 0)
+			continue;
+		if (n == 0 || !bmap_inline_gap(&bc, lbn, end, pbn))
+			n++;
+		end = pbn + run;
+	}
+	return n;
+}
+
+/*
+ * Most blocks inode SI may hold, itself included, for journal credits:
+ * its data and indirect blocks; all of the volume for a hashed
+ * directory, whose buckets are not counted anywhere.
+ */
+static u_int32_t inode_nblocks(struct sfs_fs *fs, const struct sfs_inode *si)
+{
+	u_int32_t n = (si->sfi_size + fs->fs_bsize - 1) / fs->fs_bsize;
+
+	if (si->sfi_type == SFS_TYPE_DIR)
+		return (si->sfi_flags & SFS_IFLAG_HASHDIR) ?
+			fs->spb.sp_nblocks : 1 + SFS_NDIRECT;
+	return 1 + n + n / (fs->fs_ppb - 1) + BMAP_MAXDEPTH;
+}
 
 void error_message(const char *message, const char *path, int error_code) {
 	switch (error_code) {
 	case -1:
-		printf("%s: %s: No such file or directory\n",message, path); return;
-	case -2:
-		printf("%s: %s: Not a directory\n",message, path); return;
-	case -3:
-		printf("%s: %s: Directory full\n",message, path); return;
-	case -4:
-		printf("%s: %s: No block available\n",message, path); return;
-	case -5:
-		printf("%s: %s: Not a directory\n",message, path); return;
-	case -6:
-		printf("%s: %s: Already exists\n",message, path); return;
-	case -7:
-		printf("%s: %s: Directory not empty\n",message, path); return;
-	case -8:
-		printf("%s: %s: Invalid argument\n",message, path); return;
-	case -9:
-		printf("%s: %s: Is a directory\n",message, path); return;
-	case -10:
-		printf("%s: %s: Is not a file\n",message, path); return;
-	default:
-		printf("unknown error code\n");
+		printf("%s: %s: No such file or directory\n",message, path); return;
+	case -2:
+		printf("%s: %s: Not a directory\n",message, path); return;
+	case -3:
+		printf("%s: %s: Directory full\n",message, path); return;
+	case -4:
+		printf("%s: %s: No block available\n",message, path); return;
+	case -5:
+		printf("%s: %s: Not a directory\n",message, path); return;
+	case -6:
+		printf("%s: %s: Already exists\n",message, path); return;
+	case -7:
+		printf("%s: %s: Directory not empty\n",message, path); return;
+	case -8:
+		printf("%s: %s: Invalid argument\n",message, path); return;
+	case -9:
+		printf("%s: %s: Is a directory\n",message, path); return;
+	case -10:
+		printf("%s: %s: Is not a file\n",message, path); return;
+	case -11:
+		printf("%s: %s: File too large\n",message, path); return;
+	case -12:
+		printf("%s: %s: Too large for the journal\n",message, path);
+		return;
+	default:
+		printf("unknown error code\n");
+		return;
+	}
+}
+
+/*
+ * Mount the volume in image PATH. With VERBOSE, what is found on the
+ * way is reported as the mount command does. Returns NULL if PATH does
+ * not hold a volume.
+ */
+static struct sfs_fs *fs_mount(const char *path, int flags, int verbose)
+{
+	struct sfs_fs *fs;
+	struct stat st;
+	u_int32_t bsize;
+	int i, replayed;
+
+	fs = calloc(1, sizeof(*fs));
+	assert(fs != NULL);
+	fs->disk = disk_open(path, (flags & SFS_MOUNT_MMAP) ? DISK_MMAP : 0);
+	if (stat(path, &st) == 0) {
+		fs->fs_dev = st.st_dev;
+		fs->fs_ino = st.st_ino;
+	}
+	disk_read_part(fs->disk, &fs->spb, SFS_SB_LOCATION, sizeof(fs->spb));
+
+	if (verbose)
+		printf("Superblock magic: %x\n", fs->spb.sp_magic);
+
+	bsize = fs->spb.sp_blocksize ? fs->spb.sp_blocksize : SFS_BLOCKSIZE;
+	if (fs->spb.sp_magic != SFS_MAGIC || bsize < SFS_BLOCKSIZE ||
+	    bsize > SFS_MAXBLOCKSIZE || (bsize & (bsize - 1)) != 0) {
+		disk_close(fs->disk);
+		free(fs);
+		return NULL;
+	}
+	fs->fs_path = strdup(path);
+	assert(fs->fs_path != NULL);
+	fs->fs_bsize = bsize;
+	fs->fs_dpb = SFS_DENTRIES(bsize);
+	fs->fs_ppb = SFS_PTRS(bsize);
+	pthread_mutex_init(&fs->bm_lock, NULL);
+	pthread_mutex_init(&fs->icache_lock, NULL);
+	pthread_mutex_init(&fs->dcache_lock, NULL);
+	for (i = 0; i < ICACHE_SIZE; i++)
+		pthread_rwlock_init(&fs->icache[i].i_lock, NULL);
+
+	disk_set_blocksize(fs->disk, bsize);
+	if (fs->spb.sp_features & SFS_FEAT_JOURNAL) {
+		fs->fs_journal = 1;
+		replayed = disk_journal_open(fs->disk, fs->spb.sp_jstart,
+					     fs->spb.sp_jblocks);
+		if (replayed > 0) {
+			if (verbose)
+				printf("Journal: %d transactions replayed\n",
+				       replayed);
+			disk_read_part(fs->disk, &fs->spb, SFS_SB_LOCATION,
+				       sizeof(fs->spb));
+		}
+	}
+	bitmap_load(fs);
+	if ((flags & SFS_MOUNT_EXTENTS) &&
+	    !(fs->spb.sp_features & SFS_FEAT_EXTENTS)) {
+		fs_start(fs, fs_credits(fs, 0));
+		sb_set_feature(fs, SFS_FEAT_EXTENTS);
+		fs_flush(fs, fs_credits(fs, 0));
+	}
+
+	fs->sd_cwd.sfd_ino = SFS_ROOT_LOCATION;		//init at root
+	fs->sd_cwd.sfd_name[0] = '/';
+	fs->sd_cwd.sfd_name[1] = '\0';
+	return fs;
+}
+
+struct sfs_fs *sfs_fs_mount(const char *path, int flags)
+{
+	return fs_mount(path, flags, 0);
+}
+
+/* The volume the shell commands work on, NULL if none is mounted */
+struct sfs_fs *sfs_fs_current()
+{
+	return cur_fs;
+}
+
+/* Write everything back and close the image; FS must be idle */
+void sfs_fs_umount(struct sfs_fs *fs)
+{
+	icache_purge(fs);
+	bitmap_unload(fs);
+	dcache_purge(fs, SFS_NOINO);
+	disk_close(fs->disk);
+	pthread_mutex_destroy(&fs->bm_lock);
+	pthread_mutex_destroy(&fs->icache_lock);
+	pthread_mutex_destroy(&fs->dcache_lock);
+	free(fs->fs_path);
+	free(fs);
+}
+
+void sfs_fs_sync(struct sfs_fs *fs)
+{
+	fs_writeback(fs);
+	disk_sync(fs->disk);
+}
+
+/*
+ * Inode INO, passed in by a caller of the handle API, referenced and
+ * locked shared; NULL unless it is an allocated block on the volume
+ * holding a file or a directory.
+ */
+static struct inode *iget_user(struct sfs_fs *fs, u_int32_t ino)
+{
+	struct inode *ip;
+	int inuse;
+
+	if (ino < SFS_ROOT_LOCATION || ino >= fs->spb.sp_nblocks)
+		return NULL;
+	pthread_mutex_lock(&fs->bm_lock);
+	inuse = (fs->bm_map[ino / BM_WORDBITS] >> (ino % BM_WORDBITS)) & 1;
+	pthread_mutex_unlock(&fs->bm_lock);
+	if (!inuse)
+		return NULL;
+
+	ip = iget(fs, ino);
+	irlock(ip);
+	if (ip->i_di.sfi_type != SFS_TYPE_FILE &&
+	    ip->i_di.sfi_type != SFS_TYPE_DIR) {
+		iunlock(ip);
+		iput(fs, ip);
+		return NULL;
+	}
+	return ip;
+}
+
+/*
+ * Look path NAME up from directory DIR. Returns 0 and stores the inode
+ * number in INO, -1 if there is no such entry or DIR is no inode, -2 if
+ * DIR or a directory on the way is not a directory, or -8 if a name is
+ * too long.
+ */
+int sfs_fs_lookup(struct sfs_fs *fs, u_int32_t dir, const char *name,
+		  u_int32_t *ino)
+{
+	struct sfs_dir ent;
+	struct inode *dp;
+	int error;
+
+	dp = iget_user(fs, dir);
+	if (dp == NULL)
+		return -1;
+	iunlock(dp);
+	iput(fs, dp);
+
+	error = namei(fs, dir, name, &ent, NULL);
+	if (error == 0)
+		*ino = ent.sfd_ino;
+	return error;
+}
+
+/* Size and SFS_TYPE_* of inode INO; returns 0, or -1 if INO is no inode */
+int sfs_fs_stat(struct sfs_fs *fs, u_int32_t ino, u_int32_t *size, int *type)
+{
+	struct inode *ip;
+
+	ip = iget_user(fs, ino);
+	if (ip == NULL)
+		return -1;
+	*size = ip->i_di.sfi_size;
+	*type = ip->i_di.sfi_type;
+	iunlock(ip);
+	iput(fs, ip);
+	return 0;
+}
+
+/*
+ * Read up to LEN bytes at offset OFF of file INO into BUF. Returns the
+ * number of bytes read, 0 at end of file, -1 if INO is no inode or -9
+ * (is a directory).
+ * Whole blocks go straight to BUF, a contiguous run at a time.
+ */
+ssize_t sfs_fs_read(struct sfs_fs *fs, u_int32_t ino, void *buf, size_t len,
+		    u_int32_t off)
+{
+	struct bmap_cursor bc;
+	struct inode *ip;
+	u_int32_t bs = fs->fs_bsize;
+	u_int32_t lbn, skip, run, pbn;
+	size_t done = 0, n;
+	char *p = buf, *tmp;
+
+	ip = iget_user(fs, ino);
+	if (ip == NULL)
+		return -1;
+	if (ip->i_di.sfi_type != SFS_TYPE_FILE) {
+		iunlock(ip);
+		iput(fs, ip);
+		return -9;
+	}
+	if (off >= ip->i_di.sfi_size)
+		len = 0;
+	else if (len > ip->i_di.sfi_size - off)
+		len = ip->i_di.sfi_size - off;
+
+	tmp = malloc(bs);
+	assert(tmp != NULL);
+	bmap_init(&bc, fs, &ip->i_di);
+	while (done < len) {
+		lbn = (off + done) / bs;
+		skip = (off + done) % bs;
+		if (skip == 0 && len - done >= bs) {
+			run = bmap_run(&bc, lbn, (len - done) / bs, &pbn);
+			if (pbn == 0)
+				bzero(p + done, (size_t)run * bs);
+			else
+				disk_readv(fs->disk, p + done, pbn, run);
+			done += (size_t)run * bs;
+			continue;
+		}
+		bmap_run(&bc, lbn, 1, &pbn);
+		if (pbn == 0)
+			bzero(tmp, bs);
+		else
+			disk_readv(fs->disk, tmp, pbn, 1);
+		n = bs - skip;
+		if (n > len - done)
+			n = len - done;
+		memcpy(p + done, tmp + skip, n);
+		done += n;
+	}
+	free(tmp);
+	iunlock(ip);
+	iput(fs, ip);
+	return done;
+}
+
+/*
+ * Shell mount table. A volume is named by its slot number or its image;
+ * the image matches however it is spelled.
+ */
+static int mount_find(const char* name)
+{
+	struct stat st;
+	char *end;
+	long n;
+	int i, known;
+
+	n = strtol(name, &end, 10);
+	if (*name != '\0' && *end == '\0')
+		return n >= 0 && n < SFS_MAXMOUNT && mounts[n] != NULL ? n : -1;
+
+	known = stat(name, &st) == 0;
+	for (i = 0; i < SFS_MAXMOUNT; i++) {
+		if (mounts[i] == NULL)
+			continue;
+		if (known ? mounts[i]->fs_dev == st.st_dev &&
+			    mounts[i]->fs_ino == st.st_ino
+			  : strcmp(mounts[i]->fs_path, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Make FS the volume shell commands work on */
+static void mount_use(struct sfs_fs *fs)
+{
+	cur_fs = fs;
+}
+
+void sfs_mount(const char* path)
+{
+	sfs_mount_opt(path, 0);
+}
+
+/*
+ * Mount the volume in PATH next to those already mounted and switch to
+ * it. A volume that is mounted already is switched to, caches intact.
+ */
+void sfs_mount_opt(const char* path, int flags)
+{
+	struct sfs_fs *fs;
+	int i;
+
+	i = mount_find(path);
+	if (i >= 0) {
+		mount_use(mounts[i]);
+		if (sh_verbose)
+			printf("%s, already mounted\n",
+			       mounts[i]->spb.sp_volname);
+		return;
+	}
+	for (i = 0; i < SFS_MAXMOUNT && mounts[i] != NULL; i++)
+		;
+	if (i == SFS_MAXMOUNT) {
+		printf("mount: %s: %d volumes already mounted\n", path,
+		       SFS_MAXMOUNT);
+		return;
+	}
+
+	if (sh_verbose)
+		printf("Disk image: %s\n", path);
+
+	fs = fs_mount(path, flags, sh_verbose);
+	if (fs == NULL) {
+		printf("%s: not an SFS volume\n", path);
+		return;
+	}
+	mounts[i] = fs;
+	mount_use(fs);
+
+	if (sh_verbose) {
+		printf("Number of blocks: %d\n", fs->spb.sp_nblocks);
+		printf("Volume name: %s\n", fs->spb.sp_volname);
+		printf("%s, mounted\n", fs->spb.sp_volname);
+	}
+}
+
+/* Turn the mount and unmount reports of the shell commands on or off */
+void sfs_set_verbose(int on)
+{
+	sh_verbose = on;
+}
+
+/* List the mounted volumes; the current one is starred */
+void sfs_mounts()
+{
+	struct sfs_fs *fs;
+	int i;
+
+	for (i = 0; i < SFS_MAXMOUNT; i++) {
+		fs = mounts[i];
+		if (fs == NULL)
+			continue;
+		printf("%c %d %-24s %-32s %s\n", fs == cur_fs ? '*' : ' ', i,
+		       fs->fs_path, fs->spb.sp_volname, fs->sd_cwd.sfd_name);
+	}
+}
+
+/* Whether a volume is mounted for the shell commands to work on */
+int sfs_mounted()
+{
+	return cur_fs != NULL;
+}
+
+void sfs_use(const char* name)
+{
+	int i = mount_find(name);
+
+	if (i < 0) {
+		printf("use: %s: not mounted\n", name);
+		return;
+	}
+	mount_use(mounts[i]);
+}
+
+static void mount_release(int i)
+{
+	if (sh_verbose)
+		printf("%s, unmounted\n", mounts[i]->spb.sp_volname);
+	if (mounts[i] == cur_fs)
+		mount_use(NULL);
+	sfs_fs_umount(mounts[i]);
+	mounts[i] = NULL;
+}
+
+/* Unmount the current volume; another one mounted becomes current */
+void sfs_umount() {
+	int i;
+
+	if( cur_fs == NULL )
+		return;
+
+	for (i = 0; mounts[i] != cur_fs; i++)
+		;
+	mount_release(i);
+	for (i = 0; i < SFS_MAXMOUNT; i++) {
+		if (mounts[i] != NULL) {
+			mount_use(mounts[i]);
+			break;
+		}
+	}
+}
+
+void sfs_umount_vol(const char* name)
+{
+	int i = mount_find(name);
+
+	if (i < 0) {
+		printf("umount: %s: not mounted\n", name);
+		return;
+	}
+	if (mounts[i] == cur_fs)
+		sfs_umount();
+	else
+		mount_release(i);
+}
+
+/* Write back every mounted volume */
+void sfs_sync() {
+	int i;
+
+	for (i = 0; i < SFS_MAXMOUNT; i++) {
+		if (mounts[i] != NULL)
+			sfs_fs_sync(mounts[i]);
+	}
+}
+
+/*
+ * Without a journal a batch holds one operation open from begin to
+ * commit; with one, its commands are operations of their own and it
+ * holds off group commits instead (see fs_writeback()).
+ */
+void sfs_begin() {
+
+	if( cur_fs == NULL )
+		return;
+
+	if (cur_fs->fs_batch++ > 0)
+		return;
+	if (cur_fs->fs_journal)
+		disk_tx_hold(cur_fs->disk, 1);
+	else
+		fs_start(cur_fs, 0);
+}
+
+void sfs_commit() {
+	struct sfs_fs *fs = cur_fs;
+
+	if( fs == NULL )
+		return;
+
+	if (fs->fs_batch > 0) {
+		if (--fs->fs_batch > 0)
+			return;
+		if (fs->fs_journal)
+			disk_tx_hold(fs->disk, 0);
+		else
+			fs_flush(fs, 0);
+	}
+	else {
+		fs_writeback(fs);
+	}
+	disk_tx_commit(fs->disk);
+}
+
+void sfs_df() {
+	struct sfs_fs *fs = cur_fs;
+	u_int32_t nfree, used;
+
+	if( fs == NULL )
+		return;
+
+	nfree = bitmap_nfree(fs);
+	used = fs->spb.sp_nblocks - nfree;
+	printf("%-32s %10s %10s %10s %5s\n",
+	       "Volume", "Blocks", "Used", "Free", "Use%");
+	printf("%-32s %10u %10u %10u %4u%%\n", fs->spb.sp_volname,
+	       fs->spb.sp_nblocks, used, nfree,
+	       (u_int32_t)((u_int64_t)used * 100 / fs->spb.sp_nblocks));
+}
+
+void sfs_cachestat() {
+	struct sfs_fs *fs = cur_fs;
+	struct disk_stats ds;
+
+	if( fs == NULL )
+		return;
+
+	disk_getstats(fs->disk, &ds);
+	printf("cache: %lu hits, %lu misses, %lu writebacks\n",
+	       ds.ds_hits, ds.ds_misses, ds.ds_writebacks);
+	printf("aio: %s, %lu blocks prefetched\n", disk_aio_engine(fs->disk),
+	       ds.ds_prefetched);
+	if (fs->spb.sp_features & SFS_FEAT_JOURNAL)
+		printf("journal: %lu commits, %lu blocks logged, "
+		       "%lu checkpoints\n",
+		       ds.ds_commits, ds.ds_logged, ds.ds_checkpoints);
+	printf("dcache: %lu hits, %lu misses\n", fs->dcache_hits,
+	       fs->dcache_misses);
+	printf("icache: %lu hits, %lu misses\n", fs->icache_hits,
+	       fs->icache_misses);
+}
+
+
+void sfs_touch(const char* path)
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *dp, *np;
+	struct sfs_dir ent;
+	char name[SFS_NAMELEN];
+	int error;
+	u_int32_t newbie_ino, credits;
+
+	dp = namei_lockparent(fs, "touch", path, name);
+	if (dp == NULL)
+		return;
+
+	if (dir_find(fs, dp, name, &ent, NULL, NULL) == 0) {
+		error_message("touch", path, -6);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+
+	credits = dir_add_credits(fs, &dp->i_di, 1);
+	error = fs_start(fs, credits);
+	if (error) {
+		error_message("touch", path, error);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	newbie_ino = 0;
+	if (dir_make_room(fs, dp) == 0)
+		newbie_ino = bitmap_alloc(fs, dp->i_ino);
+	if (newbie_ino == 0) {
+		error_message("touch", path, -4);
+		iunlock(dp);
+		iput(fs, dp);
+		fs_flush(fs, credits);
+		return;
+	}
+
+	np = iget_new(fs, newbie_ino); // initalize sfi_direct[] and sfi_indirect
+	np->i_di.sfi_size = 0;
+	np->i_di.sfi_type = SFS_TYPE_FILE;
+	np->i_di.sfi_flags = file_newflags(fs);
+
+	error = dir_add(fs, dp, name, newbie_ino, SFS_TYPE_FILE);
+	iunlock(np);
+	if (error) {
+		idrop(fs, np);
+		bitmap_free(fs, newbie_ino);
+		error_message("touch", path, error);
+	}
+	else {
+		iput(fs, np);
+	}
+	iunlock(dp);
+	iput(fs, dp);
+	fs_flush(fs, credits);
+}
+
+void sfs_cd(const char* path)
+{
+	struct sfs_fs *fs = cur_fs;
+	struct sfs_dir ent;
+	u_int16_t type;
+	int error;
+
+	if (path == NULL) {
+		strcpy(fs->sd_cwd.sfd_name,"/");
+		fs->sd_cwd.sfd_ino = SFS_ROOT_LOCATION;
+		return;
+	}
+
+	error = namei(fs, fs->sd_cwd.sfd_ino, path, &ent, &type);
+	if (error != 0) {
+		error_message("cd", path, error);
+		return;
+	}
+	if (type != SFS_TYPE_DIR) {
+		error_message("cd", path, -2); // 폴더 아님
+		return;
+	}
+	strcpy(fs->sd_cwd.sfd_name, ent.sfd_name);
+	fs->sd_cwd.sfd_ino = ent.sfd_ino;
+}
+
+/* ls: print one entry, with a trailing / for directories */
+static int ls_entry(const struct sfs_dir *ent, const struct dirloc *loc,
+		    void *arg)
+{
+	u_int16_t type = dirent_type_get(arg, ent);
+
+	if (type == SFS_TYPE_FILE)
+		printf("%s\t", ent->sfd_name);
+	else if (type == SFS_TYPE_DIR)
+		printf("%s/\t", ent->sfd_name);
+	return 0;
+}
+
+void sfs_ls(const char* path)
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *ip;
+	struct sfs_dir ent;
+	u_int16_t type = SFS_TYPE_DIR;
+	int error;
+
+	ent.sfd_ino = fs->sd_cwd.sfd_ino;
+	if (path != NULL) {
+		error = namei(fs, fs->sd_cwd.sfd_ino, path, &ent, &type);
+		if (error != 0) {
+			error_message("ls", path, error);
+			return;
+		}
+	}
+	if (type == SFS_TYPE_FILE) {
+		printf("%s", ent.sfd_name);
+	}
+	else {
+		ip = iget(fs, ent.sfd_ino);
+		irlock(ip);
+		dir_foreach(fs, &ip->i_di, ls_entry, fs);
+		iunlock(ip);
+		iput(fs, ip);
+	}
+	printf("\n");
+}
+
+void sfs_mkdir(const char* org_path) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *dp, *np;
+	struct sfs_dir sd[SFS_MAXDENTRIES], ent;
+	char name[SFS_NAMELEN];
+	int error;
+	u_int32_t newbie_ino, newbie_blk, credits;
+
+	dp = namei_lockparent(fs, "mkdir", org_path, name);
+	if (dp == NULL)
+		return;
+
+	if (dir_find(fs, dp, name, &ent, NULL, NULL) == 0) {
+		error_message("mkdir", org_path, -6);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+
+	credits = dir_add_credits(fs, &dp->i_di, 2);
+	error = fs_start(fs, credits);
+	if (error) {
+		error_message("mkdir", org_path, error);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	// the inode near its parent, its first block right after it
+	newbie_ino = 0;
+	if (dir_make_room(fs, dp) == 0)
+		newbie_ino = bitmap_alloc(fs, dp->i_ino);
+	newbie_blk = newbie_ino ? bitmap_alloc(fs, newbie_ino + 1) : 0;
+	if (newbie_blk == 0) {
+		if (newbie_ino != 0)
+			bitmap_free(fs, newbie_ino);
+		error_message("mkdir", org_path, -4);
+		iunlock(dp);
+		iput(fs, dp);
+		fs_flush(fs, credits);
+		return;
+	}
+
+	bzero(sd, fs->fs_bsize);
+	dirent_set(&sd[0], ".", newbie_ino, SFS_TYPE_DIR);
+	dirent_set(&sd[1], "..", dp->i_ino, SFS_TYPE_DIR);
+	meta_write(fs, sd, newbie_blk);
+
+	np = iget_new(fs, newbie_ino); // initalize sfi_direct[] and sfi_indirect
+	np->i_di.sfi_size = 2 * sizeof(struct sfs_dir);
+	np->i_di.sfi_type = SFS_TYPE_DIR;
+	np->i_di.sfi_direct[0] = newbie_blk;
+
+	error = dir_add(fs, dp, name, newbie_ino, SFS_TYPE_DIR);
+	iunlock(np);
+	if (error) {
+		idrop(fs, np);
+		bitmap_free(fs, newbie_blk);
+		bitmap_free(fs, newbie_ino);
+		error_message("mkdir", org_path, error);
+	}
+	else {
+		iput(fs, np);
+	}
+	iunlock(dp);
+	iput(fs, dp);
+	fs_flush(fs, credits);
+}
+
+/* rmdir: stop at the first entry other than . and .. */
+static int dir_entry_notdot(const struct sfs_dir *ent,
+			    const struct dirloc *loc, void *arg)
+{
+	return !is_dot(ent->sfd_name);
+}
+
+void sfs_rmdir(const char* org_path) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *dp, *tp;
+	struct sfs_dir ent;
+	struct dirloc loc;
+	char name[SFS_NAMELEN];
+	u_int16_t type;
+	u_int32_t credits;
+	int error;
+
+	dp = namei_lockparent(fs, "rmdir", org_path, name);
+	if (dp == NULL)
+		return;
+
+	// Error4: invalid argument
+	if (is_dot(name)) {
+		error_message("rmdir", org_path, -8);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	// Error1: does not exist that dir.
+	if (dir_find(fs, dp, name, &ent, &type, &loc) != 0) {
+		error_message("rmdir", org_path, -1);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	// Error2 : not a dir
+	if (type != SFS_TYPE_DIR) {
+		error_message("rmdir", org_path, -5);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	// Error4: the working directory
+	if (ent.sfd_ino == fs->sd_cwd.sfd_ino) {
+		error_message("rmdir", org_path, -8);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	tp = iget(fs, ent.sfd_ino);
+	iwlock(tp);
+	// Error3: dir is not empty
+	if (dir_foreach(fs, &tp->i_di, dir_entry_notdot, NULL)) {
+		error_message("rmdir", org_path, -7);
+		iunlock(tp);
+		iput(fs, tp);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+
+	credits = fs_credits(fs, inode_nblocks(fs, &tp->i_di));
+	error = fs_start(fs, credits);
+	if (error) {
+		error_message("rmdir", org_path, error);
+		iunlock(tp);
+		iput(fs, tp);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	dir_free_blocks(fs, &tp->i_di);
+	iunlock(tp);
+	idrop(fs, tp);
+	bitmap_free(fs, ent.sfd_ino);
+	dir_remove(fs, dp, &loc);
+	dcache_purge(fs, ent.sfd_ino);
+	iunlock(dp);
+	iput(fs, dp);
+	fs_flush(fs, credits);
+}
+
+/* Whether directory DIR is directory INO or lies below it */
+static int dir_within(struct sfs_fs *fs, u_int32_t dir, u_int32_t ino)
+{
+	struct sfs_dir ent;
+
+	while (dir != ino) {
+		if (dir == SFS_ROOT_LOCATION ||
+		    namei_step(fs, dir, "..", &ent, NULL) != 0)
+			return 0;
+		dir = ent.sfd_ino;
+	}
+	return 1;
+}
+
+/* Point the ".." entry of directory TP, locked, at directory PARENT */
+static void dir_reparent(struct sfs_fs *fs, struct inode *tp, u_int32_t parent)
+{
+	struct sfs_dir sd[SFS_MAXDENTRIES], ent;
+	struct dirloc loc;
+
+	if (dir_find(fs, tp, "..", &ent, NULL, &loc) != 0)
+		return;
+	disk_read(fs->disk, sd, loc.dl_block);
+	dirent_set(&sd[loc.dl_slot], "..", parent, SFS_TYPE_DIR);
+	meta_write(fs, sd, loc.dl_block);
+	dcache_enter(fs, tp->i_ino, "..", parent, SFS_TYPE_DIR, &loc);
+}
+
+/*
+ * Rename SRC_NAME to DST_NAME, which may be in another directory. The
+ * two directories are locked source first: only the shell changes a
+ * volume, and readers hold one directory at a time. A directory moving
+ * to another parent is locked next, before the operation starts.
+ */
+void sfs_mv(const char* src_name, const char* dst_name) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *sp, *dp, *tp;
+	struct sfs_dir sd[SFS_MAXDENTRIES], ent;
+	struct dirloc loc;
+	char sname[SFS_NAMELEN], dname[SFS_NAMELEN];
+	u_int32_t sdir, ddir, credits;
+	u_int16_t type;
+	int error;
+
+	error = namei_parent(fs, fs->sd_cwd.sfd_ino, src_name, &sdir, sname);
+	if (error) {
+		error_message("mv", src_name, error);
+		return;
+	}
+	error = namei_parent(fs, fs->sd_cwd.sfd_ino, dst_name, &ddir, dname);
+	if (error) {
+		error_message("mv", dst_name, error);
+		return;
+	}
+	// a directory cannot move below itself
+	if (sdir != ddir && namei_step(fs, sdir, sname, &ent, &type) == 0 &&
+	    type == SFS_TYPE_DIR && !is_dot(sname) &&
+	    dir_within(fs, ddir, ent.sfd_ino)) {
+		error_message("mv", src_name, -8);
+		return;
+	}
+
+	sp = iget(fs, sdir);
+	iwlock(sp);
+	dp = sp;
+	if (ddir != sdir) {
+		dp = iget(fs, ddir);
+		iwlock(dp);
+	}
+	if (sp->i_di.sfi_type != SFS_TYPE_DIR)
+		error_message("mv", src_name, error = -2);
+	else if (dp->i_di.sfi_type != SFS_TYPE_DIR)
+		error_message("mv", dst_name, error = -2);
+	else if (dir_find(fs, dp, dname, &ent, NULL, NULL) == 0)
+		error_message("mv", dst_name, error = -6);
+	else if (is_dot(sname) || is_dot(dname))
+		error_message("mv", src_name, error = -8);
+	else if (dir_find(fs, sp, sname, &ent, &type, &loc) != 0)
+		error_message("mv", src_name, error = -1);
+	tp = NULL;
+	if (!error) {
+		if (sp != dp && type == SFS_TYPE_DIR) {
+			tp = iget(fs, ent.sfd_ino);
+			iwlock(tp);
+		}
+		credits = dir_add_credits(fs, &dp->i_di, 0);
+		error = fs_start(fs, credits);
+		if (error)
+			error_message("mv", dst_name, error);
+	}
+	if (error) {
+		if (tp != NULL) {
+			iunlock(tp);
+			iput(fs, tp);
+		}
+		if (dp != sp) {
+			iunlock(dp);
+			iput(fs, dp);
+		}
+		iunlock(sp);
+		iput(fs, sp);
+		return;
+	}
+
+	if (sp == dp && !(dp->i_di.sfi_flags & SFS_IFLAG_HASHDIR)) {
+		// rename in place
+		disk_read(fs->disk, sd, loc.dl_block);
+		dirent_set(&sd[loc.dl_slot], dname, ent.sfd_ino, type);
+		meta_write(fs, sd, loc.dl_block);
+		dcache_enter(fs, dp->i_ino, sname, SFS_NOINO,
+			     SFS_TYPE_INVAL, NULL);
+		dcache_enter(fs, dp->i_ino, dname, ent.sfd_ino, type, &loc);
+	}
+	else {
+		// add the new name, then drop the old entry, which a bucket
+		// split may have moved
+		error = dir_add(fs, dp, dname, ent.sfd_ino, type);
+		if (error)
+			error_message("mv", dst_name, error);
+		else if (dir_find(fs, sp, sname, &ent, NULL, &loc) == 0)
+			dir_remove(fs, sp, &loc);
+		if (!error && tp != NULL)
+			dir_reparent(fs, tp, dp->i_ino);
+	}
+	if (!error && ent.sfd_ino == fs->sd_cwd.sfd_ino)
+		strcpy(fs->sd_cwd.sfd_name, dname);
+	if (tp != NULL) {
+		iunlock(tp);
+		iput(fs, tp);
+	}
+	if (dp != sp) {
+		iunlock(dp);
+		iput(fs, dp);
+	}
+	iunlock(sp);
+	iput(fs, sp);
+	fs_flush(fs, credits);
+}
+
+void sfs_rm(const char* path) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *dp, *tp;
+	struct sfs_dir ent;
+	struct dirloc loc;
+	char name[SFS_NAMELEN];
+	u_int16_t type;
+	u_int32_t credits;
+	int error;
+
+	dp = namei_lockparent(fs, "rm", path, name);
+	if (dp == NULL)
+		return;
+
+	// Error1: does not exist that file.
+	if (dir_find(fs, dp, name, &ent, &type, &loc) != 0) {
+		error_message("rm", path, -1);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	// Error2 : is a dir
+	if (type == SFS_TYPE_DIR) {
+		error_message("rm", path, -9);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	tp = iget(fs, ent.sfd_ino);
+	iwlock(tp);
+
+	credits = fs_credits(fs, inode_nblocks(fs, &tp->i_di));
+	error = fs_start(fs, credits);
+	if (error) {
+		error_message("rm", path, error);
+		iunlock(tp);
+		iput(fs, tp);
+		iunlock(dp);
+		iput(fs, dp);
+		return;
+	}
+	file_free_blocks(fs, &tp->i_di);
+	iunlock(tp);
+	idrop(fs, tp);
+	bitmap_free(fs, ent.sfd_ino);
+	dir_remove(fs, dp, &loc);
+	iunlock(dp);
+	iput(fs, dp);
+	fs_flush(fs, credits);
+}
+
+/*
+ * cpin/cpout move file data in chunks of CP_BUFSIZE bytes: one host
+ * read or write per chunk, and one disk transfer per run of contiguous
+ * blocks within it.
+ */
+#define CP_BUFSIZE	(64 * 1024)
+#define CP_CHUNK(fs)	(CP_BUFSIZE / (fs)->fs_bsize)	// blocks per chunk
+
+/*
+ * cpout reads ahead: the reads of the next chunk are started, all at
+ * once, before the current one is written out. Chunks follow the
+ * read-ahead window, so they start small and grow to CP_RAMAX bytes.
+ */
+#define CP_RAMAX	(1024 * 1024)
+#define CP_RABLOCKS(fs)	(CP_RAMAX / (fs)->fs_bsize)	// largest chunk
+
+struct cp_chunk {
+	char *cc_buf;
+	u_int32_t cc_first, cc_end;	// logical blocks held
+	u_int32_t cc_nio;
+	struct disk_io *cc_io;		// one per run
+};
+
+/* Start reading blocks FIRST..END-1 of the file walked by BC into CC */
+static void cp_chunk_start(struct bmap_cursor *bc, struct cp_chunk *cc,
+			   u_int32_t first, u_int32_t end)
+{
+	struct sfs_fs *fs = bc->bc_fs;
+	u_int32_t j, run, pbn;
+
+	cc->cc_first = first;
+	cc->cc_end = end;
+	cc->cc_nio = 0;
+	for (j = first; j < end; j += run) {
+		run = bmap_run(bc, j, end - j, &pbn);
+		if (pbn == 0) {
+			bzero(cc->cc_buf + (j - first) * fs->fs_bsize,
+			      run * fs->fs_bsize);
+			continue;
+		}
+		cc->cc_io[cc->cc_nio].dio_data =
+			cc->cc_buf + (j - first) * fs->fs_bsize;
+		cc->cc_io[cc->cc_nio].dio_block = pbn;
+		cc->cc_io[cc->cc_nio].dio_nblocks = run;
+		cc->cc_nio++;
+	}
+	disk_aread(fs->disk, cc->cc_io, cc->cc_nio);
+}
+
+/* read() or write() LEN bytes, resuming short transfers; stops at EOF */
+static ssize_t host_io(int iswrite, int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		if (iswrite)
+			n = write(fd, p + done, len - done);
+		else
+			n = read(fd, p + done, len - done);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * cpin: copy host file PATH in as LOCAL_PATH. Blocks are taken in the
+ * reference shell's order -- the directory's new block if it needs one,
+ * the inode, then the data -- so on a fresh image they land where its
+ * cpin puts them. One thing differs: the bytes past the end of the file
+ * in its last block are zeroed here, where the reference shell leaves
+ * whatever its buffer held.
+ */
+void sfs_cpin(const char* local_path, const char* path) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *dp, *np;
+	struct sfs_dir ent;
+	char name[SFS_NAMELEN];
+	struct stat st;
+	struct bmap_cursor bc;
+	u_int32_t newbie_ino, nblk = 0, maxblk, placed, want, credits;
+	ssize_t got;
+	char *buf;
+	int fd, error;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("cpin: can't open %s input file\n", path);
+		return;
+	}
+	maxblk = file_maxblocks(fs, file_newflags(fs));
+	if (fstat(fd, &st) < 0 ||
+	    st.st_size > (off_t)maxblk * fs->fs_bsize) {
+		printf("cpin: input file size exceeds the max file size\n");
+		close(fd);
+		return;
+	}
+	// a file is copied as it was when opened
+	if (S_ISREG(st.st_mode))
+		maxblk = (st.st_size + fs->fs_bsize - 1) / fs->fs_bsize;
+
+	dp = namei_lockparent(fs, "cpin", local_path, name);
+	if (dp == NULL) {
+		close(fd);
+		return;
+	}
+
+	if (dir_find(fs, dp, name, &ent, NULL, NULL) == 0) {
+		error_message("cpin", local_path, -6);
+		iunlock(dp);
+		iput(fs, dp);
+		close(fd);
+		return;
+	}
+
+	// the inode, the data, its indirect blocks and a reservation
+	credits = dir_add_credits(fs, &dp->i_di, 1 + maxblk +
+				  maxblk / (fs->fs_ppb - 1) + BMAP_MAXDEPTH +
+				  BMAP_PREALLOC);
+	error = fs_start(fs, credits);
+	if (error) {
+		error_message("cpin", local_path, error);
+		iunlock(dp);
+		iput(fs, dp);
+		close(fd);
+		return;
+	}
+	newbie_ino = 0;
+	if (dir_make_room(fs, dp) == 0)
+		newbie_ino = bitmap_alloc(fs, dp->i_ino);
+	if (newbie_ino == 0) {
+		error_message("cpin", local_path, -4);
+		iunlock(dp);
+		iput(fs, dp);
+		close(fd);
+		fs_flush(fs, credits);
+		return;
+	}
+	np = iget_new(fs, newbie_ino);
+	np->i_di.sfi_type = SFS_TYPE_FILE;
+	np->i_di.sfi_flags = file_newflags(fs);
+
+	error = dir_add(fs, dp, name, newbie_ino, SFS_TYPE_FILE);
+	if (error) {
+		iunlock(np);
+		idrop(fs, np);
+		bitmap_free(fs, newbie_ino);
+		error_message("cpin", local_path, error);
+		iunlock(dp);
+		iput(fs, dp);
+		close(fd);
+		fs_flush(fs, credits);
+		return;
+	}
+	// the new file stays locked while it fills
+	iunlock(dp);
+	iput(fs, dp);
+
+	bmap_init(&bc, fs, &np->i_di);
+	bc.bc_goal = newbie_ino + 1;	// the data follows the inode
+	buf = malloc(CP_BUFSIZE);
+	assert(buf != NULL);
+	while (nblk < maxblk) {
+		want = maxblk - nblk;
+		if (want > CP_CHUNK(fs))
+			want = CP_CHUNK(fs);
+		got = host_io(0, fd, buf, want * fs->fs_bsize);
+		if (got <= 0)
+			break;
+		want = (got + fs->fs_bsize - 1) / fs->fs_bsize;
+		bzero(buf + got, want * fs->fs_bsize - got);
+
+		error = file_append(&bc, nblk, buf, want, &placed);
+		nblk += placed;
+		if (error) {
+			// keep what fit
+			np->i_di.sfi_size = nblk * fs->fs_bsize;
+			error_message("cpin", local_path, error);
+			break;
+		}
+		np->i_di.sfi_size += got;
+	}
+	bmap_release(&bc);
+	bmap_flush(&bc);
+	imark_dirty(np);
+	iunlock(np);
+	iput(fs, np);
+	free(buf);
+	close(fd);
+	fs_flush(fs, credits);
+}
+
+void sfs_cpout(const char* local_path, const char* path) 
+{
+	struct sfs_fs *fs = cur_fs;
+	struct inode *ip;
+	struct sfs_dir ent;
+	struct bmap_cursor bc;
+	struct cp_chunk cc[2], *cur, *next;
+	struct disk_ra ra;
+	u_int32_t size, nblk, first, want, i, bs = fs->fs_bsize;
+	u_int16_t type;
+	size_t len;
+	int fd, error;
+
+	error = namei(fs, fs->sd_cwd.sfd_ino, local_path, &ent, &type);
+	if (error != 0) {
+		error_message("cpout", local_path, error);
+		return;
+	}
+	if (type != SFS_TYPE_FILE) {
+		error_message("cpout", local_path, -10);
+		return;
+	}
+	if (access(path, F_OK) == 0) {
+		error_message("cpout", path, -6);
+		return;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		printf("cpout: can't open %s output file\n", path);
+		return;
+	}
+
+	ip = iget(fs, ent.sfd_ino);
+	irlock(ip);
+	size = ip->i_di.sfi_size;
+	nblk = (size + bs - 1) / bs;
+	bmap_init(&bc, fs, &ip->i_di);
+
+	for (i = 0; i < 2; i++) {
+		cc[i].cc_buf = malloc(CP_RAMAX);
+		cc[i].cc_io = malloc(CP_RABLOCKS(fs) * sizeof(struct disk_io));
+		assert(cc[i].cc_buf != NULL && cc[i].cc_io != NULL);
+	}
+
+	/* every chunk is used whole, so each one is followed by a window */
+	disk_ra_init(fs->disk, &ra, CP_RABLOCKS(fs));
+	cur = &cc[0];
+	next = &cc[1];
+	want = disk_ra_access(&ra, 0, 0, &first);
+	if (nblk > 0)
+		cp_chunk_start(&bc, cur, 0, want < nblk ? want : nblk);
+	while (nblk > 0) {
+		want = disk_ra_access(&ra, cur->cc_first,
+				      cur->cc_end - cur->cc_first, &first);
+		if (cur->cc_end < nblk)
+			cp_chunk_start(&bc, next, first,
+				       first + want < nblk ? first + want : nblk);
+		disk_await(fs->disk, cur->cc_io, cur->cc_nio);
+		len = (cur->cc_end - cur->cc_first) * bs;
+		if (len > size - cur->cc_first * bs)
+			len = size - cur->cc_first * bs;
+		if (host_io(1, fd, cur->cc_buf, len) != (ssize_t)len) {
+			printf("cpout: %s: write failed\n", path);
+			if (cur->cc_end < nblk)
+				disk_await(fs->disk, next->cc_io,
+					   next->cc_nio);
+			break;
+		}
+		if (cur->cc_end == nblk)
+			break;
+		cur = next;
+		next = (cur == &cc[0]) ? &cc[1] : &cc[0];
+	}
+	iunlock(ip);
+	iput(fs, ip);
+	for (i = 0; i < 2; i++) {
+		free(cc[i].cc_buf);
+		free(cc[i].cc_io);
+	}
+	close(fd);
+}
+
+static int dump_bucket(const struct sfs_dir *sd, u_int32_t blk, void *arg)
+{
+	const struct sfs_dirbucket *hdr = (const struct sfs_dirbucket *)sd;
+
+	printf("bucket block %d next %d count %d\n",
+	       blk, hdr->sdb_next, hdr->sdb_count);
+	dump_directory(arg, sd);
+	return 0;
+}
+
+void dump_inode(struct sfs_fs *fs, const struct sfs_inode *inode) {
+	int i;
+	struct sfs_dir dbuf[SFS_MAXDENTRIES];
+
+	if (inode->sfi_flags & SFS_IFLAG_EXTENTS) {
+		printf("size %d type %d extents", inode->sfi_size, inode->sfi_type);
+		for(i=0; i < inode->sfi_nextent; i++) {
+			printf(" %d+%d", inode->sfi_extent[i].se_start,
+			       inode->sfi_extent[i].se_len);
+		}
+		printf("\n");
+		return;
+	}
+	printf("size %d type %d direct ", inode->sfi_size, inode->sfi_type);
+	for(i=0; i < SFS_NDIRECT; i++) {
+		printf(" %d ", inode->sfi_direct[i]);
+	}
+	printf(" indirect %d",inode->sfi_indirect);
+	if (inode->sfi_dindirect != 0 || inode->sfi_tindirect != 0)
+		printf(" dindirect %d tindirect %d", inode->sfi_dindirect,
+		       inode->sfi_tindirect);
+	if (inode->sfi_flags & SFS_IFLAG_HASHDIR)
+		printf(" hashed");
+	printf("\n");
+
+	if (inode->sfi_type == SFS_TYPE_DIR) {
+		for(i=0; i < SFS_NDIRECT; i++) {
+			if (inode->sfi_direct[i] == 0) continue;
+			dump_directory(fs, block_get(fs, dbuf, inode->sfi_direct[i]));
+		}
+		if (inode->sfi_flags & SFS_IFLAG_HASHDIR)
+			dirhash_walk(fs, inode, dump_bucket, fs);
+	}
+
+}
+
+/* A debugging aid: the entries' inodes are printed without locking them */
+void dump_directory(struct sfs_fs *fs, const struct sfs_dir dir_entry[]) {
+	int i;
+	struct inode *ip;
+	dirblk_prefetch(fs, dir_entry, 0, 0);
+	for(i=0; i < fs->fs_dpb;i++) {
+		printf("%d %s\n",dir_entry[i].sfd_ino, dir_entry[i].sfd_name);
+		if (dir_entry[i].sfd_ino == SFS_NOINO)
+			continue;
+		ip = iget(fs, dir_entry[i].sfd_ino);
+		if (ip->i_di.sfi_type == SFS_TYPE_FILE) {
+			printf("\t");
+			dump_inode(fs, &ip->i_di);
+		}
+		iput(fs, ip);
+	}
+}
+
+void sfs_dump() {
+	// dump the current directory structure
+	struct sfs_fs *fs = cur_fs;
+	struct inode *cp = iget(fs, fs->sd_cwd.sfd_ino);
+
+	irlock(cp);
+	printf("cwd inode %d name %s\n",fs->sd_cwd.sfd_ino,fs->sd_cwd.sfd_name);
+	dump_inode(fs, &cp->i_di);
+	printf("\n");
+	iunlock(cp);
+	iput(fs, cp);
+
+}
+
+/*
+ * Consistency check.
+ *
+ * fsck walks the tree from the root and marks every block it reaches
+ * in a map of its own: inodes, directory blocks and hash indexes, file
+ * data and indirect blocks, on top of the superblock, the freemap and
+ * the journal. Directories are shared out among worker threads through
+ * a queue: a worker scans one directory, reading the inodes of each of
+ * its blocks' entries ahead in one batch, and queues the subdirectories
+ * it finds. Every block is read once. Marks are set with atomic ORs,
+ * so a block reached a second time is caught as it happens. The map is
+ * then compared with the freemap a word at a time.
+ *
+ * Each directory's part of the listing is kept in memory, with the
+ * places where its subdirectories' parts go, and is printed in tree
+ * order once the walk is over.
+ */
+#define FSCK_MAXTHREADS	16
+
+struct fsck_dir;
+
+/* A subdirectory's part of the listing goes at FC_OFF of its parent's */
+struct fsck_child {
+	size_t fc_off;
+	struct fsck_dir *fc_dir;
+};
+
+struct fsck_dir {
+	struct sfs_inode fd_di;		// the directory's inode
+	u_int32_t fd_ino;
+	u_int32_t fd_parent;		// what ".." should be
+	int fd_depth;			// 1 for the root
+	char *fd_out;			// its part of the listing
+	size_t fd_len, fd_size;
+	struct fsck_child *fd_child;
+	int fd_nchild, fd_maxchild;
+	struct fsck_dir *fd_next;	// next on the work queue
+};
+
+struct fsck {
+	struct sfs_fs *fk_fs;
+	int fk_flags;			// SFS_FSCK_*
+	u_int64_t *fk_reach;		// blocks reached by the walk
+	u_int64_t *fk_dup;		// ...and reached more than once
+
+	pthread_mutex_t fk_lock;	// guards the queue
+	pthread_cond_t fk_cv;
+	struct fsck_dir *fk_head, *fk_tail;
+	int fk_pending;			// directories queued or being scanned
+
+	unsigned long fk_ndirs, fk_nfiles, fk_nerrors;
+};
+
+/* Arguments of fsck_bucket() */
+struct fsck_scan_arg {
+	struct fsck *fk;
+	struct fsck_dir *fd;
+};
+
+static void fsck_vappend(struct fsck_dir *fd, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int n;
+
+	for (;;) {
+		if (fd->fd_out != NULL) {
+			va_copy(aq, ap);
+			n = vsnprintf(fd->fd_out + fd->fd_len,
+				      fd->fd_size - fd->fd_len, fmt, aq);
+			va_end(aq);
+			if (fd->fd_len + n < fd->fd_size)
+				break;
+		}
+		fd->fd_size = fd->fd_size * 2 + 256;
+		fd->fd_out = realloc(fd->fd_out, fd->fd_size);
+		assert(fd->fd_out != NULL);
+	}
+	fd->fd_len += n;
+}
+
+/* Add to FD's part of the listing, unless only problems are reported */
+static void fsck_print(struct fsck *fk, struct fsck_dir *fd,
+		       const char *fmt, ...)
+{
+	va_list ap;
+
+	if (fk->fk_flags & SFS_FSCK_QUIET)
+		return;
+	va_start(ap, fmt);
+	fsck_vappend(fd, fmt, ap);
+	va_end(ap);
+}
+
+/* Report a problem found while scanning FD, in its place in the listing */
+static void fsck_error(struct fsck *fk, struct fsck_dir *fd,
+		       const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fsck_vappend(fd, fmt, ap);
+	va_end(ap);
+	__atomic_add_fetch(&fk->fk_nerrors, 1, __ATOMIC_RELAXED);
+}
+
+/* The "> " prefix of a line DEPTH levels down */
+static void fsck_indent(struct fsck *fk, struct fsck_dir *fd, int depth)
+{
+	while (depth-- > 0)
+		fsck_print(fk, fd, "> ");
+}
+
+/*
+ * Mark block B reached. Returns 0 the first time, 1 if it was reached
+ * before and -1 if B is not on the volume.
+ */
+static int fsck_mark(struct fsck *fk, u_int32_t b)
+{
+	u_int64_t mask = 1ULL << (b % BM_WORDBITS);
+	u_int64_t old;
+
+	if (b >= fk->fk_fs->spb.sp_nblocks)
+		return -1;
+	old = __atomic_fetch_or(&fk->fk_reach[b / BM_WORDBITS], mask,
+				__ATOMIC_RELAXED);
+	if (!(old & mask))
+		return 0;
+	__atomic_fetch_or(&fk->fk_dup[b / BM_WORDBITS], mask, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Mark block B of inode INO, complaining if it is not on the volume.
+ * Nonzero if B must not be read: it is off the volume or was reached
+ * (and read) before.
+ */
+static int fsck_block(struct fsck *fk, struct fsck_dir *fd, u_int32_t ino,
+		      u_int32_t b)
+{
+	int r = fsck_mark(fk, b);
+
+	if (r < 0)
+		fsck_error(fk, fd, "fsck: inode %u: block %u out of range\n",
+			   ino, b);
+	return r;
+}
+
+/* Mark indirect block BLK of inode INO, LEVELS above the data, and below */
+static void fsck_ind(struct fsck *fk, struct fsck_dir *fd, u_int32_t ino,
+		     u_int32_t blk, int levels)
+{
+	u_int32_t buf[SFS_MAXPTRS];
+	const u_int32_t *ind;
+	int i;
+
+	if (fsck_block(fk, fd, ino, blk))
+		return;
+	ind = block_get(fk->fk_fs, buf, blk);
+	for (i = 0; i < fk->fk_fs->fs_ppb; i++) {
+		if (ind[i] == 0)
+			continue;
+		if (levels > 1)
+			fsck_ind(fk, fd, ino, ind[i], levels - 1);
+		else
+			fsck_block(fk, fd, ino, ind[i]);
+	}
+}
+
+/* List file INO, an entry of FD, and mark its blocks */
+static void fsck_file(struct fsck *fk, struct fsck_dir *fd, u_int32_t ino,
+		      const struct sfs_inode *si)
+{
+	const struct sfs_extent *ext;
+	u_int32_t j;
+	int i;
+
+	fsck_indent(fk, fd, fd->fd_depth + 1);
+	fsck_print(fk, fd, " size %u type %u ", si->sfi_size, si->sfi_type);
+	if (si->sfi_flags & SFS_IFLAG_EXTENTS) {
+		fsck_print(fk, fd, "extents");
+		for (i = 0; i < si->sfi_nextent; i++)
+			fsck_print(fk, fd, " %u+%u", si->sfi_extent[i].se_start,
+				   si->sfi_extent[i].se_len);
+		fsck_print(fk, fd, "\n");
+		for (i = 0; i < si->sfi_nextent; i++) {
+			ext = &si->sfi_extent[i];
+			for (j = 0; j < ext->se_len; j++) {
+				if (fsck_block(fk, fd, ino, ext->se_start + j) < 0)
+					break;
+			}
+		}
+		return;
+	}
+
+	fsck_print(fk, fd, "direct ");
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (si->sfi_direct[i] != 0)
+			fsck_print(fk, fd, "%u ", si->sfi_direct[i]);
+	}
+	if (si->sfi_indirect != 0)
+		fsck_print(fk, fd, "indirect %u", si->sfi_indirect);
+	if (si->sfi_dindirect != 0)
+		fsck_print(fk, fd, " dindirect %u", si->sfi_dindirect);
+	if (si->sfi_tindirect != 0)
+		fsck_print(fk, fd, " tindirect %u", si->sfi_tindirect);
+	fsck_print(fk, fd, "\n");
+
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (si->sfi_direct[i] != 0)
+			fsck_block(fk, fd, ino, si->sfi_direct[i]);
+	}
+	if (si->sfi_indirect != 0)
+		fsck_ind(fk, fd, ino, si->sfi_indirect, 1);
+	if (si->sfi_dindirect != 0)
+		fsck_ind(fk, fd, ino, si->sfi_dindirect, 2);
+	if (si->sfi_tindirect != 0)
+		fsck_ind(fk, fd, ino, si->sfi_tindirect, 3);
+}
+
+static struct fsck_dir *fsck_dir_new(const struct sfs_inode *si,
+				     u_int32_t ino, u_int32_t parent,
+				     int depth)
+{
+	struct fsck_dir *fd = calloc(1, sizeof(*fd));
+
+	assert(fd != NULL);
+	fd->fd_di = *si;
+	fd->fd_ino = ino;
+	fd->fd_parent = parent;
+	fd->fd_depth = depth;
+	return fd;
+}
+
+static void fsck_queue(struct fsck *fk, struct fsck_dir *fd)
+{
+	pthread_mutex_lock(&fk->fk_lock);
+	if (fk->fk_tail != NULL)
+		fk->fk_tail->fd_next = fd;
+	else
+		fk->fk_head = fd;
+	fk->fk_tail = fd;
+	fk->fk_pending++;
+	pthread_cond_signal(&fk->fk_cv);
+	pthread_mutex_unlock(&fk->fk_lock);
+}
+
+/* List entry ENT of directory FD; files are checked, directories queued */
+static void fsck_entry(struct fsck *fk, struct fsck_dir *fd,
+		       const struct sfs_dir *ent)
+{
+	struct sfs_fs *fs = fk->fk_fs;
+	char buf[SFS_MAXBLOCKSIZE];
+	const struct sfs_inode *si;
+	struct fsck_dir *child;
+	u_int32_t ino = ent->sfd_ino;
+
+	fsck_indent(fk, fd, fd->fd_depth);
+	fsck_print(fk, fd, " %u %s\n", ino, ent->sfd_name);
+
+	if (is_dot(ent->sfd_name)) {
+		if (ino != (strcmp(ent->sfd_name, ".") == 0 ? fd->fd_ino
+							    : fd->fd_parent))
+			fsck_error(fk, fd, "fsck: directory %u: %s is inode "
+				   "%u\n", fd->fd_ino, ent->sfd_name, ino);
+		return;
+	}
+	switch (fsck_mark(fk, ino)) {
+	case -1:
+		fsck_error(fk, fd, "fsck: directory %u: %s: inode %u out of "
+			   "range\n", fd->fd_ino, ent->sfd_name, ino);
 		return;
+	case 1:
+		return;		// reported with the map
+	}
+
+	si = block_get(fs, buf, ino);
+	switch (si->sfi_type) {
+	case SFS_TYPE_FILE:
+		fsck_indent(fk, fd, fd->fd_depth);
+		fsck_print(fk, fd, " file inode %u name %s\n", ino,
+			   ent->sfd_name);
+		fsck_file(fk, fd, ino, si);
+		__atomic_add_fetch(&fk->fk_nfiles, 1, __ATOMIC_RELAXED);
+		break;
+	case SFS_TYPE_DIR:
+		fsck_indent(fk, fd, fd->fd_depth);
+		fsck_print(fk, fd, " directory inode %u name %s\n", ino,
+			   ent->sfd_name);
+		if (fd->fd_nchild == fd->fd_maxchild) {
+			fd->fd_maxchild = fd->fd_maxchild * 2 + 8;
+			fd->fd_child = realloc(fd->fd_child, fd->fd_maxchild *
+					       sizeof(*fd->fd_child));
+			assert(fd->fd_child != NULL);
+		}
+		child = fsck_dir_new(si, ino, fd->fd_ino, fd->fd_depth + 1);
+		fd->fd_child[fd->fd_nchild].fc_off = fd->fd_len;
+		fd->fd_child[fd->fd_nchild++].fc_dir = child;
+		fsck_queue(fk, child);
+		break;
+	default:
+		fsck_error(fk, fd, "fsck: directory %u: %s: inode %u has "
+			   "type %u\n", fd->fd_ino, ent->sfd_name, ino,
+			   si->sfi_type);
 	}
 }
 
-void sfs_mount(const char* path)
+static int fsck_bucket(const struct sfs_dir *sd, u_int32_t blk, void *arg)
+{
+	struct fsck_scan_arg *sa = arg;
+	int j;
+
+	fsck_block(sa->fk, sa->fd, sa->fd->fd_ino, blk);
+	dirblk_prefetch(sa->fk->fk_fs, sd, 1, 0);
+	for (j = 1; j < sa->fk->fk_fs->fs_dpb; j++) {
+		if (sd[j].sfd_ino != SFS_NOINO)
+			fsck_entry(sa->fk, sa->fd, &sd[j]);
+	}
+	return 0;
+}
+
+/* Mark the blocks of directory FD and go through its entries */
+static void fsck_scan(struct fsck *fk, struct fsck_dir *fd)
 {
-	if( sd_cwd.sfd_ino !=  SFS_NOINO )
-	{
-		//umount
-		disk_close();
-		printf("%s, unmounted\n", spb.sp_volname);
-		bzero(&spb, sizeof(struct sfs_super));
-		sd_cwd.sfd_ino = SFS_NOINO;
+	struct sfs_fs *fs = fk->fk_fs;
+	const struct sfs_inode *si = &fd->fd_di;
+	struct sfs_inode di;
+	const struct sfs_dir *sd[SFS_NDIRECT];
+	char *buf;
+	u_int32_t top[SFS_MAXPTRS];
+	const u_int32_t *idx;
+	struct fsck_scan_arg sa;
+	int i, j, bad = 0;
+
+	__atomic_add_fetch(&fk->fk_ndirs, 1, __ATOMIC_RELAXED);
+	di = *si;		// only the blocks that may be read are
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (si->sfi_direct[i] != 0 &&
+		    fsck_block(fk, fd, fd->fd_ino, si->sfi_direct[i]))
+			di.sfi_direct[i] = 0;
 	}
+	buf = malloc(SFS_NDIRECT * fs->fs_bsize);
+	assert(buf != NULL);
+	dir_blocks_get(fs, &di, buf, sd);
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (sd[i] == NULL)
+			continue;
+		dirblk_prefetch(fs, sd[i], 0, 0);
+		for (j = 0; j < fs->fs_dpb; j++) {
+			if (sd[i][j].sfd_ino != SFS_NOINO)
+				fsck_entry(fk, fd, &sd[i][j]);
+		}
+	}
+	free(buf);
+	if (!(si->sfi_flags & SFS_IFLAG_HASHDIR) ||
+	    fsck_block(fk, fd, fd->fd_ino, si->sfi_indirect))
+		return;
+
+	/* The buckets are only walked if the whole index is sound */
+	idx = block_get(fs, top, si->sfi_indirect);
+	for (i = 0; i < fs->fs_ppb; i++) {
+		if (idx[i] != 0 && fsck_block(fk, fd, fd->fd_ino, idx[i]))
+			bad = 1;
+	}
+	if (bad)
+		return;
+	sa.fk = fk;
+	sa.fd = fd;
+	dirhash_walk(fs, si, fsck_bucket, &sa);
+}
 
-	printf("Disk image: %s\n", path);
+static void *fsck_worker(void *arg)
+{
+	struct fsck *fk = arg;
+	struct fsck_dir *fd;
 
-	disk_open(path);
-	disk_read( &spb, SFS_SB_LOCATION );
+	pthread_mutex_lock(&fk->fk_lock);
+	for (;;) {
+		while (fk->fk_head == NULL && fk->fk_pending > 0)
+			pthread_cond_wait(&fk->fk_cv, &fk->fk_lock);
+		fd = fk->fk_head;
+		if (fd == NULL)
+			break;
+		fk->fk_head = fd->fd_next;
+		if (fk->fk_head == NULL)
+			fk->fk_tail = NULL;
+		pthread_mutex_unlock(&fk->fk_lock);
 
-	printf("Superblock magic: %x\n", spb.sp_magic);
+		fsck_scan(fk, fd);
 
-	assert( spb.sp_magic == SFS_MAGIC );
-	
-	printf("Number of blocks: %d\n", spb.sp_nblocks);
-	printf("Volume name: %s\n", spb.sp_volname);
-	printf("%s, mounted\n", spb.sp_volname);
-	
-	sd_cwd.sfd_ino = 1;		//init at root
-	sd_cwd.sfd_name[0] = '/';
-	sd_cwd.sfd_name[1] = '\0';
+		pthread_mutex_lock(&fk->fk_lock);
+		if (--fk->fk_pending == 0)
+			pthread_cond_broadcast(&fk->fk_cv);
+	}
+	pthread_mutex_unlock(&fk->fk_lock);
+	return NULL;
 }
 
-void sfs_umount() {
+/* Print FD's part of the listing with its subdirectories', and free it */
+static void fsck_output(struct fsck_dir *fd)
+{
+	size_t off = 0;
+	int i;
 
-	if( sd_cwd.sfd_ino !=  SFS_NOINO )
-	{
-		//umount
-		disk_close();
-		printf("%s, unmounted\n", spb.sp_volname);
-		bzero(&spb, sizeof(struct sfs_super));
-		sd_cwd.sfd_ino = SFS_NOINO;
+	for (i = 0; i < fd->fd_nchild; i++) {
+		fwrite(fd->fd_out + off, 1, fd->fd_child[i].fc_off - off, stdout);
+		off = fd->fd_child[i].fc_off;
+		fsck_output(fd->fd_child[i].fc_dir);
 	}
+	if (fd->fd_len > off)
+		fwrite(fd->fd_out + off, 1, fd->fd_len - off, stdout);
+	free(fd->fd_out);
+	free(fd->fd_child);
+	free(fd);
 }
 
+/*
+ * Report LEN blocks from START found to be in KIND of trouble: 0, in
+ * use on the freemap but not reached; 1, reached but free on the
+ * freemap; 2, reached more than once.
+ */
+static void fsck_report(int kind, u_int32_t start, u_int32_t len)
+{
+	char range[32];
 
-void sfs_touch(const char* path)
+	if (len == 1)
+		snprintf(range, sizeof(range), "%u", start);
+	else
+		snprintf(range, sizeof(range), "%u-%u", start, start + len - 1);
+	if (kind == 2)
+		printf("block %s reached more than once\n", range);
+	else
+		printf("bitmap %s error %d(fsck) != %d (bitmap)\n", range,
+		       kind, !kind);
+}
+
+/*
+ * Report, in runs of the same kind, the blocks set in MAP if DUP, or
+ * those whose bit in MAP, the reached blocks, differs from the freemap.
+ * Returns how many blocks were reported.
+ */
+static u_int32_t fsck_runs(struct fsck *fk, const u_int64_t *map, int dup)
 {
-	//skeleton implementation
-
-	struct sfs_inode si;
-	disk_read( &si, sd_cwd.sfd_ino );
-
-	//for consistency
-	assert( si.sfi_type == SFS_TYPE_DIR );
-
-	//we assume that cwd is the root directory and root directory is empty which has . and .. only
-	//unused DISK2.img satisfy these assumption
-	//for new directory entry(for new file), we use cwd.sfi_direct[0] and offset 2
-	//becasue cwd.sfi_directory[0] is already allocated, by .(offset 0) and ..(offset 1)
-	//for new inode, we use block 6 
-	// block 0: superblock,	block 1:root, 	block 2:bitmap 
-	// block 3:bitmap,  	block 4:bitmap 	block 5:root.sfi_direct[0] 	block 6:unused
-	//
-	//if used DISK2.img is used, result is not defined
-
-    //buffer for disk read
-    struct sfs_dir sd[SFS_DENTRYPERBLOCK];
-    int c;
-
-    // Error1: is there same path ?
-    int samePath = 0;
-    for (c = 0; c < SFS_NDIRECT; c++) {
-        disk_read(sd,si.sfi_direct[c]);
-        int d;
-        for(d=0; d < SFS_DENTRYPERBLOCK;d++) {
-            if(strcmp(sd[d].sfd_name,path) == 0){
-                samePath = 1;
-            }
-        }
-    }
-    if(samePath == 1){
-        error_message("touch",path,-6);
-        return;
-    }
-    int bm[4096]={0,};
-    int real[4096]={0,};
-    int temp[4096]={0,};
-    int afbm[4096];
-
-    int bmNum = 0;
-    if(spb.sp_nblocks%4096 == 0){
-        bmNum = spb.sp_nblocks/4096;
-    }else{
-        bmNum = spb.sp_nblocks/4096 + 1;
-    }
-
-    int a;
-    int curbm = 0;
-    int bitFull = 1;
-    for(a =2;a < bmNum; a++){
-        disk_read(bm,a);
-        if(bm[127]!= -1){
-            bitFull = 0;
-            curbm = a;
-            break;
-        }
-    }
-    // Error 2: bitmap Full
-    if(bitFull == 1){
-        error_message("touch",path,-4);
-        return;
-    }
-    // Error3: directory is full
-    disk_read(sd,si.sfi_direct[14]);
-    if(sd[7].sfd_ino != 0){
-        error_message("touch",path,-3);
-        return ;
-    }
-    int x;
-    for (x = 0;x <4096 ;x++) {
-        afbm[x] = bm[x];
-    }
-//    int m,n;
-//    for (m = 0; m < 512; ++m) {
-//        for (n = 0; n < 8; ++n) {
-//            printf("%d",bm[8*m+n]);
-//        }
-//        printf("\n");
-//    }
-    int p = 0;
-    int k = 0;
-    int i,j;
-    int position;
-    int find = 0;
-    while(afbm[k] == -1){
-        k++;
-    }
-    while (1){
-        temp[p] = bm[k] % 2;
-        bm[k] = bm[k] /2;
-        p++;
-        if(bm[k] ==0)   break;
-    }
-    for(i = p -1; i >=0; i--) {
-        real[p-i-1] = temp[i];
-    }
-
-    int flag = 0;
-    for (i = 0; i< 512; i++) {
-        for (j = 0; j < 8; ++j) {
-            if(real[8*i+j] == 0){
-                position = k*32+8*i+j;
-                real[8*i+j] = 1;
-                flag = 1;
-                break;
-            }
-        }
-        if(flag == 1){
-            break;
-        }
-    }
-    BIT_FLIP(afbm[k],position);
-    disk_write(afbm,curbm);
-
-    //allocate new block
-    int newbie_ino = position;
-    int l;
-    int location = 100;
-    int v;
-    int directNum;
-    int nextDirect = 0;
-    for(v =0;v<SFS_NDIRECT;v++){
-        //block access
-        if(si.sfi_direct[v] == 0){
-            location = 0;
-            directNum = v;
-            nextDirect = 1;
-            break;
-        }
-        disk_read(sd, si.sfi_direct[v]);
-
-        if(v == 0){
-            for (l = 2; l <8 ; l++) {
-                if (sd[l].sfd_ino == 0) {
-                    location = l;
-                    break;
-                }
-            }
-        }
-        else {
-            for (l = 1; l < 8; l++) {
-                if (sd[l].sfd_ino == 0) {
-                    location = l;
-                    break;
-                }
-            }
-        }
-        if(location != 100){
-            directNum = v;
-            break;
-        }
-    }
-
-    if(nextDirect == 1){
-        int m;
-        for (m = 0; m < 4096; m++) {
-            bm[m] = 0;
-            real[m]= 0;
-            temp[m] = 0;
-        }
-        bitFull = 1;
-        for(a =2;a < bmNum; a++){
-            disk_read(bm,a);
-            if(bm[127]!= -1){
-                bitFull = 0;
-                curbm = a;
-                break;
-            }
-        }
-        // Error 2: bitmap Full
-        if(bitFull == 1){
-            error_message("touch",path,-4);
-            return;
-        }
-        for (x = 0;x <4096 ;x++) {
-            afbm[x] = bm[x];
-        }
-        while(afbm[k] == -1){
-            k++;
-        }
-        while (1){
-            temp[p] = bm[k] % 2;
-            bm[k] = bm[k] /2;
-            p++;
-            if(bm[k] ==0)   break;
-        }
-        for(i = p -1; i >=0; i--) {
-            real[p-i-1] = temp[i];
-        }
-
-        flag = 0;
-        int nextPosition;
-        for (i = 0; i< 512; i++) {
-            for (j = 0; j < 8; ++j) {
-                if(real[8*i+j] == 0){
-                    nextPosition = 32*k+8*i+j;
-                    real[8*i+j] = 1;
-                    flag = 1;
-                    break;
-                }
-            }
-            if(flag == 1){
-                break;
-            }
-        }
-        BIT_FLIP(afbm[k],nextPosition);
-        disk_write(afbm,curbm);
-
-        newbie_ino = nextPosition;
-
-        si.sfi_direct[directNum] = position;
-        disk_write( &si, sd_cwd.sfd_ino );
-        struct sfs_inode newD;
-        bzero(&newD,SFS_BLOCKSIZE);
-        newD.sfi_size = 0;
-        disk_write(&newD,position);
-        disk_read( &si, sd_cwd.sfd_ino );
-        disk_read( sd, si.sfi_direct[directNum] );
-    }
-    sd[location].sfd_ino = newbie_ino;
-    strncpy( sd[location].sfd_name, path, SFS_NAMELEN );
-
-	disk_write( sd, si.sfi_direct[directNum] );
-
-	si.sfi_size += sizeof(struct sfs_dir);
-	disk_write( &si, sd_cwd.sfd_ino );
-
-	struct sfs_inode newbie;
-
-	bzero(&newbie,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
-	newbie.sfi_size = 0;
-	newbie.sfi_type = SFS_TYPE_FILE;
-	disk_write( &newbie, newbie_ino );
-	//
-	//disk_read(sd,si.sfi_direct[directNum]);
+	struct sfs_fs *fs = fk->fk_fs;
+	u_int32_t nwords = (fs->spb.sp_nblocks + BM_WORDBITS - 1) / BM_WORDBITS;
+	u_int32_t w, b, start = 0, len = 0, count = 0;
+	u_int64_t bits;
+	int kind, runkind = 0;
 
+	for (w = 0; w < nwords; w++) {
+		bits = dup ? map[w] : map[w] ^ fs->bm_map[w];
+		if (w == nwords - 1 && fs->spb.sp_nblocks % BM_WORDBITS)
+			bits &= (1ULL << (fs->spb.sp_nblocks % BM_WORDBITS)) - 1;
+		while (bits) {
+			b = w * BM_WORDBITS + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			kind = dup ? 2 : (map[w] >> (b % BM_WORDBITS)) & 1;
+			count++;
+			if (len > 0 && b == start + len && kind == runkind) {
+				len++;
+				continue;
+			}
+			if (len > 0)
+				fsck_report(runkind, start, len);
+			start = b;
+			len = 1;
+			runkind = kind;
+		}
+	}
+	if (len > 0)
+		fsck_report(runkind, start, len);
+	return count;
 }
 
-void sfs_cd(const char* path)
+/*
+ * Make the freemap agree with the reached blocks, one operation per
+ * freemap block so that no journal is too small for it.
+ */
+static void fsck_repair(struct fsck *fk, u_int32_t *freed, u_int32_t *taken)
 {
-    struct sfs_inode c_inode;
-
-    disk_read(&c_inode, sd_cwd.sfd_ino);
-    int i;
-    int errorFlag = 1;// is dir?
-    int isfile = 1;
-    struct sfs_dir dir_entry[SFS_DENTRYPERBLOCK];
-    if(path == NULL){
-        errorFlag = 0;
-        isfile = 0;
-        strcpy(sd_cwd.sfd_name,"/");
-        sd_cwd.sfd_ino = 1;
-    }
-    else if (c_inode.sfi_type == SFS_TYPE_DIR) {
-        for(i=0; i < SFS_NDIRECT; i++) {
-            if(c_inode.sfi_type != SFS_TYPE_DIR) break;
-            if (c_inode.sfi_direct[i] == 0) break;
-            disk_read(dir_entry, c_inode.sfi_direct[i]);
-            int j;
-            struct sfs_inode tnode;
-            for(j=0; j < SFS_DENTRYPERBLOCK;j++) {
-                disk_read(&tnode,dir_entry[j].sfd_ino);
-                if(strcmp(dir_entry[j].sfd_name,path) == 0){
-                    errorFlag = 0;
-                    if(tnode.sfi_type == SFS_TYPE_DIR){
-                        isfile = 0;
-                        strcpy(sd_cwd.sfd_name, dir_entry[j].sfd_name);
-                        sd_cwd.sfd_ino = dir_entry[j].sfd_ino;
-                        break;
-                    }
-                }
-            }
-        }
-    }
-    if(errorFlag == 1){
-        error_message("cd",path,-1); //
-    }
-    if(errorFlag == 0 && isfile == 1){
-        error_message("cd",path,-2); // 폴더 아님
-    }
+	struct sfs_fs *fs = fk->fk_fs;
+	u_int32_t nwords = (fs->spb.sp_nblocks + BM_WORDBITS - 1) / BM_WORDBITS;
+	u_int32_t w, b, end, credits = fs_credits(fs, 1);
+	u_int64_t bits;
+	int inuse;
+
+	*freed = *taken = 0;
+	for (w = 0; w < nwords; w = end) {
+		end = w + BM_BLOCKWORDS(fs);
+		if (end > nwords)
+			end = nwords;
+		if (fs_start(fs, credits) != 0)
+			return;
+		pthread_mutex_lock(&fs->bm_lock);
+		bitmap_reclaim(fs);
+		for (; w < end; w++) {
+			bits = fk->fk_reach[w] ^ fs->bm_map[w];
+			if (w == nwords - 1 && fs->spb.sp_nblocks % BM_WORDBITS)
+				bits &= (1ULL << (fs->spb.sp_nblocks %
+						  BM_WORDBITS)) - 1;
+			while (bits) {
+				b = w * BM_WORDBITS + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				inuse = (fk->fk_reach[w] >> (b % BM_WORDBITS)) & 1;
+				bitmap_mark(fs, b, inuse);
+				if (inuse) {
+					// reached: not free to rewrite in place
+					fs->bm_fresh[w] &= ~(1ULL << (b % BM_WORDBITS));
+					(*taken)++;
+				}
+				else {
+					(*freed)++;
+				}
+			}
+		}
+		pthread_mutex_unlock(&fs->bm_lock);
+		fs_flush(fs, credits);
+	}
 }
 
-void sfs_ls(const char* path)
+static int fsck_nthreads(void)
 {
-    struct sfs_inode c_inode;
-
-    disk_read(&c_inode, sd_cwd.sfd_ino);
-    int i;
-    struct sfs_dir dir_entry[SFS_DENTRYPERBLOCK];
-    int errorflag = 1;
-    if (c_inode.sfi_type == SFS_TYPE_DIR) {
-        for(i=0; i < SFS_NDIRECT; i++) {
-            if (c_inode.sfi_direct[i] == 0) break;
-            disk_read(dir_entry, c_inode.sfi_direct[i]);
-            int j;
-            for(j=0; j < SFS_DENTRYPERBLOCK;j++) {
-                if(path != NULL){
-                    if(strcmp(dir_entry[j].sfd_name,path) == 0){
-                        errorflag = 0;
-                        struct sfs_inode inode;
-                        disk_read(&inode,dir_entry[j].sfd_ino);
-                        if(inode.sfi_type == SFS_TYPE_FILE){
-                            printf("%s",dir_entry[j].sfd_name);
-                            break;
-                        }
-                        struct sfs_dir tdir_entry[SFS_DENTRYPERBLOCK];
-                        int k;
-                        for (k = 0; k < SFS_NDIRECT; k++) {
-                            if (inode.sfi_direct[k] == 0) break;
-                            disk_read(tdir_entry, inode.sfi_direct[k]);
-                            int m;
-                            for (m = 0; m < SFS_DENTRYPERBLOCK; m++) {
-                                if (tdir_entry[m].sfd_ino != 0) {
-                                    struct sfs_inode tnode;
-                                    disk_read(&tnode,tdir_entry[m].sfd_ino);
-                                    if (tnode.sfi_type == SFS_TYPE_FILE) {
-                                        printf("%s\t", tdir_entry[m].sfd_name);
-                                    } else if (tnode.sfi_type == SFS_TYPE_DIR) {
-                                        printf("%s/\t", tdir_entry[m].sfd_name);
-                                    }
-                                }
-                            }
-                        }
-
-                    }
-                }else{
-                    errorflag = 0;
-                    if(dir_entry[j].sfd_ino != 0){
-                        struct sfs_inode tnode;
-                        disk_read(&tnode,dir_entry[j].sfd_ino);
-                        if (tnode.sfi_type == SFS_TYPE_FILE){
-                            printf("%s\t",dir_entry[j].sfd_name);
-                        }
-                        else if(tnode.sfi_type == SFS_TYPE_DIR){
-                            printf("%s/\t",dir_entry[j].sfd_name);
-                        }
-                    }
-                }
-            }
-        }
-    }
-    if(errorflag){
-        error_message("ls",path,-1);
-    }else{
-        printf("\n");
-    }
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return n < FSCK_MAXTHREADS ? n : FSCK_MAXTHREADS;
 }
 
-void sfs_mkdir(const char* org_path) 
+void sfs_fsck() {
+	sfs_fsck_opt(0);
+}
+
+/*
+ * Check the current volume: list its tree, unless FLAGS has
+ * SFS_FSCK_QUIET, and report the blocks whose freemap bit is wrong and
+ * those reached twice. With SFS_FSCK_REPAIR the freemap is fixed.
+ */
+void sfs_fsck_opt(int flags) {
+	struct sfs_fs *fs = cur_fs;
+	char buf[SFS_MAXBLOCKSIZE];
+	pthread_t tid[FSCK_MAXTHREADS];
+	struct fsck fk;
+	struct fsck_dir *root;
+	u_int32_t b, nbad, ndup, freed, taken, used = 0;
+	int i, n;
+
+	if( fs == NULL )
+		return;
+
+	// the walk reads inodes and the freemap as they are on disk
+	fs_writeback(fs);
+
+	bzero(&fk, sizeof(fk));
+	fk.fk_fs = fs;
+	fk.fk_flags = flags;
+	fk.fk_reach = calloc(fs->bm_nwords, sizeof(u_int64_t));
+	fk.fk_dup = calloc(fs->bm_nwords, sizeof(u_int64_t));
+	assert(fk.fk_reach != NULL && fk.fk_dup != NULL);
+	pthread_mutex_init(&fk.fk_lock, NULL);
+	pthread_cond_init(&fk.fk_cv, NULL);
+
+	fsck_mark(&fk, SFS_SB_LOCATION);
+	fsck_mark(&fk, SFS_ROOT_LOCATION);
+	for (b = 0; b < fs->bm_nblocks; b++)
+		fsck_mark(&fk, SFS_MAP_LOCATION + b);
+	if (fs->spb.sp_features & SFS_FEAT_JOURNAL) {
+		for (b = 0; b < fs->spb.sp_jblocks; b++)
+			fsck_mark(&fk, fs->spb.sp_jstart + b);
+	}
+
+	if (!(flags & SFS_FSCK_QUIET))
+		printf("root directory inode %u name /\n", SFS_ROOT_LOCATION);
+	root = fsck_dir_new(block_get(fs, buf, SFS_ROOT_LOCATION),
+			    SFS_ROOT_LOCATION, SFS_ROOT_LOCATION, 1);
+	fsck_queue(&fk, root);
+
+	n = fsck_nthreads();
+	for (i = 0; i < n; i++)
+		pthread_create(&tid[i], NULL, fsck_worker, &fk);
+	for (i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
+	fsck_output(root);
+	if (!(flags & SFS_FSCK_QUIET))
+		printf("\n");
+
+	pthread_mutex_lock(&fs->bm_lock);
+	nbad = fsck_runs(&fk, fk.fk_reach, 0);
+	ndup = fsck_runs(&fk, fk.fk_dup, 1);
+	pthread_mutex_unlock(&fs->bm_lock);
+	if (nbad > 0 && (flags & SFS_FSCK_REPAIR)) {
+		fsck_repair(&fk, &freed, &taken);
+		printf("fsck: %u blocks freed, %u blocks marked in use\n",
+		       freed, taken);
+	}
+	if (flags & SFS_FSCK_QUIET) {
+		for (i = 0; i < fs->bm_nwords; i++)
+			used += __builtin_popcountll(fk.fk_reach[i]);
+		printf("fsck: %lu directories, %lu files, %u blocks in use, "
+		       "%lu errors\n", fk.fk_ndirs, fk.fk_nfiles, used,
+		       fk.fk_nerrors + nbad + ndup);
+	}
+
+	pthread_mutex_destroy(&fk.fk_lock);
+	pthread_cond_destroy(&fk.fk_cv);
+	free(fk.fk_reach);
+	free(fk.fk_dup);
+}
+
+/* Dump the freemap, as it is in memory, a byte per line */
+void sfs_bitmap() {
+	struct sfs_fs *fs = cur_fs;
+	const unsigned char *map;
+	u_int32_t i, j;
+	int k;
+
+	if( fs == NULL )
+		return;
+
+	pthread_mutex_lock(&fs->bm_lock);
+	map = (const unsigned char *)fs->bm_map;
+	for (i = 0; i < fs->bm_nblocks; i++) {
+		printf("Bitmap Block %u ==============================\n", i);
+		printf("Byte index\tHexa\tBit(LSB-MSB)\n");
+		for (j = 0; j < fs->fs_bsize; j++, map++) {
+			printf("\t%u\t%x\t", j, *map);
+			for (k = 0; k < CHAR_BIT; k++)
+				putchar((*map >> k) & 1 ? '1' : '0');
+			putchar('\n');
+		}
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+}
+
+/*
+ * Free space and fragmentation statistics for bitmap --stats. Free runs
+ * are measured on the cached freemap a word at a time: a word that is
+ * all used or all free is taken whole, others a run at a time by
+ * counting trailing bits. Files are found by a walk of the tree, a
+ * directory at a time so that deep trees take no stack.
+ */
+#define STATS_NBUCKETS	32		// free run lengths, by powers of two
+
+struct stats_dir {
+	u_int32_t sd_ino;
+	char *sd_path;			// "" for the root
+	struct stats_dir *sd_next;
+};
+
+struct frag_stats {
+	struct sfs_fs *fs;
+	const char *path;		// directory being listed
+	struct stats_dir *head, *tail;	// directories still to list
+	unsigned long files, frags, fragmented;
+	u_int32_t worst;		// most fragments of one file
+	char *worstpath;		// ...and that file
+};
+
+static void stats_queue(struct frag_stats *st, u_int32_t ino, char *path)
+{
+	struct stats_dir *sd = malloc(sizeof(*sd));
+
+	assert(sd != NULL);
+	sd->sd_ino = ino;
+	sd->sd_path = path;
+	sd->sd_next = NULL;
+	if (st->tail != NULL)
+		st->tail->sd_next = sd;
+	else
+		st->head = sd;
+	st->tail = sd;
+}
+
+static int stats_entry(const struct sfs_dir *ent, const struct dirloc *loc,
+		       void *arg)
 {
-    //skeleton implementation
-
-    struct sfs_inode si;
-    disk_read( &si, sd_cwd.sfd_ino );
-
-    //for consistency
-    assert( si.sfi_type == SFS_TYPE_DIR );
-
-    //we assume that cwd is the root directory and root directory is empty which has . and .. only
-    //unused DISK2.img satisfy these assumption
-    //for new directory entry(for new file), we use cwd.sfi_direct[0] and offset 2
-    //becasue cwd.sfi_directory[0] is already allocated, by .(offset 0) and ..(offset 1)
-    //for new inode, we use block 6
-    // block 0: superblock,	block 1:root, 	block 2:bitmap
-    // block 3:bitmap,  	block 4:bitmap 	block 5:root.sfi_direct[0] 	block 6:unused
-    //
-    //if used DISK2.img is used, result is not defined
-
-    //buffer for disk read
-    struct sfs_dir sd[SFS_DENTRYPERBLOCK];
-    int c;
-
-    // Error1: is there same path ?
-    int samePath = 0;
-    for (c = 0; c < SFS_NDIRECT; c++) {
-        disk_read(sd,si.sfi_direct[c]);
-        int d;
-        for(d=0; d < SFS_DENTRYPERBLOCK;d++) {
-            if(strcmp(sd[d].sfd_name,org_path) == 0){
-                samePath = 1;
-            }
-        }
-    }
-    if(samePath == 1){
-        error_message("mkdir",org_path,-6);
-        return;
-    }
-    int bm[4096]={0,};
-    int real[4096]={0,};
-    int temp[4096]={0,};
-    int afbm[4096];
-
-    int bmNum = 0;
-    if(spb.sp_nblocks%4096 == 0){
-        bmNum = spb.sp_nblocks/4096;
-    }else{
-        bmNum = spb.sp_nblocks/4096 + 1;
-    }
-
-    int a;
-    int curbm = 0;
-    int bitFull = 1;
-    for(a =2;a < bmNum; a++){
-        disk_read(bm,a);
-        if(bm[127]!= -1){
-            bitFull = 0;
-            curbm = a;
-            break;
-        }
-    }
-    // Error 2: bitmap Full
-    if(bitFull == 1){
-        error_message("mkdir",org_path,-4);
-        return;
-    }
-
-    // Error3: directory is full
-    disk_read(sd,si.sfi_direct[14]);
-    if(sd[7].sfd_ino != 0){
-        error_message("mkdir",org_path,-3);
-        return ;
-    }
-
-    int x;
-    for (x = 0;x <4096 ;x++) {
-        afbm[x] = bm[x];
-    }
-
-    int p = 0;
-    int k = 0;
-    int i,j;
-    int position;
-    int find = 0;
-    while(afbm[k] == -1){
-        k++;
-    }
-
-    while (1){
-        temp[p] = bm[k] % 2;
-        bm[k] = bm[k] /2;
-        p++;
-        if(bm[k] ==0){
-            break;
-        }
-    }
-    for(i = p -1; i >=0; i--) {
-        real[p-i-1] = temp[i];
-    }
-
-    int flag = 0;
-    for (i = 0; i< 512; i++) {
-        for (j = 0; j < 8; ++j) {
-            if(real[8*i+j] == 0){
-                position = k*32+8*i+j;
-                real[8*i+j] = 1;
-                flag = 1;
-                break;
-            }
-        }
-        if(flag == 1){
-            break;
-        }
-    }
-//    printf("1curbm%d\n",curbm);
-//    printf("1before<< :afbm[%d]:%d\n",k,afbm[k]);
-    BIT_FLIP(afbm[k],position);
-//    printf("1after<< :afbm[%d]:%d\n",k,afbm[k]);
-    disk_write(afbm,curbm);
-
-
-    //allocate new block
-    int newbie_ino = position;
-    int l;
-    int location = 100;
-    int v;
-    int directNum;
-    int nextDirect = 0;
-    for(v =0;v<SFS_NDIRECT;v++){
-        //block access
-        if(si.sfi_direct[v] == 0){
-            location = 0;
-            directNum = v;
-            nextDirect = 1;
-            break;
-        }
-        disk_read(sd, si.sfi_direct[v]);
-
-        if(v == 0){
-            for (l = 2; l <8 ; l++) {
-                if (sd[l].sfd_ino == 0) {
-                    location = l;
-                    break;
-                }
-            }
-        }
-        else {
-            for (l = 1; l < 8; l++) {
-                if (sd[l].sfd_ino == 0) {
-                    location = l;
-                    break;
-                }
-            }
-        }
-        if(location != 100){
-            directNum = v;
-            break;
-        }
-    }
-
-    // direct over
-    if(nextDirect == 1){
-        int dbm[4096]={0,};
-        int dreal[4096]={0,};
-        int dtemp[4096]={0,};
-        int dafbm[4096];
-        bitFull = 1;
-        for(a =2;a < bmNum; a++){
-            disk_read(dbm,a);
-            if(dbm[127]!= -1){
-                bitFull = 0;
-                curbm = a;
-                break;
-            }
-        }
-        // Error 2: bitmap Full
-        if(bitFull == 1){
-            error_message("mkdir",org_path,-4);
-            return;
-        }
-
-        for (x = 0;x <4096 ;x++) {
-            dafbm[x] = dbm[x];
-        }
-        while(dafbm[k] == -1){
-            k++;
-        }
-        while (1){
-            dtemp[p] = dbm[k] % 2;
-            dbm[k] = dbm[k] /2;
-            p++;
-            if(dbm[k] ==0)   break;
-        }
-        for(i = p -1; i >=0; i--) {
-            dreal[p-i-1] = dtemp[i];
-        }
-        flag = 0;
-        int nextPosition;
-        for (i = 0; i< 512; i++) {
-            for (j = 0; j < 8; ++j) {
-                if(dreal[8*i+j] == 0){
-                    nextPosition = k*32+8*i+j;
-                    dreal[8*i+j] = 1;
-                    flag = 1;
-                    break;
-                }
-            }
-            if(flag == 1){
-                break;
-            }
-        }
-//        printf("d curbm%d\n",curbm);
-//        printf("d before 1<< :afbm[%d]:%d\n",k,dafbm[k]);
-        BIT_FLIP(dafbm[k],nextPosition);
-//        printf("d after 1<< :afbm[%d]:%d\n",k,dafbm[k]);
-        disk_write(dafbm,curbm);
-
-        newbie_ino = nextPosition;
-
-        si.sfi_direct[directNum] = position;
-        disk_write( &si, sd_cwd.sfd_ino );
-        struct sfs_inode newD;
-        bzero(&newD,SFS_BLOCKSIZE);
-        newD.sfi_size = 0;
-        disk_write(&newD,position);
-        disk_read( &si, sd_cwd.sfd_ino );
-        disk_read( sd, si.sfi_direct[directNum] );
-    }
-
-
-    int f;
-    for (f = 0; f<4096; f++) {
-        bm[f] = 0;
-        real[f] = 0;
-        temp[f] = 0;
-    }
-
-    bitFull = 1;
-    for(a =2;a < bmNum; a++){
-        disk_read(bm,a);
-        if(bm[127]!= -1){
-            bitFull = 0;
-            curbm = a;
-            break;
-        }
-    }
-    // Error 2: bitmap Full
-    if(bitFull == 1){
-        error_message("mkdir",org_path,-4);
-        return;
-    }
-    for (x = 0;x <4096 ;x++) {
-        afbm[x] = bm[x];
-    }
-
-    p = 0;
-    k = 0;
-    while(afbm[k] == -1){
-        k++;
-    }
-    while (1){
-        temp[p] = bm[k] % 2;
-        bm[k] = bm[k] /2;
-        p++;
-        if(bm[k] ==0)   break;
-    }
-    for(i = p -1; i >=0; i--) {
-        real[p-i-1] = temp[i];
-    }
-
-    flag = 0;
-    int nnPosition;
-    for (i = 0; i< 512; i++) {
-        for (j = 0; j < 8; ++j) {
-            if(real[8*i+j] == 0){
-                nnPosition = k*32+8*i+j;
-                real[8*i+j] = 1;
-                flag = 1;
-                break;
-            }
-        }
-        if(flag == 1){
-            break;
-        }
-    }
-//    printf("2curbm%d\n",curbm);
-//    printf("2before 1<< :afbm[%d]:%d\n",k,afbm[k]);
-    BIT_FLIP(afbm[k],nnPosition);
-//    printf("2after 1<< :afbm[%d]:%d\n",k,afbm[k]);
-    disk_write(afbm,curbm);
-
-
-    sd[location].sfd_ino = newbie_ino;
-    strncpy( sd[location].sfd_name, org_path, SFS_NAMELEN );
-
-    disk_write( sd, si.sfi_direct[directNum] );
-
-    si.sfi_size += sizeof(struct sfs_dir);
-    disk_write( &si, sd_cwd.sfd_ino );
-
-    struct sfs_inode newbie;
-
-    bzero(&newbie,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
-    newbie.sfi_size = newbie.sfi_size + 2* sizeof(struct sfs_dir);
-    newbie.sfi_type = SFS_TYPE_DIR;
-    newbie.sfi_direct[0] = newbie_ino + 1;
-    disk_write( &newbie, newbie_ino );
-
-    disk_read(sd,newbie.sfi_direct[0]);
-    bzero(&sd,SFS_BLOCKSIZE);
-    sd[0].sfd_ino = newbie_ino;
-    strcpy(sd[0].sfd_name,".");
-    sd[1].sfd_ino = sd_cwd.sfd_ino;
-    strcpy(sd[1].sfd_name,"..");
-    for(i = 2; i<8; i++){
-        sd[i].sfd_ino = SFS_NOINO;
-    }
-    disk_write(sd,newbie.sfi_direct[0]);
+	struct frag_stats *st = arg;
+	struct inode *ip;
+	u_int32_t n;
+	char *path;
 
+	if (is_dot(ent->sfd_name))
+		return 0;
+	path = malloc(strlen(st->path) + strlen(ent->sfd_name) + 2);
+	assert(path != NULL);
+	sprintf(path, "%s/%s", st->path, ent->sfd_name);
+	if (dirent_type_get(st->fs, ent) == SFS_TYPE_DIR) {
+		stats_queue(st, ent->sfd_ino, path);
+		return 0;
+	}
 
+	ip = iget(st->fs, ent->sfd_ino);
+	irlock(ip);
+	n = file_fragments(st->fs, &ip->i_di);
+	iunlock(ip);
+	iput(st->fs, ip);
+	st->files++;
+	st->frags += n;
+	if (n > 1)
+		st->fragmented++;
+	if (n > st->worst) {
+		st->worst = n;
+		free(st->worstpath);
+		st->worstpath = path;
+	}
+	else {
+		free(path);
+	}
+	return 0;
 }
 
-void sfs_rmdir(const char* org_path) 
+/* Count the fragments of every file on the volume */
+static void stats_files(struct sfs_fs *fs, struct frag_stats *st)
 {
-    struct sfs_inode si;
-    disk_read( &si, sd_cwd.sfd_ino );
-
-    //for consistency
-    assert( si.sfi_type == SFS_TYPE_DIR );
-
-    struct sfs_dir sd[SFS_DENTRYPERBLOCK];
-    int c;
-
-    int entryNum = 100;
-    int directNum = 0;
-    for (c = 0; c < SFS_NDIRECT; c++) {
-        disk_read(sd,si.sfi_direct[c]);
-        int d;
-        for(d=0; d < SFS_DENTRYPERBLOCK;d++) {
-            if(strcmp(sd[d].sfd_name,org_path) == 0){
-                directNum = c;
-                entryNum = d;
-                break;
-            }
-        }
-        if(entryNum != 100){
-            break;
-        }
-    }
-    // Error4: invalid argument
-    if(strcmp(org_path,".") == 0){
-        error_message("rmdir",org_path,-8);
-        return;
-    }
-    // Error1: does not exist that dir.
-    if(entryNum == 100){
-        error_message("rmdir",org_path,-1);
-        return;
-    }
-    struct sfs_inode tnode;
-    disk_read(&tnode,sd[entryNum].sfd_ino);
-    // Error2 : not a dir
-    if(tnode.sfi_type != SFS_TYPE_DIR){
-        error_message("rmdir",org_path,-5);
-        return;
-    }
-
-    // Error3: dir is not empty
-    struct sfs_dir tdir[SFS_DENTRYPERBLOCK];
-    int z;
-    for (z = 0; z < SFS_NDIRECT; z++) {
-        disk_read(tdir,tnode.sfi_direct[z]);
-        int i;
-        for (i = 2; i < SFS_DENTRYPERBLOCK; ++i) {
-            if(tdir[i].sfd_ino != 0){
-                error_message("rmdir",org_path,-7);
-                return;
-            }
-        }
-    }
-
-
-    disk_read(sd,si.sfi_direct[directNum]);
-
-
-    int bm[4096]={0,};
-    int real[4096]={0,};
-    int temp[4096]={0,};
-    int afbm[4096];
-
-    int bmNum = 0;
-    if(spb.sp_nblocks%4096 == 0){
-        bmNum = spb.sp_nblocks/4096;
-    }else{
-        bmNum = spb.sp_nblocks/4096 + 1;
-    }
-
-    int a;
-    int curbm = 0;
-    int bitFull = 1;
-    for(a =2;a < bmNum; a++){
-        disk_read(bm,a);
-        if(bm[127]!= -1){
-            bitFull = 0;
-            curbm = a;
-            break;
-        }
-    }
-
-    int x;
-    for (x = 0;x <4096 ;x++) {
-        afbm[x] = bm[x];
-    }
-
-    int p = 0;
-    int k = 0;
-    int i,j;
-    int position;
-    int find = 0;
-    while(afbm[k] == -1){
-        k++;
-    }
-    while (1){
-        temp[p] = bm[k] % 2;
-        bm[k] = bm[k] /2;
-        p++;
-        if(bm[k] ==0)   break;
-    }
-    for(i = p -1; i >=0; i--) {
-        real[p-i-1] = temp[i];
-    }
-
-    int flag = 0;
-    for (i = 0; i< 512; i++) {
-        for (j = 0; j < 8; ++j) {
-            if(real[8*i+j] == 0){
-                position = 32*k+8*i+j;
-                real[8*i+j] = 1;
-                flag = 1;
-                break;
-            }
-        }
-        if(flag == 1){
-            break;
-        }
-    }
-
-    BIT_CLEAR(afbm[k],sd[entryNum].sfd_ino+1);
-    BIT_CLEAR(afbm[k],sd[entryNum].sfd_ino);
-    disk_write(afbm,curbm);
-
-
-
-    sd[entryNum].sfd_ino = SFS_NOINO;
-    si.sfi_size -= sizeof(struct sfs_dir);
-    disk_write(sd,si.sfi_direct[directNum]);
-    disk_write(&si,sd_cwd.sfd_ino);
+	struct stats_dir *sd;
+	struct inode *ip;
 
+	bzero(st, sizeof(*st));
+	st->fs = fs;
+	stats_queue(st, SFS_ROOT_LOCATION, strdup(""));
+	while ((sd = st->head) != NULL) {
+		st->head = sd->sd_next;
+		if (st->head == NULL)
+			st->tail = NULL;
+		st->path = sd->sd_path;
+		ip = iget(fs, sd->sd_ino);
+		irlock(ip);
+		dir_foreach(fs, &ip->i_di, stats_entry, st);
+		iunlock(ip);
+		iput(fs, ip);
+		free(sd->sd_path);
+		free(sd);
+	}
 }
 
-void sfs_mv(const char* src_name, const char* dst_name) 
+struct free_stats {
+	u_int32_t runs[STATS_NBUCKETS];	// free runs of 2^k to 2^(k+1)-1
+	u_int64_t blocks[STATS_NBUCKETS];	// ...and their blocks
+	u_int32_t nruns;
+	u_int32_t largest, largestat;	// longest run and its start
+};
+
+/* Count a free run of LEN blocks from START */
+static void stats_run(struct free_stats *fr, u_int32_t start, u_int32_t len)
 {
-	struct sfs_inode si;
-	disk_read(&si,sd_cwd.sfd_ino);
-    assert( si.sfi_type == SFS_TYPE_DIR );
-
-    struct sfs_dir dir[SFS_DENTRYPERBLOCK];
-    int i,j;
-    for (i = 0; i < SFS_NDIRECT; i++) {
-        disk_read(dir,si.sfi_direct[i]);
-        for (j = 0; j < SFS_DENTRYPERBLOCK; j++) {
-            if(strcmp(dir[j].sfd_name,dst_name) == 0){
-                error_message("mv",dst_name,-6);
-                return;
-            }
-        }
-    }
-    int sfind = 0;
-    for (i = 0; i < SFS_NDIRECT; i++) {
-        disk_read(dir,si.sfi_direct[i]);
-        for (j = 0; j < SFS_DENTRYPERBLOCK; j++) {
-            if(strcmp(dir[j].sfd_name,src_name) == 0){
-                sfind = 1;
-                strcpy(dir[j].sfd_name,dst_name);
-                disk_write(dir,si.sfi_direct[i]);
-                break;
-            }
-        }
-        if(sfind == 1){
-            break;
-        }
-    }
-
-    if(sfind == 0){
-        error_message("mv",src_name,-1);
-        return;
-    }
+	int k = 63 - __builtin_clzll(len);
+
+	fr->runs[k]++;
+	fr->blocks[k] += len;
+	fr->nruns++;
+	if (len > fr->largest) {
+		fr->largest = len;
+		fr->largestat = start;
+	}
+}
+
+void sfs_bitmap_stats() {
+	struct sfs_fs *fs = cur_fs;
+	struct frag_stats st;
+	struct free_stats fr;
+	u_int32_t nwords, w, used = 0, nfree, start = 0, len = 0;
+	u_int64_t f, valid;
+	int b, n, k;
+
+	if( fs == NULL )
+		return;
 
+	bzero(&fr, sizeof(fr));
+	nwords = (fs->spb.sp_nblocks + BM_WORDBITS - 1) / BM_WORDBITS;
+	pthread_mutex_lock(&fs->bm_lock);
+	for (w = 0; w < nwords; w++) {
+		valid = ~0ULL;
+		if (w == nwords - 1 && fs->spb.sp_nblocks % BM_WORDBITS)
+			valid = (1ULL << (fs->spb.sp_nblocks % BM_WORDBITS)) - 1;
+		f = ~fs->bm_map[w] & valid;	// free blocks
+		used += __builtin_popcountll(~f & valid);
+		for (b = 0; b < BM_WORDBITS; b += n) {
+			if ((f >> b) & 1) {
+				n = ~(f >> b) ? __builtin_ctzll(~(f >> b))
+					      : BM_WORDBITS;
+				if (len == 0)
+					start = w * BM_WORDBITS + b;
+				len += n;
+				continue;
+			}
+			if (len > 0) {
+				stats_run(&fr, start, len);
+				len = 0;
+			}
+			if ((f >> b) == 0)
+				break;
+			n = __builtin_ctzll(f >> b);
+		}
+	}
+	if (len > 0)
+		stats_run(&fr, start, len);
+	pthread_mutex_unlock(&fs->bm_lock);
+	nfree = fs->spb.sp_nblocks - used;
+
+	printf("%s: %u blocks of %u bytes, %u used, %u free (%u%%)\n",
+	       fs->spb.sp_volname, fs->spb.sp_nblocks, fs->fs_bsize, used,
+	       nfree, (u_int32_t)((u_int64_t)nfree * 100 / fs->spb.sp_nblocks));
+	if (fr.nruns > 0) {
+		printf("free extents: %u, largest %u at block %u, "
+		       "average %.1f\n", fr.nruns, fr.largest, fr.largestat,
+		       (double)nfree / fr.nruns);
+		printf("%20s %10s %10s\n", "free extent length", "extents",
+		       "blocks");
+		for (k = 0; k < STATS_NBUCKETS; k++) {
+			if (fr.runs[k] == 0)
+				continue;
+			if (k == 0)
+				printf("%20u", 1U);
+			else
+				printf("%9u - %8u", 1U << k,
+				       (u_int32_t)((2ULL << k) - 1));
+			printf(" %10u %10llu\n", fr.runs[k],
+			       (unsigned long long)fr.blocks[k]);
+		}
+	}
 
+	stats_files(fs, &st);
+	printf("files: %lu, fragments: %lu (%.2f per file), "
+	       "%lu fragmented\n", st.files, st.frags,
+	       st.files ? (double)st.frags / st.files : 0.0, st.fragmented);
+	if (st.worst > 1)
+		printf("most fragmented: %s, %u fragments\n", st.worstpath,
+		       st.worst);
+	free(st.worstpath);
 }
 
-void sfs_rm(const char* path) 
+/*
+ * Defragmenter.
+ *
+ * defrag walks the tree a directory at a time, as bitmap --stats does.
+ * A file in more than one fragment (file_fragments()) and without holes
+ * is moved to the first run of free blocks long enough for its data and
+ * indirect blocks: the data is copied a chunk at a time and the file
+ * mapped afresh through file_append(), which places the indirect blocks
+ * in line as cpin does. A directory whose blocks are out of order is
+ * copied in walk order: the direct blocks, then for a hashed directory
+ * the index and the buckets, with the pointers between them translated.
+ * Neither is moved if defrag_pays() says free space would end up in
+ * more extents than before. Each move is one operation; on a journalled
+ * volume a crash leaves the file or directory at its old place or its
+ * new one, as the old blocks are not reused before the move commits.
+ */
+#define DEFRAG_REPORT	1.0		// seconds between progress reports
+
+struct defrag_run {
+	u_int32_t dr_start;
+	u_int32_t dr_len;
+};
+
+/* Where a moved directory block went, for translating pointers */
+struct defrag_map {
+	u_int32_t dm_old;
+	u_int32_t dm_new;
+};
+
+struct defrag_stats {
+	struct sfs_fs *fs;
+	char *buf;			// copy buffer, CP_BUFSIZE bytes
+	u_int32_t *queue;		// directories still to go through
+	u_int32_t qhead, qtail, qsize;
+	unsigned long files, dirs;	// looked at
+	unsigned long fmoved, dmoved;	// ...and moved
+	unsigned long noroom;		// left as they were, for want of room
+	u_int64_t blocks;		// blocks moved
+	double start, last;		// when the walk started, last report
+};
+
+static double defrag_now(void)
 {
-    struct sfs_inode si;
-    disk_read( &si, sd_cwd.sfd_ino );
-
-    //for consistency
-    assert( si.sfi_type == SFS_TYPE_DIR );
-
-    struct sfs_dir sd[SFS_DENTRYPERBLOCK];
-    int c;
-
-    int entryNum = 100;
-    int directNum = 0;
-    for (c = 0; c < SFS_NDIRECT; c++) {
-        disk_read(sd,si.sfi_direct[c]);
-        int d;
-        for(d=0; d < SFS_DENTRYPERBLOCK;d++) {
-            if(strcmp(sd[d].sfd_name,path) == 0){
-                directNum = c;
-                entryNum = d;
-                break;
-            }
-        }
-        if(entryNum != 100){
-            break;
-        }
-    }
-    // Error1: does not exist that file.
-    if(entryNum == 100){
-        error_message("rm",path,-1);
-        return;
-    }
-    struct sfs_inode tnode;
-    disk_read(&tnode,sd[entryNum].sfd_ino);
-    // Error2 : not a dir
-    if(tnode.sfi_type == SFS_TYPE_DIR){
-        error_message("rm",path,-9);
-        return;
-    }
-
-
-
-    disk_read(sd,si.sfi_direct[directNum]);
-
-
-    int bm[4096]={0,};
-    int real[4096]={0,};
-    int temp[4096]={0,};
-    int afbm[4096];
-
-    int bmNum = 0;
-    if(spb.sp_nblocks%4096 == 0){
-        bmNum = spb.sp_nblocks/4096;
-    }else{
-        bmNum = spb.sp_nblocks/4096 + 1;
-    }
-
-    int a;
-    int curbm = 0;
-    int bitFull = 1;
-    for(a =2;a < bmNum; a++){
-        disk_read(bm,a);
-        if(bm[127]!= -1){
-            printf("bm[127]:%d\n",bm[127]);
-            bitFull = 0;
-            curbm = a;
-            break;
-        }
-    }
-    printf("curbm:%d\n",curbm);
-    int x;
-    for (x = 0;x <4096 ;x++) {
-        afbm[x] = bm[x];
-    }
-
-    int p = 0;
-    int k = 0;
-    int i,j;
-    int position;
-    int find = 0;
-    while(afbm[k] == -1){
-        k++;
-    }
-    while (1){
-        temp[p] = bm[k] % 2;
-        bm[k] = bm[k] /2;
-        p++;
-        if(bm[k] ==0)   break;
-    }
-    for(i = p -1; i >=0; i--) {
-        real[p-i-1] = temp[i];
-    }
-
-    int flag = 0;
-    for (i = 0; i< 512; i++) {
-        for (j = 0; j < 8; ++j) {
-            if(real[8*i+j] == 0){
-                position = 32*k+8*i+j;
-                real[8*i+j] = 1;
-                flag = 1;
-                break;
-            }
-        }
-        if(flag == 1){
-            break;
-        }
-    }
-    printf("k:%d\n",k);
-    BIT_CLEAR(afbm[k],sd[entryNum].sfd_ino);
-    int l;
-    for (l = 0; l < SFS_NDIRECT; l++) {
-        if(tnode.sfi_direct[l] != 0){
-            BIT_CLEAR(afbm[k],tnode.sfi_direct[l]);
-            tnode.sfi_direct[l] = SFS_NOINO;
-        }
-    }
-    disk_write(&tnode,sd[entryNum].sfd_ino);
-    disk_write(afbm,curbm);
-
-
-
-    sd[entryNum].sfd_ino = SFS_NOINO;
-    si.sfi_size -= sizeof(struct sfs_dir);
-    disk_write(sd,si.sfi_direct[directNum]);
-    disk_write(&si,sd_cwd.sfd_ino);
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void sfs_cpin(const char* local_path, const char* path) 
+static void defrag_progress(struct defrag_stats *st)
+{
+	double t = defrag_now();
+
+	if (t - st->last < DEFRAG_REPORT)
+		return;
+	st->last = t;
+	printf("defrag: %lu files, %lu directories, %llu blocks moved\n",
+	       st->files, st->dirs, (unsigned long long)st->blocks);
+	fflush(stdout);
+}
+
+struct defrag_blocks {
+	u_int32_t *blk;
+	u_int32_t n;
+};
+
+static void defrag_add(struct defrag_blocks *db, u_int32_t blk)
 {
-	printf("Not Implemented\n");
+	db->blk = realloc(db->blk, (db->n + 1) * sizeof(*db->blk));
+	assert(db->blk != NULL);
+	db->blk[db->n++] = blk;
 }
 
-void sfs_cpout(const char* local_path, const char* path) 
+static int defrag_blk_cmp(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Whether the blocks in DB, which are freed once they have been copied,
+ * can be given up without adding free extents: defrag may leave free
+ * space as broken up as it found it, never more. Each run of the blocks
+ * becomes a free extent, unless it meets free space on one side (merged)
+ * or both (two extents become one). Called with the new run taken.
+ */
+static int defrag_pays(struct sfs_fs *fs, const struct defrag_blocks *db)
 {
-	printf("Not Implemented\n");
+	u_int32_t *blk, i, j;
+	int added = 0;
+
+	blk = malloc(db->n * sizeof(*blk));
+	assert(blk != NULL);
+	memcpy(blk, db->blk, db->n * sizeof(*blk));
+	qsort(blk, db->n, sizeof(*blk), defrag_blk_cmp);
+	pthread_mutex_lock(&fs->bm_lock);
+	for (i = 0; i < db->n; i = j) {
+		for (j = i + 1; j < db->n && blk[j] == blk[j - 1] + 1; j++)
+			;
+		added++;
+		if (!(fs->bm_map[(blk[i] - 1) / BM_WORDBITS] &
+		      (1ULL << ((blk[i] - 1) % BM_WORDBITS))))
+			added--;
+		if (blk[j - 1] + 1 < fs->spb.sp_nblocks &&
+		    !(fs->bm_map[(blk[j - 1] + 1) / BM_WORDBITS] &
+		      (1ULL << ((blk[j - 1] + 1) % BM_WORDBITS))))
+			added--;
+	}
+	pthread_mutex_unlock(&fs->bm_lock);
+	free(blk);
+	return added <= 0;
 }
 
-void dump_inode(struct sfs_inode inode) {
+/* Add indirect block BLK, LEVELS above the data, and those below it */
+static void defrag_ind(struct sfs_fs *fs, u_int32_t blk, int levels,
+		       struct defrag_blocks *db)
+{
+	u_int32_t ind[SFS_MAXPTRS];
 	int i;
-	struct sfs_dir dir_entry[SFS_DENTRYPERBLOCK];
 
-	printf("size %d type %d direct ", inode.sfi_size, inode.sfi_type);
-	for(i=0; i < SFS_NDIRECT; i++) {
-		printf(" %d ", inode.sfi_direct[i]);
+	defrag_add(db, blk);
+	if (levels == 1)
+		return;
+	disk_read(fs->disk, ind, blk);
+	for (i = 0; i < fs->fs_ppb; i++) {
+		if (ind[i] != 0)
+			defrag_ind(fs, ind[i], levels - 1, db);
 	}
-	printf(" indirect %d",inode.sfi_indirect);
-	printf("\n");
+}
 
-	if (inode.sfi_type == SFS_TYPE_DIR) {
-		for(i=0; i < SFS_NDIRECT; i++) {
-			if (inode.sfi_direct[i] == 0) break;
-			disk_read(dir_entry, inode.sfi_direct[i]);
-			dump_directory(dir_entry);
+/*
+ * Move file SI, which the caller holds locked exclusive, into one run:
+ * its data and its indirect blocks, which file_append() places in line
+ * as cpin does. Returns the number of blocks moved; 0 if the file is in
+ * one fragment already (file_fragments()), has holes, or would leave
+ * free space more broken up (defrag_pays()); -4 if no free run is long
+ * enough.
+ */
+static int defrag_file(struct sfs_fs *fs, struct inode *ip, char *buf)
+{
+	struct sfs_inode *si = &ip->i_di;
+	struct bmap_cursor bc;
+	struct defrag_run *runs = NULL;
+	struct defrag_blocks db;
+	u_int32_t nblk = (si->sfi_size + fs->fs_bsize - 1) / fs->fs_bsize;
+	u_int32_t nruns = 0, lbn, run, pbn, start, off, n, placed, i, j;
+	u_int32_t credits = fs_credits(fs, 2 * inode_nblocks(fs, si) +
+				       BMAP_PREALLOC);
+	int error;
+
+	if (file_fragments(fs, si) <= 1)
+		return 0;
+	bmap_init(&bc, fs, si);
+	for (lbn = 0; lbn < nblk; lbn += run) {
+		run = bmap_run(&bc, lbn, nblk - lbn, &pbn);
+		if (pbn == 0) {
+			free(runs);
+			return 0;
+		}
+		runs = realloc(runs, (nruns + 1) * sizeof(*runs));
+		assert(runs != NULL);
+		runs[nruns].dr_start = pbn;
+		runs[nruns++].dr_len = run;
+	}
+	bzero(&db, sizeof(db));
+	if (si->sfi_indirect != 0)
+		defrag_ind(fs, si->sfi_indirect, 1, &db);
+	if (si->sfi_dindirect != 0)
+		defrag_ind(fs, si->sfi_dindirect, 2, &db);
+	if (si->sfi_tindirect != 0)
+		defrag_ind(fs, si->sfi_tindirect, 3, &db);
+
+	for (i = 0; i < nruns; i++) {
+		for (j = 0; j < runs[i].dr_len; j++)
+			defrag_add(&db, runs[i].dr_start + j);
+	}
+
+	if (fs_start(fs, credits) != 0) {
+		free(runs);
+		free(db.blk);
+		return 0;
+	}
+	if (!bitmap_alloc_contig(fs, db.n, &start)) {
+		fs_flush(fs, credits);
+		free(runs);
+		free(db.blk);
+		return -4;
+	}
+	if (!defrag_pays(fs, &db)) {
+		for (i = 0; i < db.n; i++)
+			bitmap_free(fs, start + i);
+		fs_flush(fs, credits);
+		free(runs);
+		free(db.blk);
+		return 0;
+	}
+
+	/* map the file afresh, from the new run and nothing else */
+	if (si->sfi_flags & SFS_IFLAG_EXTENTS) {
+		bzero(si->sfi_extent, sizeof(si->sfi_extent));
+		si->sfi_nextent = 0;
+	}
+	else {
+		bzero(si->sfi_direct, sizeof(si->sfi_direct));
+		si->sfi_indirect = si->sfi_dindirect = si->sfi_tindirect = 0;
+	}
+	bmap_init(&bc, fs, si);
+	bc.bc_rsv = bc.bc_goal = start;
+	bc.bc_nrsv = db.n;
+	lbn = 0;
+	for (i = 0; i < nruns; i++) {
+		for (off = 0; off < runs[i].dr_len; off += n) {
+			n = runs[i].dr_len - off;
+			if (n > CP_CHUNK(fs))
+				n = CP_CHUNK(fs);
+			disk_readv(fs->disk, buf, runs[i].dr_start + off, n);
+			error = file_append(&bc, lbn, buf, n, &placed);
+			assert(error == 0 && placed == n);
+			lbn += n;
 		}
 	}
+	bmap_flush(&bc);
+	assert(bc.bc_nrsv == 0);
+	imark_dirty(ip);
 
+	for (i = 0; i < db.n; i++)
+		bitmap_free(fs, db.blk[i]);
+	fs_flush(fs, credits);
+	free(runs);
+	free(db.blk);
+	return i;
 }
 
-void dump_directory(struct sfs_dir dir_entry[]) {
-	int i;
-	struct sfs_inode inode;
-	for(i=0; i < SFS_DENTRYPERBLOCK;i++) {
-		printf("%d %s\n",dir_entry[i].sfd_ino, dir_entry[i].sfd_name);
-		disk_read(&inode,dir_entry[i].sfd_ino);
-		if (inode.sfi_type == SFS_TYPE_FILE) {
-			printf("\t");
-			dump_inode(inode);
+static int defrag_bucket(const struct sfs_dir *sd, u_int32_t blk, void *arg)
+{
+	defrag_add(arg, blk);
+	return 0;
+}
+
+static int defrag_map_cmp(const void *a, const void *b)
+{
+	const struct defrag_map *x = a, *y = b;
+
+	return x->dm_old < y->dm_old ? -1 : x->dm_old > y->dm_old;
+}
+
+/* New place of directory block OLD; 0 stays 0 */
+static u_int32_t defrag_xlate(const struct defrag_map *map, u_int32_t n,
+			      u_int32_t old)
+{
+	struct defrag_map key, *m;
+
+	if (old == 0)
+		return 0;
+	key.dm_old = old;
+	m = bsearch(&key, map, n, sizeof(*map), defrag_map_cmp);
+	assert(m != NULL);
+	return m->dm_new;
+}
+
+/*
+ * Move the blocks of directory DP, which the caller holds locked
+ * exclusive, into one run. Returns the number of blocks moved; 0 if
+ * they are in order already or free space would be left more broken
+ * up (defrag_pays());
+ * -4 if no free run is long enough.
+ */
+static int defrag_dir(struct sfs_fs *fs, struct inode *dp)
+{
+	struct sfs_inode *si = &dp->i_di;
+	struct defrag_blocks db;
+	struct defrag_map *map;
+	u_int32_t buf[SFS_MAXPTRS];
+	struct sfs_dirbucket *hdr = (struct sfs_dirbucket *)buf;
+	u_int32_t ndirect, nindex, start, i, j, credits;
+	const u_int32_t *top;
+
+	bzero(&db, sizeof(db));
+	for (i = 0; i < SFS_NDIRECT; i++) {
+		if (si->sfi_direct[i] != 0)
+			defrag_add(&db, si->sfi_direct[i]);
+	}
+	ndirect = db.n;
+	if (si->sfi_flags & SFS_IFLAG_HASHDIR) {
+		defrag_add(&db, si->sfi_indirect);
+		top = block_get(fs, buf, si->sfi_indirect);
+		for (i = 0; i < fs->fs_ppb; i++) {
+			if (top[i] != 0)
+				defrag_add(&db, top[i]);
 		}
 	}
+	/* the index blocks follow the direct blocks; buckets come last */
+	nindex = db.n;
+	if (si->sfi_flags & SFS_IFLAG_HASHDIR)
+		dirhash_walk(fs, si, defrag_bucket, &db);
+	for (i = 1; i < db.n && db.blk[i] == db.blk[0] + i; i++)
+		;
+	if (i == db.n) {
+		free(db.blk);
+		return 0;
+	}
+
+	credits = fs_credits(fs, 2 * db.n);
+	if (fs_start(fs, credits) != 0) {
+		free(db.blk);
+		return 0;
+	}
+	if (!bitmap_alloc_contig(fs, db.n, &start)) {
+		fs_flush(fs, credits);
+		free(db.blk);
+		return -4;
+	}
+	if (!defrag_pays(fs, &db)) {
+		for (i = 0; i < db.n; i++)
+			bitmap_free(fs, start + i);
+		fs_flush(fs, credits);
+		free(db.blk);
+		return 0;
+	}
+	map = malloc(db.n * sizeof(*map));
+	assert(map != NULL);
+	for (i = 0; i < db.n; i++) {
+		map[i].dm_old = db.blk[i];
+		map[i].dm_new = start + i;
+	}
+	qsort(map, db.n, sizeof(*map), defrag_map_cmp);
+
+	for (i = 0; i < db.n; i++) {
+		disk_read(fs->disk, buf, db.blk[i]);
+		if (i >= ndirect && i < nindex) {
+			for (j = 0; j < fs->fs_ppb; j++)
+				buf[j] = defrag_xlate(map, db.n, buf[j]);
+		}
+		else if (i >= nindex) {
+			hdr->sdb_next = defrag_xlate(map, db.n, hdr->sdb_next);
+		}
+		meta_write(fs, buf, start + i);
+	}
+	for (i = 0; i < SFS_NDIRECT; i++)
+		si->sfi_direct[i] = defrag_xlate(map, db.n, si->sfi_direct[i]);
+	if (si->sfi_flags & SFS_IFLAG_HASHDIR)
+		si->sfi_indirect = defrag_xlate(map, db.n, si->sfi_indirect);
+	imark_dirty(dp);
+	dcache_purge(fs, dp->i_ino);
+
+	for (i = 0; i < db.n; i++)
+		bitmap_free(fs, db.blk[i]);
+	fs_flush(fs, credits);
+	free(map);
+	free(db.blk);
+	return i;
 }
 
-void sfs_dump() {
-	// dump the current directory structure
-	struct sfs_inode c_inode;
+static void defrag_queue(struct defrag_stats *st, u_int32_t ino)
+{
+	if (st->qtail == st->qsize) {
+		st->qsize = st->qsize * 2 + 64;
+		st->queue = realloc(st->queue, st->qsize * sizeof(u_int32_t));
+		assert(st->queue != NULL);
+	}
+	st->queue[st->qtail++] = ino;
+}
 
-	disk_read(&c_inode, sd_cwd.sfd_ino);
-	printf("cwd inode %d name %s\n",sd_cwd.sfd_ino,sd_cwd.sfd_name);
-	dump_inode(c_inode);
-	printf("\n");
+static void defrag_count(struct defrag_stats *st, int moved,
+			 unsigned long *count)
+{
+	if (moved > 0) {
+		(*count)++;
+		st->blocks += moved;
+	}
+	else if (moved < 0) {
+		st->noroom++;
+	}
+	defrag_progress(st);
+}
+
+static int defrag_entry(const struct sfs_dir *ent, const struct dirloc *loc,
+			void *arg)
+{
+	struct defrag_stats *st = arg;
+	struct inode *ip;
+	int moved;
+
+	if (is_dot(ent->sfd_name))
+		return 0;
+	if (dirent_type_get(st->fs, ent) == SFS_TYPE_DIR) {
+		defrag_queue(st, ent->sfd_ino);
+		return 0;
+	}
+
+	ip = iget(st->fs, ent->sfd_ino);
+	iwlock(ip);
+	moved = defrag_file(st->fs, ip, st->buf);
+	iunlock(ip);
+	iput(st->fs, ip);
+	st->files++;
+	defrag_count(st, moved, &st->fmoved);
+	return 0;
+}
+
+void sfs_defrag() {
+	struct sfs_fs *fs = cur_fs;
+	struct defrag_stats st;
+	struct inode *dp;
+	double secs;
+
+	if( fs == NULL )
+		return;
+
+	bzero(&st, sizeof(st));
+	st.fs = fs;
+	st.buf = malloc(CP_BUFSIZE);
+	assert(st.buf != NULL);
+	st.start = st.last = defrag_now();
+	defrag_queue(&st, SFS_ROOT_LOCATION);
+	while (st.qhead < st.qtail) {
+		dp = iget(fs, st.queue[st.qhead++]);
+		iwlock(dp);
+		st.dirs++;
+		defrag_count(&st, defrag_dir(fs, dp), &st.dmoved);
+		dir_foreach(fs, &dp->i_di, defrag_entry, &st);
+		iunlock(dp);
+		iput(fs, dp);
+	}
+	secs = defrag_now() - st.start;
 
+	printf("defrag: %lu of %lu files and %lu of %lu directories moved, "
+	       "%llu blocks in %.3f s (%.1f MB/s)\n", st.fmoved, st.files,
+	       st.dmoved, st.dirs, (unsigned long long)st.blocks, secs,
+	       secs > 0 ? st.blocks * fs->fs_bsize / secs / 1e6 : 0.0);
+	if (st.noroom > 0)
+		printf("defrag: %lu left as they were, no free run long "
+		       "enough\n", st.noroom);
+	free(st.queue);
+	free(st.buf);
 }
@@ -1,215 +1,315 @@
 // A few extra command added
+//
+//	usage: sfs [-q] [-t] [-b script]
+//
+// Without -b, commands are read from stdin after an "os_shell> " prompt.
+// With -b, they are read from the script (- for stdin) with no prompt or
+// banner, and the shell stops at its end. -q leaves out the mount and unmount
+// reports, -t reports how long each kind of command took; a script run
+// always reports that, on stderr.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "sfs_func.h"
 #define DELIMS " \t\r\n"
 #define MAX_ARGC 10
 
-int main()
+/*
+ * Commands, looked up by name through a hash table. A command takes
+ * from MINARGS to MAXARGS arguments and prints its usage otherwise;
+ * one marked NEEDFS is refused until a volume is mounted.
+ */
+struct command {
+	const char *name;
+	int minargs, maxargs;
+	int needfs;
+	const char *usage;
+	void (*run)(int argc, char *argv[]);
+
+	struct command *next;	/* hash chain */
+	unsigned long calls;	/* times run, and their latency */
+	double secs, max;
+};
+
+#define CMD_NHASH 64
+
+static struct command *cmd_hash[CMD_NHASH];
+static int done;
+
+static void cmd_mount(int argc, char *argv[])
 {
-	char buf[256];
-	int argc;
-	char* argv[MAX_ARGC];
-
-	printf("OS SFS shell\n");
+	int i, flags = 0;
 
-	while(! feof(stdin))
+	if( argc == 1 )
 	{
-		printf("os_shell> ");
-
-		fgets( buf, sizeof(buf), stdin);
-		
-		argv[0] = strtok(buf, DELIMS);
-		if( !argv[0] )
-			continue;
+		sfs_mounts();
+		return;
+	}
+	for( i = 1; i < argc - 1; i++ )
+	{
+		if( !strcmp(argv[i], "-m") )
+			flags |= SFS_MOUNT_MMAP;
+		else if( !strcmp(argv[i], "-e") )
+			flags |= SFS_MOUNT_EXTENTS;
+		else
+			break;
+	}
+	if( i != argc - 1 )
+	{
+		printf("usage: mount [[-m] [-e] disk_img]\n");
+		return;
+	}
 
-		argc = 1;
-		while((argv[argc] = strtok(NULL, DELIMS)) != NULL) {
-			argc++;
-		}
+	sfs_mount_opt(argv[i], flags);
+}
 
-		if( !strcmp(argv[0], "mount") )
-		{
-			if(	argc != 2 )
-			{
-				printf("usage: mount disk_img\n");
-				continue;
-			}
-			
-			sfs_mount(argv[1]);			
-			continue;	
-		}
+static void cmd_fsck(int argc, char *argv[])
+{
+	int i, flags = 0;
 
-		if( !strcmp(argv[0], "umount") )
+	for( i = 1; i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "-q") )
+			flags |= SFS_FSCK_QUIET;
+		else if( !strcmp(argv[i], "-r") )
+			flags |= SFS_FSCK_REPAIR;
+		else
 		{
-			sfs_umount();
-			continue;
+			printf("usage: fsck [-q] [-r]\n");
+			return;
 		}
+	}
 
-		if( !strcmp(argv[0], "ls") )
-		{
-			if( argc == 1 )
-				sfs_ls(NULL);
-			else if( argc == 2 )
-				sfs_ls(argv[1]);
-			else
-			{
-				printf("usage: ls [path]\n");
-			}
-			continue;	
-		}
+	sfs_fsck_opt(flags);
+}
 
-		if( !strcmp(argv[0], "cd") )
-		{
-			if( argc == 1 )
-				sfs_cd(NULL);
-			else if( argc != 2 )
-			{
-				printf("usage: cd [path]\n");
-				continue;
-			}
-			
-			sfs_cd(argv[1]);
-			continue;	
-		}
+static void cmd_bitmap(int argc, char *argv[])
+{
+	if( argc == 1 )
+		sfs_bitmap();
+	else if( !strcmp(argv[1], "--stats") )
+		sfs_bitmap_stats();
+	else
+		printf("usage: bitmap [--stats]\n");
+}
 
-		if( !strcmp(argv[0], "dump") )
-		{
-			sfs_dump();
-			continue;
-		}
+static void cmd_umount(int argc, char *argv[])
+{
+	if( argc == 1 )
+		sfs_umount();
+	else
+		sfs_umount_vol(argv[1]);
+}
 
-		if( !strcmp(argv[0], "touch") )
-		{
-			if( argc != 2 )
-			{
-				printf("usage: touch path\n");
-				continue;
-			}
+static void cmd_use(int argc, char *argv[])	{ sfs_use(argv[1]); }
+static void cmd_ls(int argc, char *argv[])	{ sfs_ls(argv[1]); }
+static void cmd_cd(int argc, char *argv[])	{ sfs_cd(argv[1]); }
+static void cmd_dump(int argc, char *argv[])	{ sfs_dump(); }
+static void cmd_touch(int argc, char *argv[])	{ sfs_touch(argv[1]); }
+static void cmd_mkdir(int argc, char *argv[])	{ sfs_mkdir(argv[1]); }
+static void cmd_rmdir(int argc, char *argv[])	{ sfs_rmdir(argv[1]); }
+static void cmd_rm(int argc, char *argv[])	{ sfs_rm(argv[1]); }
+static void cmd_mv(int argc, char *argv[])	{ sfs_mv(argv[1], argv[2]); }
+static void cmd_cpin(int argc, char *argv[])	{ sfs_cpin(argv[1], argv[2]); }
+static void cmd_cpout(int argc, char *argv[])	{ sfs_cpout(argv[1], argv[2]); }
+static void cmd_sync(int argc, char *argv[])	{ sfs_sync(); }
+static void cmd_begin(int argc, char *argv[])	{ sfs_begin(); }
+static void cmd_commit(int argc, char *argv[])	{ sfs_commit(); }
+static void cmd_cache(int argc, char *argv[])	{ sfs_cachestat(); }
+static void cmd_df(int argc, char *argv[])	{ sfs_df(); }
+static void cmd_defrag(int argc, char *argv[])	{ sfs_defrag(); }
+
+static void cmd_exit(int argc, char *argv[])
+{
+	sfs_sync();
+	printf("bye\n");
+	done = 1;
+}
 
-			sfs_touch(argv[1]);
-			continue;	
-		}
+static struct command commands[] = {
+	{ "mount",	0, MAX_ARGC - 1, 0, NULL,	cmd_mount },
+	{ "umount",	0, 1, 0, "umount [disk_img]",	cmd_umount },
+	{ "use",	1, 1, 0, "use disk_img",	cmd_use },
+	{ "ls",		0, 1, 1, "ls [path]",		cmd_ls },
+	{ "cd",		0, 1, 1, "cd [path]",		cmd_cd },
+	{ "dump",	0, MAX_ARGC - 1, 1, NULL,	cmd_dump },
+	{ "touch",	1, 1, 1, "touch path",		cmd_touch },
+	{ "mkdir",	1, 1, 1, "mkdir directory",	cmd_mkdir },
+	{ "rmdir",	1, 1, 1, "rmdir directory",	cmd_rmdir },
+	{ "rm",		1, 1, 1, "rm path",		cmd_rm },
+	{ "mv",		2, 2, 1, "mv src dst",		cmd_mv },
+	{ "cpin",	2, 2, 1, "copyin local-file file(source)", cmd_cpin },
+	{ "cpout",	2, 2, 1, "copyout local-file(source) file", cmd_cpout },
+	{ "sync",	0, MAX_ARGC - 1, 0, NULL,	cmd_sync },
+	{ "begin",	0, MAX_ARGC - 1, 1, NULL,	cmd_begin },
+	{ "commit",	0, MAX_ARGC - 1, 1, NULL,	cmd_commit },
+	{ "cache",	0, MAX_ARGC - 1, 1, NULL,	cmd_cache },
+	{ "exit",	0, MAX_ARGC - 1, 0, NULL,	cmd_exit },
+	{ "fsck",	0, 2, 1, "fsck [-q] [-r]",	cmd_fsck },
+	{ "bitmap",	0, 1, 1, "bitmap [--stats]",	cmd_bitmap },
+	{ "df",		0, MAX_ARGC - 1, 1, NULL,	cmd_df },
+	{ "defrag",	0, 0, 1, "defrag",		cmd_defrag },
+};
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static unsigned cmd_hashval(const char *name)
+{
+	unsigned h = 5381;
 
+	while( *name )
+		h = h * 33 + (unsigned char)*name++;
+	return h % CMD_NHASH;
+}
 
-		if( !strcmp(argv[0], "mkdir") )
-		{
-			if( argc != 2 )
-			{
-				printf("usage: mkdir directory\n");
-				continue;
-			}
+static void cmd_init(void)
+{
+	unsigned i, h;
 
-			sfs_mkdir(argv[1]);
-			continue;	
-		}
+	for( i = 0; i < NCOMMANDS; i++ )
+	{
+		h = cmd_hashval(commands[i].name);
+		commands[i].next = cmd_hash[h];
+		cmd_hash[h] = &commands[i];
+	}
+}
 
-		if( !strcmp(argv[0], "rmdir") )
-		{
-			if( argc != 2 )
-			{
-				printf("usage: rmdir directory\n");
-				continue;
-			}
+static struct command *cmd_lookup(const char *name)
+{
+	struct command *c;
 
-			sfs_rmdir(argv[1]);
-			continue;	
-		}
+	for( c = cmd_hash[cmd_hashval(name)]; c != NULL; c = c->next )
+	{
+		if( !strcmp(c->name, name) )
+			return c;
+	}
+	return NULL;
+}
 
-		if( !strcmp(argv[0], "rm") )
-		{
-			if( argc != 2 )
-			{
-				printf("usage: rm path\n");
-				continue;
-			}
+static double now(void)
+{
+	struct timespec ts;
 
-			sfs_rm(argv[1]);	
-			continue;	
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-		if( !strcmp(argv[0], "mv") )
-		{
-			if( argc != 3 )
-			{
-				printf("usage: mv src dst\n");
-				continue;
-			}
+/* Latency of every command that was run, and the totals, on stderr */
+static void cmd_report(void)
+{
+	unsigned long calls = 0;
+	double secs = 0;
+	unsigned i;
 
-			sfs_mv(argv[1], argv[2]);
+	fprintf(stderr, "%-8s %8s %12s %10s %10s\n",
+		"command", "calls", "total ms", "avg us", "max us");
+	for( i = 0; i < NCOMMANDS; i++ )
+	{
+		if( commands[i].calls == 0 )
 			continue;
-		}
+		fprintf(stderr, "%-8s %8lu %12.3f %10.1f %10.1f\n",
+			commands[i].name, commands[i].calls,
+			commands[i].secs * 1e3,
+			commands[i].secs * 1e6 / commands[i].calls,
+			commands[i].max * 1e6);
+		calls += commands[i].calls;
+		secs += commands[i].secs;
+	}
+	fprintf(stderr, "%-8s %8lu %12.3f %10.1f\n", "total", calls,
+		secs * 1e3, calls ? secs * 1e6 / calls : 0.0);
+}
 
-		if( !strcmp(argv[0], "cpin") )
+int main(int argc, char *argv[])
+{
+	char buf[256] = "";
+	int ac, ch, batch = 0, timing = 0;
+	char* av[MAX_ARGC];
+	struct command *c;
+	FILE *in = stdin;
+	double t;
+
+	while( (ch = getopt(argc, argv, "b:qt")) != -1 )
+	{
+		switch( ch )
 		{
-			if( argc != 3 )
+		case 'b':
+			in = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
+			if( in == NULL )
 			{
-				printf("usage: copyin local-file file(source)\n");
-				continue;
+				perror(optarg);
+				return 1;
 			}
-
-			sfs_cpin(argv[1], argv[2]);
-			continue;
+			batch = timing = 1;
+			break;
+		case 'q':
+			sfs_set_verbose(0);
+			break;
+		case 't':
+			timing = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: sfs [-q] [-t] [-b script]\n");
+			return 1;
 		}
+	}
+	cmd_init();
 
-		if( !strcmp(argv[0], "cpout") )
-		{
-			if( argc != 3 )
-			{
-				printf("usage: copyout local-file(source) file\n");
-				continue;
-			}
+	if( !batch )
+		printf("OS SFS shell\n");
 
-			sfs_cpout(argv[1], argv[2]);
-			continue;
-		}
+	while( !done && !feof(in) )
+	{
+		if( !batch )
+			printf("os_shell> ");
 
-		if( !strcmp(argv[0], "exit") )
-		{
-			printf("bye\n");
-			return 0;
-		}
+		// at end of input the shell has always rerun the last line
+		if( fgets(buf, sizeof(buf), in) == NULL && batch )
+			break;
 
-		if( !strcmp(argv[0], "fsck") )
-		{
-			sfs_fsck();
+		av[0] = strtok(buf, DELIMS);
+		if( !av[0] )
 			continue;
-		}
 
-		if( !strcmp(argv[0], "bitmap") )
+		ac = 1;
+		while( ac < MAX_ARGC && (av[ac] = strtok(NULL, DELIMS)) != NULL )
+			ac++;
+		if( ac < MAX_ARGC )
+			av[ac] = NULL;
+
+		c = cmd_lookup(av[0]);
+		if( c == NULL )
 		{
-			sfs_bitmap();
+			printf("%s command not found\n", av[0]);
 			continue;
 		}
-/*
-		if( !strcmp(argv[0], "fixdir") )
+		if( ac - 1 < c->minargs || ac - 1 > c->maxargs )
 		{
-			sfs_fixdir();
+			printf("usage: %s\n", c->usage);
 			continue;
 		}
-
-		if( !strcmp(argv[0], "fixfiles") )
+		if( c->needfs && !sfs_mounted() )
 		{
-			sfs_fixfiles();
+			printf("%s: no volume mounted\n", av[0]);
 			continue;
 		}
 
-		if( !strcmp(argv[0], "test") )
-		{
-			if(	argc != 2 )
-			{
-				printf("usage: test argv\n");
-				continue;
-			}
-
-			sfs_test(argv[1]);
-			continue;
-		}
-*/
-		printf("%s command not found\n", argv[0]);
+		t = now();
+		c->run(ac, av);
+		t = now() - t;
+		c->calls++;
+		c->secs += t;
+		if( t > c->max )
+			c->max = t;
 	}
 
+	if( !done )
+		sfs_sync();
+	if( timing )
+	{
+		fflush(stdout);
+		cmd_report();
+	}
 	return 0;
 }
@@ -0,0 +1,231 @@
+/*
+ * sfs_mkfs - create an empty SFS volume in an image file.
+ *
+ *	usage: sfs_mkfs [-f] [-e] [-b blocksize] [-j jblocks] [-n volname]
+ *		image nblocks
+ *
+ * Build with
+ *	gcc -o sfs_mkfs sfs_mkfs.c
+ *
+ * Layout: the superblock in block 0, the root directory inode in block 1
+ * (an inode's number is its block number), the free block bitmap from
+ * block 2, the journal if there is one (-j), and the root directory's
+ * first block.
+ * The image is extended with ftruncate(), so everything else is a hole
+ * that reads as zeroes; only those metadata blocks are written, and a
+ * multi-gigabyte image is formatted in a few writes.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "sfs_types.h"
+#include "sfs.h"
+
+static u_int32_t blocksize = SFS_BLOCKSIZE;
+static char *block;			/* one block of scratch space */
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "usage: sfs_mkfs [-f] [-e] [-b blocksize] "
+		"[-j jblocks] [-n volname] image nblocks\n");
+	exit(1);
+}
+
+static
+void
+write_block(int fd, u_int32_t b)
+{
+	ssize_t len;
+
+	len = pwrite(fd, block, blocksize, (off_t)b * blocksize);
+	if (len < 0) {
+		err(1, "block %u", b);
+	}
+	if ((u_int32_t)len != blocksize) {
+		errx(1, "block %u: short write", b);
+	}
+}
+
+/*
+ * Write the bitmap blocks that have bits set: those covering blocks 0
+ * through LAST, which are in use, and the one holding the bits past the
+ * end of the volume, which are set so that they are never allocated.
+ * The blocks in between are all zero and stay holes.
+ */
+static
+void
+write_bitmap(int fd, u_int32_t nblocks, u_int32_t nbm, u_int32_t last)
+{
+	u_int32_t bits = SFS_BITS(blocksize);
+	u_int32_t i, b, lo, hi;
+
+	for (i = 0; i < nbm; i++) {
+		lo = i * bits;
+		if (lo > last && (u_int64_t)lo + bits <= nblocks) {
+			continue;
+		}
+		memset(block, 0, blocksize);
+		for (b = 0; b < bits; b++) {
+			hi = lo + b;
+			if (hi <= last || hi >= nblocks) {
+				block[b / CHAR_BIT] |= 1 << (b % CHAR_BIT);
+			}
+		}
+		write_block(fd, SFS_MAP_LOCATION + i);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sfs_super sp;
+	struct sfs_jheader jh;
+	struct sfs_inode si;
+	struct sfs_dir *sd;
+	const char *volname = "SFS_VOLUME";
+	const char *path;
+	char *end;
+	unsigned long n;
+	u_int32_t nblocks, nbm, rootdir, jblocks = 0, features = 0;
+	int ch, fd, oflags = O_WRONLY|O_CREAT|O_EXCL;
+
+	while ((ch = getopt(argc, argv, "feb:j:n:")) != -1) {
+		switch (ch) {
+		    case 'f':
+			oflags &= ~O_EXCL;
+			oflags |= O_TRUNC;
+			break;
+		    case 'e':
+			features |= SFS_FEAT_EXTENTS;
+			break;
+		    case 'b':
+			n = strtoul(optarg, &end, 0);
+			if (*end || n < SFS_BLOCKSIZE || n > SFS_MAXBLOCKSIZE ||
+			    (n & (n - 1))) {
+				errx(1, "%s: block size must be a power of 2 "
+				     "from %d to %d", optarg, SFS_BLOCKSIZE,
+				     SFS_MAXBLOCKSIZE);
+			}
+			blocksize = n;
+			break;
+		    case 'j':
+			n = strtoul(optarg, &end, 0);
+			if (*end || n < SFS_JMINBLOCKS || n > 0xffffffUL) {
+				errx(1, "%s: journal must be at least %d blocks",
+				     optarg, SFS_JMINBLOCKS);
+			}
+			jblocks = n;
+			features |= SFS_FEAT_JOURNAL;
+			break;
+		    case 'n':
+			if (strlen(optarg) >= SFS_VOLNAME_SIZE) {
+				errx(1, "%s: volume name too long", optarg);
+			}
+			volname = optarg;
+			break;
+		    default:
+			usage();
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+	}
+	path = argv[optind];
+
+	n = strtoul(argv[optind+1], &end, 0);
+	if (*end || n == 0 || n > 0xffffffffUL) {
+		errx(1, "%s: invalid number of blocks", argv[optind+1]);
+	}
+	nblocks = n;
+
+	nbm = (nblocks + SFS_BITS(blocksize) - 1) / SFS_BITS(blocksize);
+	if (jblocks > 0 && jblocks < SFS_JOPBLOCKS + nbm) {
+		errx(1, "%u: journal must be at least %u blocks for %u blocks",
+		     jblocks, SFS_JOPBLOCKS + nbm, nblocks);
+	}
+	rootdir = SFS_MAP_LOCATION + nbm + jblocks;
+	if ((u_int64_t)rootdir >= nblocks) {
+		errx(1, "%u blocks: too small, need at least %u", nblocks,
+		     rootdir + 1);
+	}
+
+	block = malloc(blocksize);
+	if (block == NULL) {
+		err(1, "malloc");
+	}
+
+	fd = open(path, oflags, 0644);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+	if (ftruncate(fd, (off_t)nblocks * blocksize)) {
+		err(1, "%s: ftruncate", path);
+	}
+
+	/* Superblock; the free count is exact, so mount can trust it */
+	memset(&sp, 0, sizeof(sp));
+	sp.sp_magic = SFS_MAGIC;
+	sp.sp_nblocks = nblocks;
+	strcpy(sp.sp_volname, volname);
+	sp.sp_features = SFS_FEAT_FREECOUNT | features;
+	sp.sp_nfree = nblocks - (rootdir + 1);
+	sp.sp_allochint = 0;
+	sp.sp_blocksize = blocksize == SFS_BLOCKSIZE ? 0 : blocksize;
+	if (jblocks > 0) {
+		sp.sp_jstart = SFS_MAP_LOCATION + nbm;
+		sp.sp_jblocks = jblocks;
+	}
+	memset(block, 0, blocksize);
+	memcpy(block, &sp, sizeof(sp));
+	write_block(fd, SFS_SB_LOCATION);
+
+	/* Root inode, holding "." and ".." */
+	memset(&si, 0, sizeof(si));
+	si.sfi_size = 2 * sizeof(struct sfs_dir);
+	si.sfi_type = SFS_TYPE_DIR;
+	si.sfi_direct[0] = rootdir;
+	memset(block, 0, blocksize);
+	memcpy(block, &si, sizeof(si));
+	write_block(fd, SFS_ROOT_LOCATION);
+
+	write_bitmap(fd, nblocks, nbm, rootdir);
+
+	/* Empty journal: only the header, the log is a hole */
+	if (jblocks > 0) {
+		memset(&jh, 0, sizeof(jh));
+		jh.sjh_magic = SFS_JMAGIC_HEAD;
+		jh.sjh_seq = 1;
+		memset(block, 0, blocksize);
+		memcpy(block, &jh, sizeof(jh));
+		write_block(fd, sp.sp_jstart);
+	}
+
+	/* Root directory block */
+	memset(block, 0, blocksize);
+	sd = (struct sfs_dir *)block;
+	sd[0].sfd_ino = SFS_ROOT_LOCATION;
+	strcpy(sd[0].sfd_name, ".");
+	sd[0].sfd_name[SFS_DTYPE_OFF] = SFS_TYPE_DIR;
+	sd[1].sfd_ino = SFS_ROOT_LOCATION;
+	strcpy(sd[1].sfd_name, "..");
+	sd[1].sfd_name[SFS_DTYPE_OFF] = SFS_TYPE_DIR;
+	write_block(fd, rootdir);
+
+	if (fsync(fd) || close(fd)) {
+		err(1, "%s", path);
+	}
+	free(block);
+
+	printf("%s: %u blocks of %u bytes, %u bitmap block%s, %u free\n",
+	       path, nblocks, blocksize, nbm, nbm == 1 ? "" : "s",
+	       sp.sp_nfree);
+	return 0;
+}
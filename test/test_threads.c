@@ -0,0 +1,148 @@
+/*
+ * test_threads - lookups and reads through the handle API while other
+ * threads create, fill and remove files with the shell commands.
+ *
+ *	usage: test_threads image hostfile
+ *
+ * Build from the top directory with
+ *	gcc -I. -o test_threads test/test_threads.c sfs_disk.c sfs_func_hw.c
+ *		-pthread [-fsanitize=thread]
+ *
+ * The image should be empty (sfs_mkfs). HOSTFILE is copied in as r0 to
+ * r3 first; the readers check every byte they read against it, and
+ * that inodes which are not files or directories are refused. The
+ * volume is checked at the end. Prints "ok" when all went well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs_types.h"
+#include "sfs_func.h"
+#include "sfs.h"
+
+#define NREADERS	4
+#define NWRITERS	4
+#define NFILES		4
+#define ROUNDS		200
+
+static struct sfs_fs *fs;
+static const char *host;
+static char *ref;
+static size_t reflen;
+static int failed;
+
+static void fail(const char *what, long id)
+{
+	printf("thread %ld: %s\n", id, what);
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void *reader(void *arg)
+{
+	long id = (long)arg;
+	char name[16], *buf;
+	u_int32_t ino, size, off;
+	size_t len;
+	ssize_t n;
+	int type, k, i;
+
+	buf = malloc(reflen);
+	for (k = 0; k < ROUNDS && !failed; k++) {
+		for (i = 0; i < NFILES; i++) {
+			sprintf(name, "r%d", i);
+			if (sfs_fs_lookup(fs, SFS_ROOT_LOCATION, name, &ino)) {
+				fail("lookup failed", id);
+				break;
+			}
+			if (sfs_fs_stat(fs, ino, &size, &type) != 0 ||
+			    size != reflen || type != SFS_TYPE_FILE) {
+				fail("stat returned the wrong size or type", id);
+				break;
+			}
+			off = (k * 37 + id * 101) % reflen;
+			len = (k * 713) % (reflen - off) + 1;
+			n = sfs_fs_read(fs, ino, buf, len, off);
+			if (n != (ssize_t)len || memcmp(buf, ref + off, len)) {
+				fail("read returned the wrong data", id);
+				break;
+			}
+		}
+		// superblock, bitmap, past the end: not inodes
+		if (sfs_fs_stat(fs, SFS_SB_LOCATION, &size, &type) != -1 ||
+		    sfs_fs_stat(fs, SFS_MAP_LOCATION, &size, &type) != -1 ||
+		    sfs_fs_read(fs, 0xfffffff0, buf, 1, 0) != -1 ||
+		    sfs_fs_lookup(fs, 0xfffffff0, "r0", &ino) != -1)
+			fail("a bad inode number was accepted", id);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	long id = (long)arg;
+	char name[16];
+	int k;
+
+	for (k = 0; k < ROUNDS / 4 && !failed; k++) {
+		sprintf(name, "w%ld_%d", id, k);
+		sfs_touch(name);
+		sfs_rm(name);
+		sfs_cpin(name, host);
+		if (k % 2)
+			sfs_rm(name);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t[NREADERS + NWRITERS];
+	char name[16];
+	FILE *f;
+	long i;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: test_threads image hostfile\n");
+		return 1;
+	}
+	host = argv[2];
+	f = fopen(host, "rb");
+	if (f == NULL) {
+		perror(host);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	reflen = ftell(f);
+	rewind(f);
+	ref = malloc(reflen);
+	if (reflen == 0 || fread(ref, 1, reflen, f) != reflen) {
+		fprintf(stderr, "%s: empty or unreadable\n", host);
+		return 1;
+	}
+	fclose(f);
+
+	sfs_set_verbose(0);
+	sfs_mount(argv[1]);
+	fs = sfs_fs_current();
+	if (fs == NULL)
+		return 1;
+	for (i = 0; i < NFILES; i++) {
+		sprintf(name, "r%ld", i);
+		sfs_cpin(name, host);
+	}
+
+	for (i = 0; i < NREADERS; i++)
+		pthread_create(&t[i], NULL, reader, (void *)i);
+	for (i = 0; i < NWRITERS; i++)
+		pthread_create(&t[NREADERS + i], NULL, writer, (void *)i);
+	for (i = 0; i < NREADERS + NWRITERS; i++)
+		pthread_join(t[i], NULL);
+
+	sfs_fsck_opt(SFS_FSCK_QUIET);
+	sfs_umount();
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}